@@ -3,11 +3,17 @@ mkdir build
 pushd build
 call cl -FC -nologo -Zi -Od ..\pmctrace_simple_test.cpp -Fepmctrace_simple_test_dm.exe
 call cl -FC -nologo -Zi -O2 ..\pmctrace_simple_test.cpp -Fepmctrace_simple_test_rm.exe
+call cl -FC -nologo -Zi -O2 ..\pmctrace_debug_decode.cpp -Fepmctrace_debug_decode.exe
+call cl -FC -nologo -Zi -O2 ..\pmctrace_compare.cpp -Fepmctrace_compare.exe
+call cl -FC -nologo -Zi -O2 ..\pmctrace_query.cpp -Fepmctrace_query.exe
+call cl -FC -nologo -Zi -O2 ..\pmctrace_daemon.cpp -Fepmctrace_daemon.exe
+call cl -FC -nologo -Zi -O2 ..\pmctrace_overhead_test.cpp -Fepmctrace_overhead_test.exe
 
-where /q nasm || (echo WARNING: nasm not found -- threaded test will not be built)
+where /q nasm || (echo WARNING: nasm not found -- threaded and validation tests will not be built)
 call nasm -f win64 ..\pmctrace_test_asm.asm -o pmctrace_test_asm.obj
 call lib -nologo pmctrace_test_asm.obj
 call cl -FC -nologo -Zi -Od ..\pmctrace_threaded_test.cpp -Fepmctrace_threaded_test_dm.exe
 call cl -FC -nologo -Zi -O2 ..\pmctrace_threaded_test.cpp -Fepmctrace_threaded_test_rm.exe
+call cl -FC -nologo -Zi -O2 ..\pmctrace_validation_test.cpp -Fepmctrace_validation_test.exe
 
 popd build
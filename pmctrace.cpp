@@ -14,15 +14,34 @@
 #define PMC_DEBUG_LOG 0
 #endif
 
+// NOTE: The debug log is a ring of fixed-size binary records, so it always holds the most recent
+// PMC_DEBUG_LOG_ENTRY_COUNT events. It is only turned into text when GetDebugLog is called (or when a
+// file written by SaveDebugLog is run through pmctrace_debug_decode).
+#if !defined(PMC_DEBUG_LOG_ENTRY_COUNT)
+#define PMC_DEBUG_LOG_ENTRY_COUNT (4*1024*1024)
+#endif
+
+// NOTE: Error entries refer to their message by index into a table of distinct messages, which is saved along with
+// the log. Every message passed to TraceError is a string literal, so this only has to be as large as the number of
+// different errors.
+#define PMC_DEBUG_LOG_MESSAGE_COUNT 64
+
+// NOTE: A daemon's session has a name of its own, so the orphan cleanup in a plain StartTracing never stops it,
+// and the mutex tells a starting daemon whether the session under that name belongs to a live daemon
+#define PMC_TRACE_NAME L"Win32PMCTrace"
+#define PMC_DAEMON_TRACE_NAME L"Win32PMCTraceDaemon"
+#define PMC_DAEMON_MUTEX_NAME L"Global\\Win32PMCTraceDaemon"
+
+// NOTE: How long ConnectToPMCDaemon waits for a daemon to hand out its logger handle and attach the client
+#if !defined(PMC_DAEMON_CONNECT_TIMEOUT_MS)
+#define PMC_DAEMON_CONNECT_TIMEOUT_MS 2000
+#endif
+
 #if PMC_DEBUG_LOG
-#define DEBUG_PRINT(Format, ...) \
-{ \
-    u64 Max = Tracer->LogEnd - Tracer->LogAt; \
-    u64 Temp = snprintf(Tracer->LogAt, Max, Format, __VA_ARGS__); \
-    if((Temp > 0) && (Temp < Max)) {Tracer->LogAt += Temp;} \
-}
+#define DEBUG_LOG(Kind, Region, OldThreadID, NewThreadID, Counters) \
+    LogDebugEvent(Tracer, Kind, CPUID, TSC, OldThreadID, NewThreadID, Region, Counters)
 #else
-#define DEBUG_PRINT(...)
+#define DEBUG_LOG(...)
 #endif
 
 enum trace_marker_type : u32
@@ -31,10 +50,70 @@ enum trace_marker_type : u32
 
     TraceMarker_Open,
     TraceMarker_Close,
+    TraceMarker_Suspend,
+    TraceMarker_Resume,
+    TraceMarker_OpenAccumulating,
+    TraceMarker_Flush,
+    TraceMarker_Lap,
+    TraceMarker_Attach,
+    TraceMarker_Detach,
 
     TraceMarker_Count,
 };
 
+enum pmc_debug_log_kind : u32
+{
+    DebugLog_None,
+
+    DebugLog_Error,
+    DebugLog_Open,
+    DebugLog_Close,
+    DebugLog_Suspend,
+    DebugLog_Resume,
+    DebugLog_Lap,
+    DebugLog_SwitchFrom,
+    DebugLog_SwitchTo,
+    DebugLog_SysEnter,
+    DebugLog_SysExit,
+    DebugLog_Flush,
+
+    DebugLog_Count,
+};
+
+struct pmc_debug_log_entry
+{
+    u64 TSC;
+    u64 Region;
+    union
+    {
+        u64 Counters[MAX_TRACE_PMC_COUNT];
+        u64 MessageIndex; // NOTE: Only for DebugLog_Error
+    };
+    u32 Kind;
+    u32 CPU;
+    u32 OldThreadID;
+    u32 NewThreadID;
+};
+
+// NOTE: Every string GetDebugLog returns is kept on a list until StopTracing, so callers never hold a freed one
+struct pmc_debug_log_text
+{
+    pmc_debug_log_text *Prev;
+};
+
+#define PMC_DEBUG_LOG_FILE_MAGIC 0x4c434d50 // NOTE: "PMCL"
+#define PMC_DEBUG_LOG_FILE_VERSION 2
+struct pmc_debug_log_file_header
+{
+    u32 Magic;
+    u32 Version;
+    u32 PMCCount;
+    u32 EntrySize;
+    u64 EntryCount;
+    u32 MessageCount;
+    u32 MessageSize; // NOTE: The terminated messages come between the header and the entries, MessageSize bytes in all
+};
+
 struct win32_trace_description
 {
     EVENT_TRACE_PROPERTIES_V2 Properties;
@@ -45,6 +124,7 @@ struct pmc_tracer_etw_marker_userdata
 {
     u64 TraceKey;
     pmc_traced_region *Dest;
+    u64 Payload; // NOTE: Only used by TraceMarker_Attach, which sends the client's section handle
 };
 struct pmc_tracer_etw_marker
 {
@@ -58,6 +138,14 @@ struct etw_thread_switch_userdata
     DWORD OldThreadId;
 };
 
+struct etw_sampled_profile_userdata
+{
+    ULONG64 InstructionPointer;
+    DWORD ThreadId;
+    USHORT CountOrSource;
+    USHORT Reserved;
+};
+
 struct pmc_tracer_cpu
 {
     pmc_traced_region *FirstRunningRegion;
@@ -68,6 +156,71 @@ struct pmc_tracer_cpu
     b32 LastSysEnterValid;
 };
 
+// NOTE: A daemon client's regions live in a section shared with the daemon, which begins with this header.
+// The client fills in Size before attaching; the daemon fills in PMCCount and then sets Attached.
+#define PMC_SHARED_HEADER_SIZE 64
+struct pmc_shared_client_header
+{
+    u64 Size;
+    u32 PMCCount;
+    u32 CoreCycleIndex;
+    b32 HasCoreCycles; // NOTE: Set when the daemon counts core cycles with a PMC, at CoreCycleIndex
+    u32 volatile Attached;
+};
+
+#define MAX_PMC_CLIENT_COUNT 64
+
+// NOTE: How many distinct regions (by offset in its section) one client can use before its markers are rejected
+#define MAX_PMC_CLIENT_REGION_COUNT 512
+
+enum pmc_client_region_state : u32
+{
+    ClientRegion_Closed,
+    ClientRegion_Running, // NOTE: On a running list or the suspended list
+    ClientRegion_Suspended, // NOTE: Suspended by the task itself, so on no list at all
+};
+
+// NOTE: The daemon's own copy of a client region. This is what goes on the running and suspended lists, so every
+// link, pointer and thread or CPU index the processing thread follows lives in daemon memory, not in the section.
+// All kinds of region begin with a pmc_traced_region, so one shadow can stand in for any of them.
+struct pmc_shared_client;
+struct pmc_client_region
+{
+    union
+    {
+        pmc_traced_region Region;
+        pmc_phased_region Phased;
+        pmc_accumulated_region Accumulated;
+    };
+
+    pmc_shared_client *Client;
+    u64 Offset; // NOTE: Of the client's region in its section
+    u64 TimelineOffset; // NOTE: Of the client's timeline in its section, if it has one
+    pmc_timeline *Timeline; // NOTE: The daemon's copy, allocated the first time the region has a timeline
+    pmc_client_region_state State;
+    b32 Accumulating;
+};
+
+struct pmc_shared_client
+{
+    u64 TraceKey;
+    u32 ProcessID;
+    HANDLE Process; // NOTE: Signaled when the client exits, whether or not it detached first
+    HANDLE Section;
+    u8 *View;
+    u8 *ClientBase;
+    u64 Size;
+
+    pmc_client_region *RegionStore; // NOTE: [MAX_PMC_CLIENT_REGION_COUNT]
+    u32 RegionCount;
+    pmc_client_region *RegionTable[2*MAX_PMC_CLIENT_REGION_COUNT]; // NOTE: Open addressed by Offset
+};
+
+// NOTE: rdpru register 0 is MPERF and register 1 is APERF
+#define RDPRU_MPERF 0
+#define RDPRU_APERF 1
+typedef u64 rdpru_function(u32 Register);
+
 #define PMC_TRACE_RESULT_MASK 0xff
 struct pmc_tracer
 {
@@ -78,6 +231,9 @@ struct pmc_tracer
     HANDLE ProcessingThread;
 
     pmc_source_mapping Mapping;
+    pmc_sampling_mapping Sampling;
+    TRACE_PROFILE_INTERVAL SavedSamplingInterval; // NOTE: The machine-wide interval to put back, if SamplingIntervalSet
+    b32 SamplingIntervalSet;
     pmc_tracer_cpu *CPUs; // NOTE(casey): [CPUCount]
     pmc_traced_region *FirstSuspendedRegion;
 
@@ -88,16 +244,70 @@ struct pmc_tracer
 
     u64 TraceKey;
 
+    pmc_trigger Triggers[MAX_PMC_TRIGGER_COUNT];
+    u64 LastTriggerCaptureTSC[MAX_PMC_TRIGGER_COUNT];
+    u32 volatile TriggerCount; // NOTE: Triggers the processing thread may read
+    LONG volatile ReservedTriggerCount; // NOTE: Slots handed out by AddPMCTrigger, which may not be written yet
+
+    pmc_capture *Captures; // NOTE: [PMC_CAPTURE_QUEUE_SIZE]
+    u64 volatile CaptureWriteIndex;
+    u64 volatile CaptureReadIndex;
+    u64 DroppedCaptureCount;
+
+    pmc_ip_sample *Samples; // NOTE: [PMC_SAMPLE_QUEUE_SIZE]
+    u64 volatile SampleWriteIndex;
+    u64 volatile SampleReadIndex;
+    u64 DroppedSampleCount;
+
+    pmc_tracer_stats Stats;
+    u64 StartTSC;
+    u64 StartQPC;
+
+    // NOTE: A daemon serves markers from the clients in its table. A client instead owns no session at all:
+    // its TraceHandle is the logger handle the daemon enabled it with, and its regions come from SharedBase.
+    b32 volatile ServesClients;
+    pmc_shared_client *Clients; // NOTE: [MAX_PMC_CLIENT_COUNT]
+    u64 RejectedClientMarkerCount;
+
+    b32 SyncPMCsEnabled;
+
+    pmc_core_cycle_source CoreCycleSource;
+    rdpru_function *ReadPRU;
+
+    pmc_site_aggregates *volatile Aggregates; // NOTE: [2]
+    u32 volatile ActiveAggregateIndex;
+    u32 volatile AggregateInUse; // NOTE: 1 + the index the processing thread is adding to, or 0
+
+    HANDLE DaemonMutex; // NOTE: Held for as long as this tracer is the daemon
+
+    b32 IsClient;
+    HANDLE SharedSection;
+    u8 *SharedBase;
+    u64 SharedSize;
+    u64 volatile SharedUsed;
+
+    DWORD ProcessingThreadID;
+
 #if PMC_DEBUG_LOG
-    char *Log;
-    char *LogAt;
-    char *LogEnd;
+    // NOTE: Only the processing thread writes the ring. Errors raised on other threads are parked in UnloggedError
+    // for it to log, and readers hold LogReaderCount while they look at the ring, during which events are dropped.
+    pmc_debug_log_entry *Log; // NOTE: [PMC_DEBUG_LOG_ENTRY_COUNT]
+    u64 volatile LogWriteIndex;
+    u64 LogDroppedCount;
+    u32 volatile LogWriterActive;
+    LONG volatile LogReaderCount;
+    char const *volatile UnloggedError;
+    char const *LogMessages[PMC_DEBUG_LOG_MESSAGE_COUNT]; // NOTE: Only added to while no reader holds the ring
+    u32 LogMessageCount;
+    pmc_debug_log_text *LogText;
 #endif
 };
 
 #define WIN32_TRACE_OPCODE_SWITCH_THREAD 36
 #define WIN32_TRACE_OPCODE_SYSTEMCALL_ENTER 51
 #define WIN32_TRACE_OPCODE_SYSTEMCALL_EXIT 52
+#define WIN32_TRACE_OPCODE_SAMPLED_PROFILE 46
+#define WIN32_TRACE_OPCODE_PMC_INTERRUPT 47
 
 static GUID Win32ThreadEventGuid = {0x3d6fa8d1, 0xfe05, 0x11d0, {0x9d, 0xda, 0x00, 0xc0, 0x4f, 0xd7, 0xba, 0x7c}};
 static GUID Win32DPCEventGuid = {0xce1dbfb4, 0x137e, 0x4da6, {0x87, 0xb0, 0x3f, 0x59, 0xaa, 0x10, 0x2c, 0xbc}};
@@ -139,18 +349,321 @@ static char const *GetErrorMessage(pmc_tracer *Tracer)
     return Result;
 }
 
+static char const *GetDebugLogKindName(u32 Kind)
+{
+    char const *Names[] =
+    {
+        "NONE",
+        "ERROR",
+        "OPEN",
+        "CLOSE",
+        "SUSPEND",
+        "RESUME",
+        "LAP",
+        "SWITCH FROM",
+        "SWITCH TO",
+        "ENTER",
+        "EXIT",
+        "FLUSH",
+    };
+
+    char const *Result = (Kind < ArrayCount(Names)) ? Names[Kind] : "UNKNOWN";
+    return Result;
+}
+
+static b32 DebugLogKindHasCounters(u32 Kind)
+{
+    b32 Result = ((Kind == DebugLog_Close) ||
+                  (Kind == DebugLog_Suspend) ||
+                  (Kind == DebugLog_Lap) ||
+                  (Kind == DebugLog_SwitchFrom) ||
+                  (Kind == DebugLog_SwitchTo) ||
+                  (Kind == DebugLog_SysEnter) ||
+                  (Kind == DebugLog_SysExit) ||
+                  (Kind == DebugLog_Flush));
+    return Result;
+}
+
+// NOTE: Returns the number of characters written, not including the terminator. The output is always
+// terminated as long as Max is non-zero.
+static u64 FormatDebugLogEntry(char *Dest, u64 Max, pmc_debug_log_entry *Entry, u32 PMCCount,
+                               char const **Messages, u32 MessageCount)
+{
+    u64 Result = 0;
+
+    if(Max)
+    {
+        int Temp;
+        if(Entry->Kind == DebugLog_Error)
+        {
+            char const *Message = "(more distinct errors than the log keeps messages for)";
+            if(Entry->MessageIndex < MessageCount)
+            {
+                Message = Messages[Entry->MessageIndex];
+            }
+            Temp = snprintf(Dest, Max, "%llu %s: %s\n", Entry->TSC, GetDebugLogKindName(Entry->Kind), Message);
+        }
+        else
+        {
+            Temp = snprintf(Dest, Max, "%llu CPU%u %s [%u -> %u] region %llx", Entry->TSC, Entry->CPU,
+                            GetDebugLogKindName(Entry->Kind), Entry->OldThreadID, Entry->NewThreadID, Entry->Region);
+        }
+
+        if((Temp > 0) && ((u64)Temp < Max))
+        {
+            Result += Temp;
+        }
+
+        if((Entry->Kind != DebugLog_Error) && (PMCCount <= MAX_TRACE_PMC_COUNT))
+        {
+            if(DebugLogKindHasCounters(Entry->Kind))
+            {
+                for(u32 PMCIndex = 0; PMCIndex < PMCCount; ++PMCIndex)
+                {
+                    Temp = snprintf(Dest + Result, Max - Result, " %llu", Entry->Counters[PMCIndex]);
+                    if((Temp > 0) && ((u64)Temp < (Max - Result)))
+                    {
+                        Result += Temp;
+                    }
+                }
+            }
+
+            Temp = snprintf(Dest + Result, Max - Result, "\n");
+            if((Temp > 0) && ((u64)Temp < (Max - Result)))
+            {
+                Result += Temp;
+            }
+        }
+    }
+
+    return Result;
+}
+
+#if PMC_DEBUG_LOG
+static pmc_debug_log_entry *GetDebugLogEntry(pmc_tracer *Tracer, u64 Index)
+{
+    pmc_debug_log_entry *Result = Tracer->Log + (Index % PMC_DEBUG_LOG_ENTRY_COUNT);
+    return Result;
+}
+
+static u64 GetFirstDebugLogIndex(pmc_tracer *Tracer)
+{
+    u64 Result = 0;
+    if(Tracer->LogWriteIndex > PMC_DEBUG_LOG_ENTRY_COUNT)
+    {
+        Result = Tracer->LogWriteIndex - PMC_DEBUG_LOG_ENTRY_COUNT;
+    }
+    return Result;
+}
+
+static pmc_debug_log_entry *BeginDebugLogEntry(pmc_tracer *Tracer)
+{
+    // NOTE: The writer announces itself before checking for readers, and readers announce themselves before
+    // checking for the writer (the same handshake as the aggregates), so one side always sees the other
+    pmc_debug_log_entry *Result = 0;
+    if(Tracer->Log)
+    {
+        Tracer->LogWriterActive = true;
+        _mm_mfence();
+        if(Tracer->LogReaderCount)
+        {
+            ++Tracer->LogDroppedCount;
+            Tracer->LogWriterActive = false;
+        }
+        else
+        {
+            Result = GetDebugLogEntry(Tracer, Tracer->LogWriteIndex);
+        }
+    }
+
+    return Result;
+}
+
+static void EndDebugLogEntry(pmc_tracer *Tracer)
+{
+    ++Tracer->LogWriteIndex;
+    _mm_sfence();
+    Tracer->LogWriterActive = false;
+}
+
+static void BeginDebugLogRead(pmc_tracer *Tracer)
+{
+    InterlockedIncrement(&Tracer->LogReaderCount);
+    while(Tracer->LogWriterActive)
+    {
+        _mm_pause();
+    }
+    _mm_mfence();
+}
+
+static void EndDebugLogRead(pmc_tracer *Tracer)
+{
+    InterlockedDecrement(&Tracer->LogReaderCount);
+}
+
+static void LogDebugError(pmc_tracer *Tracer, char const *Message)
+{
+    pmc_debug_log_entry *Entry = BeginDebugLogEntry(Tracer);
+    if(Entry)
+    {
+        *Entry = {};
+        Entry->TSC = __rdtsc();
+        Entry->Kind = DebugLog_Error;
+
+        // NOTE: The table only changes here, after BeginDebugLogEntry has made sure no reader is looking at it
+        u32 MessageIndex = 0;
+        while((MessageIndex < Tracer->LogMessageCount) && (Tracer->LogMessages[MessageIndex] != Message))
+        {
+            ++MessageIndex;
+        }
+        if((MessageIndex == Tracer->LogMessageCount) && (MessageIndex < ArrayCount(Tracer->LogMessages)))
+        {
+            Tracer->LogMessages[Tracer->LogMessageCount++] = Message;
+        }
+        Entry->MessageIndex = MessageIndex;
+
+        EndDebugLogEntry(Tracer);
+    }
+}
+
+static void LogDebugEvent(pmc_tracer *Tracer, pmc_debug_log_kind Kind, u32 CPU, u64 TSC,
+                          u32 OldThreadID, u32 NewThreadID, pmc_traced_region *Region, u64 *Counters)
+{
+    pmc_debug_log_entry *Entry = BeginDebugLogEntry(Tracer);
+    if(Entry)
+    {
+        Entry->TSC = TSC;
+        Entry->Region = (u64)Region;
+        Entry->Kind = Kind;
+        Entry->CPU = CPU;
+        Entry->OldThreadID = OldThreadID;
+        Entry->NewThreadID = NewThreadID;
+        for(u32 PMCIndex = 0; PMCIndex < MAX_TRACE_PMC_COUNT; ++PMCIndex)
+        {
+            Entry->Counters[PMCIndex] = Counters ? Counters[PMCIndex] : 0;
+        }
+        EndDebugLogEntry(Tracer);
+    }
+}
+#endif
+
 static char const *GetDebugLog(pmc_tracer *Tracer)
 {
     char const *Result = "(debug log not enabled - define PMC_DEBUG_LOG to 1 to enable)";
 #if PMC_DEBUG_LOG
-    Result = Tracer->Log;
+    Result = "(unable to allocate debug log text)";
+    if(Tracer->Log)
+    {
+        BeginDebugLogRead(Tracer);
+
+        // NOTE: Formatting is deferred until someone actually asks for the log, so the processing thread
+        // only ever pays for copying a fixed-size record per event. Each entry is formatted once to measure
+        // the text and once more to write it, so the allocation is only as large as the entries written.
+        u64 FirstIndex = GetFirstDebugLogIndex(Tracer);
+        u64 OnePastLastIndex = Tracer->LogWriteIndex;
+        u32 PMCCount = Tracer->Mapping.PMCCount;
+
+        char DroppedText[96] = {};
+        if(Tracer->LogDroppedCount)
+        {
+            snprintf(DroppedText, sizeof(DroppedText), "(%llu events were not logged while the log was being read)\n",
+                     Tracer->LogDroppedCount);
+        }
+
+        char EntryText[128 + 24*MAX_TRACE_PMC_COUNT];
+        u64 TextSize = strlen(DroppedText) + 1;
+        for(u64 Index = FirstIndex; Index < OnePastLastIndex; ++Index)
+        {
+            TextSize += FormatDebugLogEntry(EntryText, sizeof(EntryText), GetDebugLogEntry(Tracer, Index), PMCCount,
+                                            Tracer->LogMessages, Tracer->LogMessageCount);
+        }
+
+        pmc_debug_log_text *Text = (pmc_debug_log_text *)Win32AllocateSize(sizeof(pmc_debug_log_text) + TextSize);
+        if(Text)
+        {
+            char *At = (char *)(Text + 1);
+            char *End = At + TextSize;
+            At += snprintf(At, End - At, "%s", DroppedText);
+            for(u64 Index = FirstIndex; Index < OnePastLastIndex; ++Index)
+            {
+                At += FormatDebugLogEntry(At, End - At, GetDebugLogEntry(Tracer, Index), PMCCount,
+                                          Tracer->LogMessages, Tracer->LogMessageCount);
+            }
+
+            Text->Prev = Tracer->LogText;
+            Tracer->LogText = Text;
+            Result = (char const *)(Text + 1);
+        }
+
+        EndDebugLogRead(Tracer);
+    }
+#endif
+    return Result;
+}
+
+static b32 SaveDebugLog(pmc_tracer *Tracer, char const *FileName)
+{
+    b32 Result = false;
+#if PMC_DEBUG_LOG
+    if(Tracer->Log)
+    {
+        FILE *File = fopen(FileName, "wb");
+        if(File)
+        {
+            BeginDebugLogRead(Tracer);
+
+            u64 FirstIndex = GetFirstDebugLogIndex(Tracer);
+            u64 OnePastLastIndex = Tracer->LogWriteIndex;
+
+            pmc_debug_log_file_header Header = {};
+            Header.Magic = PMC_DEBUG_LOG_FILE_MAGIC;
+            Header.Version = PMC_DEBUG_LOG_FILE_VERSION;
+            Header.PMCCount = Tracer->Mapping.PMCCount;
+            Header.EntrySize = sizeof(pmc_debug_log_entry);
+            Header.EntryCount = OnePastLastIndex - FirstIndex;
+            Header.MessageCount = Tracer->LogMessageCount;
+            for(u32 MessageIndex = 0; MessageIndex < Tracer->LogMessageCount; ++MessageIndex)
+            {
+                Header.MessageSize += (u32)strlen(Tracer->LogMessages[MessageIndex]) + 1;
+            }
+
+            Result = (fwrite(&Header, sizeof(Header), 1, File) == 1);
+            for(u32 MessageIndex = 0; Result && (MessageIndex < Tracer->LogMessageCount); ++MessageIndex)
+            {
+                char const *Message = Tracer->LogMessages[MessageIndex];
+                Result = (fwrite(Message, strlen(Message) + 1, 1, File) == 1);
+            }
+            for(u64 Index = FirstIndex; Result && (Index < OnePastLastIndex); ++Index)
+            {
+                Result = (fwrite(GetDebugLogEntry(Tracer, Index), sizeof(pmc_debug_log_entry), 1, File) == 1);
+            }
+
+            EndDebugLogRead(Tracer);
+
+            if(fclose(File) != 0)
+            {
+                Result = false;
+            }
+        }
+    }
 #endif
     return Result;
 }
 
 static void TraceError(pmc_tracer *Tracer, char const *Message)
 {
-    DEBUG_PRINT("%s\n", Message);
+#if PMC_DEBUG_LOG
+    // NOTE: Errors can be raised on instrumented threads, which must not touch the ring, so the processing thread
+    // logs those the next time it handles an event. Only one is parked at a time, the rest are dropped.
+    if(GetCurrentThreadId() == Tracer->ProcessingThreadID)
+    {
+        LogDebugError(Tracer, Message);
+    }
+    else
+    {
+        InterlockedCompareExchangePointer((void *volatile *)&Tracer->UnloggedError, (void *)Message, 0);
+    }
+#endif
     if(!Tracer->Error)
     {
         Tracer->Error = true;
@@ -217,489 +730,2356 @@ static void ApplyPMCsAsClose(pmc_traced_region *Region, u32 PMCCount, u64 *PMCDa
     Results->TSCElapsed += TSC;
 }
 
-static void CALLBACK Win32ProcessETWEvent(EVENT_RECORD *Event)
+static void ApplyKernelPMCsAsOpen(pmc_traced_region *Region, u32 PMCCount, u64 *PMCData, u64 TSC)
 {
-    pmc_tracer *Tracer = (pmc_tracer *)Event->UserContext;
-
-    GUID EventGUID = Event->EventHeader.ProviderId;
-	UCHAR Opcode = Event->EventHeader.EventDescriptor.Opcode;
-    u32 CPUID = GetEventProcessorIndex(Event);
-    u32 PMCCount = Tracer->Mapping.PMCCount;
-    u64 TSC = Event->EventHeader.TimeStamp.QuadPart;
-    u64 PMCData[MAX_TRACE_PMC_COUNT] = {};
+    pmc_trace_result *Results = &Region->Results;
 
-    if(CPUID < Tracer->CPUCount)
+    for(u32 PMCIndex = 0; PMCIndex < PMCCount; ++PMCIndex)
     {
-        pmc_tracer_cpu *CPU = &Tracer->CPUs[CPUID];
-
-        if(GUIDsAreEqual(EventGUID, TraceMarkerCategoryGuid))
-        {
-            pmc_tracer_etw_marker_userdata *Marker = (pmc_tracer_etw_marker_userdata *)Event->UserData;
-            u64 MarkerKey = Marker->TraceKey;
-            pmc_traced_region *Region = Marker->Dest;
+        Results->KernelCounters[PMCIndex] -= PMCData[PMCIndex];
+    }
 
-            // NOTE(casey): Only process marker events if the keys match. If they don't match, they
-            // are events that were inserted by another instance of the tracer, so we don't want
-            // to accidentally start counting them as if they came from our own trace.
-            if(Tracer->TraceKey == MarkerKey)
-            {
-                if(Opcode == TraceMarker_Open)
-                {
-                    DEBUG_PRINT("OPEN\n");
+    Results->KernelTSCElapsed -= TSC;
+}
 
-                    // NOTE(casey): Add this region to the list of regions running on this CPU core
-                    Region->Next = CPU->FirstRunningRegion;
-                    CPU->FirstRunningRegion = Region;
+static void ApplyKernelPMCsAsClose(pmc_traced_region *Region, u32 PMCCount, u64 *PMCData, u64 TSC)
+{
+    pmc_trace_result *Results = &Region->Results;
 
-                    // NOTE(casey): Mark that this region will get its starting counter values from the next SysExit event
-                    if(CPU->WaitingForSysExitToStart)
-                    {
-                        TraceError(Tracer, "Additional region opened on the same thread before SysExit event started the prior region");
-                    }
-                    CPU->WaitingForSysExitToStart = Region;
-                }
-                else if(Opcode == TraceMarker_Close)
-                {
-                    DEBUG_PRINT("CLOSE\n");
+    for(u32 PMCIndex = 0; PMCIndex < PMCCount; ++PMCIndex)
+    {
+        Results->KernelCounters[PMCIndex] += PMCData[PMCIndex];
+    }
 
-                    pmc_trace_result *Results = &Region->Results;
+    Results->KernelTSCElapsed += TSC;
+}
 
-                    if(CPU->LastSysEnterValid)
-                    {
-                        // NOTE(casey): Apply the counters and TSC we saved from the preceeding SysEnter event
-                        ApplyPMCsAsClose(Region, PMCCount, CPU->LastSysEnterCounters, CPU->LastSysEnterTSC);
+static void ResetTimelineBase(pmc_timeline *Timeline)
+{
+    Timeline->SkippedBoundaryCount = 0;
+    Timeline->LastTSCElapsed = 0;
+    for(u32 PMCIndex = 0; PMCIndex < MAX_TRACE_PMC_COUNT; ++PMCIndex)
+    {
+        Timeline->LastCounters[PMCIndex] = 0;
+    }
+}
 
-                        CPU->LastSysEnterValid = false;
-                    }
-                    else
-                    {
-                        TraceError(Tracer, "No ENTER for CLOSE event");
-                    }
+static void MergeTimelinePoints(pmc_timeline *Timeline)
+{
+    // NOTE: Adjacent points are summed pairwise, which keeps every delta exact while halving the resolution
+    u32 MergedCount = Timeline->PointCount / 2;
+    for(u32 PointIndex = 0; PointIndex < MergedCount; ++PointIndex)
+    {
+        pmc_timeline_point *First = &Timeline->Points[2*PointIndex];
+        pmc_timeline_point *Second = &Timeline->Points[2*PointIndex + 1];
+        pmc_timeline_point *Dest = &Timeline->Points[PointIndex];
 
-                    // NOTE(casey): Remove this trace from the list of traces running on this CPU core
-                    pmc_traced_region **FindRegion = &CPU->FirstRunningRegion;
-                    while(*FindRegion)
-                    {
-                        if(*FindRegion == Region)
-                        {
-                            *FindRegion = Region->Next;
-                            break;
-                        }
+        Dest->TSC = Second->TSC;
+        Dest->TSCElapsed = First->TSCElapsed + Second->TSCElapsed;
+        for(u32 PMCIndex = 0; PMCIndex < MAX_TRACE_PMC_COUNT; ++PMCIndex)
+        {
+            Dest->Counters[PMCIndex] = First->Counters[PMCIndex] + Second->Counters[PMCIndex];
+        }
+    }
 
-                        FindRegion = &(*FindRegion)->Next;
-                    }
+    if(Timeline->PointCount & 1)
+    {
+        Timeline->Points[MergedCount++] = Timeline->Points[Timeline->PointCount - 1];
+    }
 
-                    // NOTE(casey): Make sure everything is written back before signaling completion
-                    _mm_mfence(); // NOTE(casey): This is a stronger memory barrier than necessary, but should not be harmful
+    Timeline->PointCount = MergedCount;
+    Timeline->Stride *= 2;
+}
 
-                    // NOTE(casey): Signal completion to anyone waiting for these results
-                    Results->Completed = true;
-                }
-                else
-                {
-                    TraceError(Tracer, "Unrecognized ETW marker type");
-                }
+/* NOTE: While a region is running, its results hold its accumulated counts minus the counters at the time it
+   was last scheduled in, so its running totals are the results plus the current counters (OpenPMCData). When
+   it isn't running, the results are already its totals, and OpenPMCData is 0. */
+static void RecordTimelinePoint(pmc_traced_region *Region, u32 PMCCount, u64 *OpenPMCData, u64 TSC, b32 Force)
+{
+    pmc_timeline *Timeline = Region->Timeline;
+    if(Timeline)
+    {
+        ++Timeline->SkippedBoundaryCount;
+        if(Force || (Timeline->SkippedBoundaryCount >= Timeline->Stride))
+        {
+            if(Timeline->PointCount == ArrayCount(Timeline->Points))
+            {
+                MergeTimelinePoints(Timeline);
+            }
+
+            pmc_trace_result *Results = &Region->Results;
+            pmc_timeline_point *Point = &Timeline->Points[Timeline->PointCount++];
+
+            u64 TSCElapsed = Results->TSCElapsed + (OpenPMCData ? TSC : 0);
+            Point->TSC = TSC;
+            Point->TSCElapsed = TSCElapsed - Timeline->LastTSCElapsed;
+            Timeline->LastTSCElapsed = TSCElapsed;
+
+            for(u32 PMCIndex = 0; PMCIndex < PMCCount; ++PMCIndex)
+            {
+                u64 Counter = Results->Counters[PMCIndex] + (OpenPMCData ? OpenPMCData[PMCIndex] : 0);
+                Point->Counters[PMCIndex] = Counter - Timeline->LastCounters[PMCIndex];
+                Timeline->LastCounters[PMCIndex] = Counter;
             }
+
+            Timeline->SkippedBoundaryCount = 0;
         }
-        else if(GUIDsAreEqual(EventGUID, Win32ThreadEventGuid))
+    }
+}
+
+static void OpenRegionOnCPU(pmc_tracer *Tracer, u32 CPUIndex, pmc_traced_region *Region)
+{
+    pmc_tracer_cpu *CPU = &Tracer->CPUs[CPUIndex];
+    Region->OnCPUIndex = CPUIndex;
+    Region->InKernel = false;
+
+    // NOTE(casey): Add this region to the list of regions running on this CPU core
+    Region->Next = CPU->FirstRunningRegion;
+    CPU->FirstRunningRegion = Region;
+
+    // NOTE(casey): Mark that this region will get its starting counter values from the next SysExit event
+    if(CPU->WaitingForSysExitToStart)
+    {
+        TraceError(Tracer, "Additional region opened on the same thread before SysExit event started the prior region");
+    }
+    CPU->WaitingForSysExitToStart = Region;
+}
+
+static void CloseRegionOnCPU(pmc_tracer *Tracer, pmc_tracer_cpu *CPU, pmc_traced_region *Region, u32 PMCCount)
+{
+    if(CPU->LastSysEnterValid)
+    {
+        // NOTE(casey): Apply the counters and TSC we saved from the preceeding SysEnter event
+        ApplyPMCsAsClose(Region, PMCCount, CPU->LastSysEnterCounters, CPU->LastSysEnterTSC);
+
+        // NOTE: That SysEnter was for the marker itself, so cancel the kernel span it started
+        if(Region->InKernel)
         {
-            if(Opcode == WIN32_TRACE_OPCODE_SWITCH_THREAD)
-            {
-                if(Event->UserDataLength == 24)
-                {
-                    etw_thread_switch_userdata *Switch = (etw_thread_switch_userdata *)Event->UserData;
+            ApplyKernelPMCsAsClose(Region, PMCCount, CPU->LastSysEnterCounters, CPU->LastSysEnterTSC);
+            Region->InKernel = false;
+        }
 
-                    // NOTE(casey): Get the PMC data once, since we may need it multiple times as we
-                    // process suspending and resuming regions
-                    if(CPU->FirstRunningRegion || Tracer->FirstSuspendedRegion)
-                    {
-                        Win32FindPMCData(Tracer, Event, PMCCount, PMCData);
-                    }
+        CPU->LastSysEnterValid = false;
+    }
+    else
+    {
+        TraceError(Tracer, "No ENTER for CLOSE event");
+    }
 
-                    // NOTE(casey): Suspend any existing regions running on this CPU core
-                    while(CPU->FirstRunningRegion)
-                    {
-                        DEBUG_PRINT("SWITCH FROM\n");
+    // NOTE(casey): Remove this trace from the list of traces running on this CPU core
+    pmc_traced_region **FindRegion = &CPU->FirstRunningRegion;
+    while(*FindRegion)
+    {
+        if(*FindRegion == Region)
+        {
+            *FindRegion = Region->Next;
+            break;
+        }
 
-                        pmc_traced_region *Region = CPU->FirstRunningRegion;
+        FindRegion = &(*FindRegion)->Next;
+    }
+}
 
-                        if(Switch->OldThreadId != Region->OnThreadID)
-                        {
-                            TraceError(Tracer, "Switched thread ID mismatch");
-                        }
+static void AccumulateRegion(pmc_accumulated_region *Accumulated, u32 PMCCount)
+{
+    pmc_trace_result *Pair = &Accumulated->Region.Results;
+    pmc_trace_result *Totals = &Accumulated->Totals;
 
-                        // NOTE(casey): Apply the current PMCs as "ending" counters
-                        ApplyPMCsAsClose(Region, PMCCount, PMCData, TSC);
+    for(u32 PMCIndex = 0; PMCIndex < PMCCount; ++PMCIndex)
+    {
+        Totals->Counters[PMCIndex] += Pair->Counters[PMCIndex];
+        Totals->KernelCounters[PMCIndex] += Pair->KernelCounters[PMCIndex];
+    }
 
-                        // NOTE(casey): Record that this region has incurred a context switch
-                        ++Region->Results.ContextSwitchCount;
+    if(!Totals->InvocationCount)
+    {
+        Totals->StartTSC = Pair->StartTSC;
+    }
+    Totals->ThreadID = Pair->ThreadID;
+    Totals->CPUIndex = Pair->CPUIndex;
+    Totals->TSCElapsed += Pair->TSCElapsed;
+    Totals->KernelTSCElapsed += Pair->KernelTSCElapsed;
+    Totals->CoreCycles += Pair->CoreCycles;
+    Totals->CoreCycleSource = Pair->CoreCycleSource;
+    Totals->SysCallCount += Pair->SysCallCount;
+    Totals->ContextSwitchCount += Pair->ContextSwitchCount;
+    Totals->ThreadHopCount += Pair->ThreadHopCount;
+    Totals->CPUMigrationCount += Pair->CPUMigrationCount;
+    ++Totals->InvocationCount;
+
+    // NOTE: The next pair's open marker always comes after this close, so the pair can be reset here
+    // rather than by the instrumented thread, which would race with this thread.
+    *Pair = {};
+}
 
-                        // NOTE(casey): Remove this region from the running set
-                        CPU->FirstRunningRegion = Region->Next;
+static b32 ExceedsTrigger(pmc_trigger *Trigger, pmc_trace_result *Results)
+{
+    b32 Result = (Trigger->MaxTSCElapsed && (Results->TSCElapsed > Trigger->MaxTSCElapsed));
+    for(u32 PMCIndex = 0; PMCIndex < Results->PMCCount; ++PMCIndex)
+    {
+        u64 Max = Trigger->MaxCounters[PMCIndex];
+        if(Max && (Results->Counters[PMCIndex] > Max))
+        {
+            Result = true;
+        }
+    }
 
-                        // NOTE(casey): Put this region on the suspended list
-                        Region->Next = Tracer->FirstSuspendedRegion;
-                        Tracer->FirstSuspendedRegion = Region;
-                    }
+    return Result;
+}
 
-                    // NOTE(casey): Look for matching region IDs that will be resumed
-                    pmc_traced_region **FindRegion = &Tracer->FirstSuspendedRegion;
-                    while(*FindRegion)
-                    {
-                        if((*FindRegion)->OnThreadID == Switch->NewThreadId)
-                        {
-                            DEBUG_PRINT("SWITCH TO\n");
+static void CheckPMCTriggers(pmc_tracer *Tracer, pmc_traced_region *Region, u64 CloseTSC)
+{
+    pmc_trace_result *Results = &Region->Results;
 
-                            pmc_traced_region *Region = *FindRegion;
+    // NOTE: Every trigger is checked against its own rate limit, so one that is holding off does not hide the
+    // region from the others on the same site
+    u32 FiredMask = 0;
+    u32 TriggerCount = Tracer->TriggerCount;
+    for(u32 TriggerIndex = 0; TriggerIndex < TriggerCount; ++TriggerIndex)
+    {
+        pmc_trigger *Trigger = &Tracer->Triggers[TriggerIndex];
+        if((Trigger->SiteID == Results->SiteID) && ExceedsTrigger(Trigger, Results))
+        {
+            u64 *LastCaptureTSC = &Tracer->LastTriggerCaptureTSC[TriggerIndex];
+            if(!*LastCaptureTSC || ((CloseTSC - *LastCaptureTSC) >= Trigger->MinTSCBetweenCaptures))
+            {
+                *LastCaptureTSC = CloseTSC;
+                FiredMask |= (1u << TriggerIndex);
+            }
+        }
+    }
 
-                            // NOTE(casey): Apply the current PMCs as "begin" counters
-                            ApplyPMCsAsOpen(Region, PMCCount, PMCData, TSC);
+    // NOTE: One capture per region is enough, even if it trips several triggers
+    if(FiredMask)
+    {
+        u64 WriteIndex = Tracer->CaptureWriteIndex;
+        if((WriteIndex - Tracer->CaptureReadIndex) < PMC_CAPTURE_QUEUE_SIZE)
+        {
+            unsigned long FirstFired;
+            _BitScanForward(&FirstFired, FiredMask);
+
+            pmc_capture *Capture = &Tracer->Captures[WriteIndex % PMC_CAPTURE_QUEUE_SIZE];
+            Capture->Result = *Results;
+            Capture->Result.Completed = true;
+            Capture->CloseTSC = CloseTSC;
+            Capture->TriggerIndex = FirstFired;
+            Capture->TriggerMask = FiredMask;
+
+            // NOTE: The capture must be fully written before the consumer can see the new write index
+            _mm_sfence();
+            Tracer->CaptureWriteIndex = WriteIndex + 1;
+        }
+        else
+        {
+            ++Tracer->DroppedCaptureCount;
+        }
+    }
+}
 
-                            // NOTE(casey): Remove this region from the suspended list
-                            *FindRegion = (*FindRegion)->Next;
+static u32 GetLog2Bucket(u64 Value)
+{
+    unsigned long Result = 0;
+    _BitScanReverse64(&Result, Value | 1);
+    return Result;
+}
 
-                            // NOTE(casey): Put this region on the running list
-                            Region->Next = CPU->FirstRunningRegion;
-                            CPU->FirstRunningRegion = Region;
-                        }
-                        else
-                        {
-                            FindRegion = &(*FindRegion)->Next;
-                        }
-                    }
-                }
-                else
-                {
-                    TraceError(Tracer, "Unexpected CSwitch data size");
-                }
+static b32 ComputePMCCoreCycles(pmc_tracer *Tracer, pmc_traced_region *Region, pmc_trace_result *Results)
+{
+    // NOTE: The source comes from the region, because a daemon processes regions started by other tracers. A core
+    // cycle PMC is always the processing tracer's own counter, though.
+    b32 Result = ((Region->CoreCycleSource == CoreCycles_PMC) && Tracer->Mapping.HasCoreCycles);
+    if(Result)
+    {
+        Results->CoreCycles = Results->Counters[Tracer->Mapping.CoreCycleIndex];
+        Results->CoreCycleSource = CoreCycles_PMC;
+    }
+    return Result;
+}
+
+static void ComputeCoreCycles(pmc_tracer *Tracer, pmc_traced_region *Region)
+{
+    pmc_trace_result *Results = &Region->Results;
+    if(!ComputePMCCoreCycles(Tracer, Region, Results) &&
+       (Region->CoreCycleSource == CoreCycles_APERF) && !Region->Accumulator &&
+       (Region->StartCPU == Region->StopCPU) && (Region->StopMPERF > Region->StartMPERF))
+    {
+        // NOTE: MPERF counts at the TSC rate while the core is running and APERF at the actual clock, so their ratio
+        // converts the region's own (context switch corrected) TSCElapsed into core cycles
+        f64 Ratio = (f64)(Region->StopAPERF - Region->StartAPERF) / (f64)(Region->StopMPERF - Region->StartMPERF);
+        Results->CoreCycles = (u64)((f64)Results->TSCElapsed * Ratio);
+        Results->CoreCycleSource = CoreCycles_APERF;
+    }
+}
+
+static void AggregateResult(pmc_tracer *Tracer, pmc_trace_result *Results)
+{
+    if(Tracer->Aggregates)
+    {
+        // NOTE: Announce the buffer before using it, then check it was not retired in the meantime. Together with
+        // TakePMCAggregates flipping before it checks, one side always sees the other.
+        u32 Index;
+        for(;;)
+        {
+            Index = Tracer->ActiveAggregateIndex;
+            Tracer->AggregateInUse = Index + 1;
+            _mm_mfence();
+            if(Tracer->ActiveAggregateIndex == Index)
+            {
+                break;
             }
         }
-        else if(GUIDsAreEqual(EventGUID, Win32DPCEventGuid))
+
+        pmc_site_aggregates *Aggregates = &Tracer->Aggregates[Index];
+        if(Results->SiteID < MAX_PMC_AGGREGATE_SITE_COUNT)
         {
-            if(Opcode == WIN32_TRACE_OPCODE_SYSTEMCALL_ENTER)
+            pmc_site_aggregate *Site = &Aggregates->Sites[Results->SiteID];
+            ++Site->RegionCount;
+            Site->TSCElapsed += Results->TSCElapsed;
+            Site->ContextSwitchCount += Results->ContextSwitchCount;
+            for(u32 CI = 0; CI < Results->PMCCount; ++CI)
             {
-                DEBUG_PRINT("ENTER\n");
+                Site->Counters[CI] += Results->Counters[CI];
+            }
 
-                // NOTE(casey): Remember the state at this SysEnter so it can be applied to a
-                // region later if there is a following Close event.
-                if(CPU->FirstRunningRegion)
-                {
-                    CPU->LastSysEnterValid = true;
-                    CPU->LastSysEnterTSC = TSC;
-                    Win32FindPMCData(Tracer, Event, PMCCount, CPU->LastSysEnterCounters);
-                }
+            u32 Bucket = GetLog2Bucket(Results->TSCElapsed);
+            if(Bucket >= PMC_AGGREGATE_HISTOGRAM_BUCKET_COUNT)
+            {
+                Bucket = PMC_AGGREGATE_HISTOGRAM_BUCKET_COUNT - 1;
             }
-            else if(Opcode == WIN32_TRACE_OPCODE_SYSTEMCALL_EXIT)
+            ++Site->TSCHistogram[Bucket];
+        }
+        else
+        {
+            ++Aggregates->DroppedRegionCount;
+        }
+
+        _mm_sfence();
+        Tracer->AggregateInUse = 0;
+    }
+}
+
+static void QueuePMCSample(pmc_tracer *Tracer, pmc_traced_region *Region, etw_sampled_profile_userdata *Sample, u64 TSC)
+{
+    ++Region->Results.SampleCount;
+
+    u64 WriteIndex = Tracer->SampleWriteIndex;
+    if((WriteIndex - Tracer->SampleReadIndex) < PMC_SAMPLE_QUEUE_SIZE)
+    {
+        pmc_ip_sample *Dest = &Tracer->Samples[WriteIndex % PMC_SAMPLE_QUEUE_SIZE];
+        Dest->InstructionPointer = Sample->InstructionPointer;
+        Dest->TSC = TSC;
+        Dest->SiteID = Region->Results.SiteID;
+        Dest->ThreadID = Sample->ThreadId;
+
+        _mm_sfence();
+        Tracer->SampleWriteIndex = WriteIndex + 1;
+    }
+    else
+    {
+        ++Tracer->DroppedSampleCount;
+    }
+}
+
+static pmc_shared_client *FindClient(pmc_tracer *Tracer, u64 TraceKey)
+{
+    pmc_shared_client *Result = 0;
+    for(u32 ClientIndex = 0; ClientIndex < MAX_PMC_CLIENT_COUNT; ++ClientIndex)
+    {
+        if(Tracer->Clients[ClientIndex].TraceKey == TraceKey)
+        {
+            Result = &Tracer->Clients[ClientIndex];
+            break;
+        }
+    }
+
+    return Result;
+}
+
+static b32 GetClientOffset(pmc_shared_client *Client, void *ClientPointer, u64 Size, u64 *Offset)
+{
+    // NOTE: Anything outside the client's section, including its header, is rejected. Only the offset is kept;
+    // a pointer from the client is never followed.
+    u64 Pointer = (u64)ClientPointer;
+    u64 Base = (u64)Client->ClientBase;
+    *Offset = Pointer - Base;
+
+    b32 Result = ((Pointer >= Base) && (Size <= Client->Size) &&
+                  (*Offset >= PMC_SHARED_HEADER_SIZE) && (*Offset <= (Client->Size - Size)));
+    return Result;
+}
+
+static pmc_client_region *GetClientRegion(pmc_shared_client *Client, u64 Offset)
+{
+    pmc_client_region *Result = 0;
+
+    u32 Mask = ArrayCount(Client->RegionTable) - 1;
+    u32 Slot = (u32)((Offset * 0x9E3779B97F4A7C15ull) >> 32) & Mask;
+    for(u32 Probe = 0; Probe < ArrayCount(Client->RegionTable); ++Probe)
+    {
+        pmc_client_region **Entry = &Client->RegionTable[(Slot + Probe) & Mask];
+        if(!*Entry)
+        {
+            if(Client->RegionCount < MAX_PMC_CLIENT_REGION_COUNT)
             {
-                DEBUG_PRINT("EXIT\n");
+                Result = &Client->RegionStore[Client->RegionCount++];
+                Result->Client = Client;
+                Result->Offset = Offset;
+                *Entry = Result;
+            }
+            break;
+        }
+        else if((*Entry)->Offset == Offset)
+        {
+            Result = *Entry;
+            break;
+        }
+    }
 
-                // NOTE(casey): If there was a region waiting to open on the next syscall exit,
-                // apply the PMCs to that region
-                if(CPU->WaitingForSysExitToStart)
+    return Result;
+}
+
+static b32 IsOnList(pmc_traced_region *First, pmc_traced_region *Region)
+{
+    b32 Result = false;
+    for(pmc_traced_region *Check = First; Check; Check = Check->Next)
+    {
+        if(Check == Region)
+        {
+            Result = true;
+            break;
+        }
+    }
+
+    return Result;
+}
+
+static void UnlinkRegion(pmc_traced_region **First, pmc_traced_region *Region)
+{
+    while(*First)
+    {
+        if(*First == Region)
+        {
+            *First = Region->Next;
+            break;
+        }
+
+        First = &(*First)->Next;
+    }
+}
+
+static void DetachClient(pmc_tracer *Tracer, pmc_shared_client *Client)
+{
+    // NOTE: Shadows the client left running are still on the lists, so they come off before their memory is freed
+    for(u32 RegionIndex = 0; RegionIndex < Client->RegionCount; ++RegionIndex)
+    {
+        pmc_client_region *Shadow = &Client->RegionStore[RegionIndex];
+        if(Shadow->State == ClientRegion_Running)
+        {
+            pmc_traced_region *Region = &Shadow->Region;
+            for(u32 CPUIndex = 0; CPUIndex < Tracer->CPUCount; ++CPUIndex)
+            {
+                pmc_tracer_cpu *CPU = &Tracer->CPUs[CPUIndex];
+                UnlinkRegion(&CPU->FirstRunningRegion, Region);
+                if(CPU->WaitingForSysExitToStart == Region)
                 {
-                    pmc_traced_region *Region = CPU->WaitingForSysExitToStart;
                     CPU->WaitingForSysExitToStart = 0;
-
-                    Win32FindPMCData(Tracer, Event, PMCCount, PMCData);
-                    ApplyPMCsAsOpen(Region, PMCCount, PMCData, TSC);
                 }
             }
+            UnlinkRegion(&Tracer->FirstSuspendedRegion, Region);
         }
+
+        Win32Deallocate(Shadow->Timeline);
     }
-    else
-    {
-        TraceError(Tracer, "Out-of-bounds CPUID in ETW event");
-    }
+
+    Win32Deallocate(Client->RegionStore);
+    UnmapViewOfFile(Client->View);
+    CloseHandle(Client->Section);
+    CloseHandle(Client->Process);
+    *Client = {};
 }
 
-static DWORD CALLBACK Win32ProcessEventThread(void *Arg)
+static void ReclaimExitedClients(pmc_tracer *Tracer)
 {
-    TRACEHANDLE Session = (TRACEHANDLE)Arg;
-    ProcessTrace(&Session, 1, 0, 0);
-    return 0;
+    // NOTE: A client that crashed, or never called StopTracing, sends no detach marker, so its slot is reclaimed
+    // once its process has exited
+    for(u32 ClientIndex = 0; ClientIndex < MAX_PMC_CLIENT_COUNT; ++ClientIndex)
+    {
+        pmc_shared_client *Client = &Tracer->Clients[ClientIndex];
+        if(Client->TraceKey && (WaitForSingleObject(Client->Process, 0) == WAIT_OBJECT_0))
+        {
+            DetachClient(Tracer, Client);
+        }
+    }
 }
 
-static ULONG WINAPI ControlCallback(WMIDPREQUESTCODE, void *, ULONG *, void *)
+static void AttachClient(pmc_tracer *Tracer, u64 TraceKey, u32 ProcessID, u8 *ClientBase, u64 ClientSection)
 {
-    return ERROR_SUCCESS;
+    // NOTE: This runs on the processing thread, but only once per client, so the cost of duplicating the
+    // handle and mapping the section is not paid per event
+    ReclaimExitedClients(Tracer);
+
+    pmc_shared_client *Client = FindClient(Tracer, 0);
+    if(Client && !FindClient(Tracer, TraceKey))
+    {
+        HANDLE Section = 0;
+        HANDLE Process = OpenProcess(PROCESS_DUP_HANDLE | SYNCHRONIZE, FALSE, ProcessID);
+        if(Process)
+        {
+            DuplicateHandle(Process, (HANDLE)ClientSection, GetCurrentProcess(), &Section, 0, FALSE, DUPLICATE_SAME_ACCESS);
+        }
+
+        u8 *View = Section ? (u8 *)MapViewOfFile(Section, FILE_MAP_ALL_ACCESS, 0, 0, 0) : 0;
+        pmc_client_region *RegionStore = 0;
+        if(View)
+        {
+            RegionStore = (pmc_client_region *)Win32AllocateSize(MAX_PMC_CLIENT_REGION_COUNT * sizeof(pmc_client_region));
+        }
+
+        if(RegionStore)
+        {
+            MEMORY_BASIC_INFORMATION Info = {};
+            VirtualQuery(View, &Info, sizeof(Info));
+
+            pmc_shared_client_header *Header = (pmc_shared_client_header *)View;
+            u64 ClaimedSize = *(u64 volatile *)&Header->Size;
+
+            Client->TraceKey = TraceKey;
+            Client->ProcessID = ProcessID;
+            Client->Process = Process;
+            Client->Section = Section;
+            Client->View = View;
+            Client->ClientBase = ClientBase;
+            Client->Size = (ClaimedSize < Info.RegionSize) ? ClaimedSize : Info.RegionSize;
+            Client->RegionStore = RegionStore;
+
+            Header->PMCCount = Tracer->Mapping.PMCCount;
+            Header->CoreCycleIndex = Tracer->Mapping.CoreCycleIndex;
+            Header->HasCoreCycles = (Tracer->CoreCycleSource == CoreCycles_PMC);
+            _mm_mfence();
+            Header->Attached = true;
+        }
+        else
+        {
+            ++Tracer->RejectedClientMarkerCount;
+            if(View)
+            {
+                UnmapViewOfFile(View);
+            }
+            if(Section)
+            {
+                CloseHandle(Section);
+            }
+            if(Process)
+            {
+                CloseHandle(Process);
+            }
+        }
+    }
+    else
+    {
+        ++Tracer->RejectedClientMarkerCount;
+    }
+}
+
+static b32 BeginClientMarker(pmc_tracer *Tracer, pmc_tracer_cpu *CPU, pmc_client_region *Shadow, UCHAR Opcode, u32 ThreadID)
+{
+    // NOTE: The client decides which markers arrive in which order, so each one is checked against what its shadow
+    // is doing. A marker that doesn't fit is rejected rather than allowed to put a shadow on a list twice or take
+    // it off a list it isn't on. Values the client wrote are read once, and only ever used as values.
+    pmc_traced_region *Region = &Shadow->Region;
+    pmc_traced_region volatile *ClientRegion = (pmc_traced_region volatile *)(Shadow->Client->View + Shadow->Offset);
+    b32 RunningHere = ((Shadow->State == ClientRegion_Running) && (Region->OnThreadID == ThreadID) &&
+                       IsOnList(CPU->FirstRunningRegion, Region));
+
+    b32 Result = false;
+    switch(Opcode)
+    {
+        case TraceMarker_Open:
+        {
+            if((Shadow->State == ClientRegion_Closed) && !CPU->WaitingForSysExitToStart)
+            {
+                pmc_timeline *ClientTimeline = ClientRegion->Timeline;
+                u64 TimelineOffset = 0;
+                b32 TimelineValid = true;
+                if(ClientTimeline)
+                {
+                    TimelineValid = GetClientOffset(Shadow->Client, ClientTimeline, sizeof(pmc_timeline), &TimelineOffset);
+                    if(TimelineValid && !Shadow->Timeline)
+                    {
+                        Shadow->Timeline = (pmc_timeline *)Win32AllocateSize(sizeof(pmc_timeline));
+                        TimelineValid = (Shadow->Timeline != 0);
+                    }
+                }
+
+                if(TimelineValid)
+                {
+                    Shadow->Phased = {};
+                    Shadow->Accumulating = false;
+                    Shadow->TimelineOffset = TimelineOffset;
+
+                    Region->Results.PMCCount = Tracer->Mapping.PMCCount;
+                    Region->Results.InvocationCount = 1;
+                    Region->Results.SiteID = ClientRegion->Results.SiteID;
+                    Region->OnThreadID = ThreadID;
+                    Region->CoreCycleSource = ClientRegion->CoreCycleSource;
+                    Region->StartAPERF = ClientRegion->StartAPERF;
+                    Region->StartMPERF = ClientRegion->StartMPERF;
+                    Region->StartCPU = ClientRegion->StartCPU;
+                    if(ClientTimeline)
+                    {
+                        Shadow->Timeline->PointCount = 0;
+                        Shadow->Timeline->Stride = 1;
+                        ResetTimelineBase(Shadow->Timeline);
+                        Region->Timeline = Shadow->Timeline;
+                    }
+
+                    Shadow->State = ClientRegion_Running;
+                    Result = true;
+                }
+            }
+        } break;
+
+        case TraceMarker_OpenAccumulating:
+        {
+            if((Shadow->State == ClientRegion_Closed) && !CPU->WaitingForSysExitToStart)
+            {
+                // NOTE: The totals carry over from pair to pair, so the shadow is only reset when it changes kind
+                if(!Shadow->Accumulating)
+                {
+                    Shadow->Accumulated = {};
+                    Shadow->Accumulating = true;
+                }
+                Shadow->TimelineOffset = 0;
+                Region->CoreCycleSource = ClientRegion->CoreCycleSource;
+
+                Shadow->State = ClientRegion_Running;
+                Result = true;
+            }
+        } break;
+
+        case TraceMarker_Close:
+        {
+            if(RunningHere)
+            {
+                Region->StopAPERF = ClientRegion->StopAPERF;
+                Region->StopMPERF = ClientRegion->StopMPERF;
+                Region->StopCPU = ClientRegion->StopCPU;
+
+                Shadow->State = ClientRegion_Closed;
+                Result = true;
+            }
+        } break;
+
+        case TraceMarker_Suspend:
+        {
+            if(RunningHere)
+            {
+                Shadow->State = ClientRegion_Suspended;
+                Result = true;
+            }
+        } break;
+
+        case TraceMarker_Resume:
+        {
+            if((Shadow->State == ClientRegion_Suspended) && !CPU->WaitingForSysExitToStart)
+            {
+                Shadow->State = ClientRegion_Running;
+                Result = true;
+            }
+        } break;
+
+        case TraceMarker_Lap:
+        {
+            Result = (RunningHere && !Shadow->Accumulating);
+        } break;
+
+        case TraceMarker_Flush:
+        {
+            Result = Shadow->Accumulating;
+        } break;
+
+        default: {} break;
+    }
+
+    return Result;
+}
+
+static void PublishClientRegion(pmc_client_region *Shadow, UCHAR Opcode)
+{
+    // NOTE: Only plain result values are written back into the section, at offsets checked when the marker arrived,
+    // and the completion flag always goes last
+    u8 *ClientMemory = Shadow->Client->View + Shadow->Offset;
+    if((Opcode == TraceMarker_Close) && !Shadow->Accumulating)
+    {
+        pmc_traced_region *ClientRegion = (pmc_traced_region *)ClientMemory;
+        pmc_trace_result Results = Shadow->Region.Results;
+        Results.Completed = false;
+        ClientRegion->Results = Results;
+
+        if(Shadow->TimelineOffset)
+        {
+            *(pmc_timeline *)(Shadow->Client->View + Shadow->TimelineOffset) = *Shadow->Timeline;
+        }
+
+        _mm_mfence();
+        ClientRegion->Results.Completed = true;
+    }
+    else if(Opcode == TraceMarker_Lap)
+    {
+        pmc_phased_region *ClientPhased = (pmc_phased_region *)ClientMemory;
+        u32 CompletedPhaseCount = Shadow->Phased.CompletedPhaseCount;
+        if(CompletedPhaseCount)
+        {
+            ClientPhased->CompletedPhases[CompletedPhaseCount - 1] = Shadow->Phased.CompletedPhases[CompletedPhaseCount - 1];
+        }
+        ClientPhased->DroppedLapCount = Shadow->Phased.DroppedLapCount;
+
+        _mm_sfence();
+        ClientPhased->CompletedPhaseCount = CompletedPhaseCount;
+    }
+    else if(Opcode == TraceMarker_Flush)
+    {
+        pmc_accumulated_region *ClientAccumulated = (pmc_accumulated_region *)ClientMemory;
+        pmc_trace_result Flushed = Shadow->Accumulated.Flushed;
+        Flushed.Completed = false;
+        ClientAccumulated->Flushed = Flushed;
+
+        _mm_mfence();
+        ClientAccumulated->Flushed.Completed = true;
+    }
+}
+
+static pmc_client_region *Win32ProcessClientMarker(pmc_tracer *Tracer, EVENT_RECORD *Event, pmc_tracer_cpu *CPU,
+                                                   pmc_tracer_etw_marker_userdata *Marker, UCHAR Opcode)
+{
+    pmc_client_region *Result = 0;
+    u32 ProcessID = Event->EventHeader.ProcessId;
+
+    if(!Marker->TraceKey)
+    {
+        // NOTE: A key of 0 marks a free slot in the client table, so it can never belong to a client
+        ++Tracer->RejectedClientMarkerCount;
+    }
+    else if(Opcode == TraceMarker_Attach)
+    {
+        AttachClient(Tracer, Marker->TraceKey, ProcessID, (u8 *)Marker->Dest, Marker->Payload);
+    }
+    else
+    {
+        // NOTE: Markers are only taken from the process that attached, so another process that learns a
+        // client's key cannot act for it
+        pmc_shared_client *Client = FindClient(Tracer, Marker->TraceKey);
+        if(Client && (Client->ProcessID == ProcessID))
+        {
+            if(Opcode == TraceMarker_Detach)
+            {
+                DetachClient(Tracer, Client);
+            }
+            else
+            {
+                u64 Size = sizeof(pmc_traced_region);
+                if(Opcode == TraceMarker_Lap)
+                {
+                    Size = sizeof(pmc_phased_region);
+                }
+                else if((Opcode == TraceMarker_OpenAccumulating) || (Opcode == TraceMarker_Flush))
+                {
+                    Size = sizeof(pmc_accumulated_region);
+                }
+
+                u64 Offset;
+                if(GetClientOffset(Client, Marker->Dest, Size, &Offset))
+                {
+                    pmc_client_region *Shadow = GetClientRegion(Client, Offset);
+                    if(Shadow && BeginClientMarker(Tracer, CPU, Shadow, Opcode, Event->EventHeader.ThreadId))
+                    {
+                        Result = Shadow;
+                    }
+                }
+            }
+        }
+
+        if(!Result && (Opcode != TraceMarker_Detach))
+        {
+            ++Tracer->RejectedClientMarkerCount;
+        }
+    }
+
+    return Result;
+}
+
+static void CALLBACK Win32ProcessETWEvent(EVENT_RECORD *Event)
+{
+    pmc_tracer *Tracer = (pmc_tracer *)Event->UserContext;
+    pmc_tracer_stats *Stats = &Tracer->Stats;
+    pmc_tracer_event_kind Kind = TracerEvent_Other;
+    u64 CallbackStartTSC = __rdtsc();
+
+    GUID EventGUID = Event->EventHeader.ProviderId;
+	UCHAR Opcode = Event->EventHeader.EventDescriptor.Opcode;
+    u32 CPUID = GetEventProcessorIndex(Event);
+    u32 PMCCount = Tracer->Mapping.PMCCount;
+    u64 TSC = Event->EventHeader.TimeStamp.QuadPart;
+    u64 PMCData[MAX_TRACE_PMC_COUNT] = {};
+
+#if PMC_DEBUG_LOG
+    if(Tracer->UnloggedError)
+    {
+        LogDebugError(Tracer, (char const *)InterlockedExchangePointer((void *volatile *)&Tracer->UnloggedError, 0));
+    }
+#endif
+
+    // NOTE: With raw timestamps, event times are TSC values, so this is how far behind real time we are running
+    u64 LagTSC = (CallbackStartTSC > TSC) ? (CallbackStartTSC - TSC) : 0;
+    Stats->LastLagTSC = LagTSC;
+    if(Stats->MaxLagTSC < LagTSC)
+    {
+        Stats->MaxLagTSC = LagTSC;
+    }
+
+    if(CPUID < Tracer->CPUCount)
+    {
+        pmc_tracer_cpu *CPU = &Tracer->CPUs[CPUID];
+
+        if(GUIDsAreEqual(EventGUID, TraceMarkerCategoryGuid))
+        {
+            Kind = TracerEvent_Marker;
+
+            pmc_tracer_etw_marker_userdata *Marker = (pmc_tracer_etw_marker_userdata *)Event->UserData;
+            b32 MarkerValid = (Event->UserDataLength >= sizeof(pmc_tracer_etw_marker_userdata));
+            u64 MarkerKey = MarkerValid ? Marker->TraceKey : 0;
+            pmc_traced_region *Region = 0;
+            pmc_client_region *ClientRegion = 0;
+
+            // NOTE(casey): Only process marker events if the keys match. If they don't match, they
+            // are events that were inserted by another instance of the tracer, so we don't want
+            // to accidentally start counting them as if they came from our own trace.
+            // NOTE: A daemon only takes its own key from its own process, since clients can log any key. Markers
+            // from its attached clients are handled through daemon-private shadows of their regions instead.
+            if(MarkerValid && (Tracer->TraceKey == MarkerKey) &&
+               (!Tracer->ServesClients || (Event->EventHeader.ProcessId == GetCurrentProcessId())))
+            {
+                Region = Marker->Dest;
+            }
+            else if(MarkerValid && Tracer->ServesClients)
+            {
+                ClientRegion = Win32ProcessClientMarker(Tracer, Event, CPU, Marker, Opcode);
+                Region = ClientRegion ? &ClientRegion->Region : 0;
+            }
+
+            if(Region)
+            {
+                if(Opcode == TraceMarker_Open)
+                {
+                    DEBUG_LOG(DebugLog_Open, Region, Event->EventHeader.ThreadId, Event->EventHeader.ThreadId, 0);
+
+                    Region->Accumulator = 0;
+                    Region->Results.StartTSC = TSC;
+                    OpenRegionOnCPU(Tracer, CPUID, Region);
+                }
+                else if(Opcode == TraceMarker_OpenAccumulating)
+                {
+                    DEBUG_LOG(DebugLog_Open, Region, Event->EventHeader.ThreadId, Event->EventHeader.ThreadId, 0);
+
+                    // NOTE: Accumulated regions are reused back-to-back, so the thread comes from the marker
+                    // rather than being written by the instrumented thread while earlier events are in flight.
+                    Region->Accumulator = (pmc_accumulated_region *)Region;
+                    Region->OnThreadID = Event->EventHeader.ThreadId;
+                    Region->Results.StartTSC = TSC;
+                    OpenRegionOnCPU(Tracer, CPUID, Region);
+                }
+                else if(Opcode == TraceMarker_Close)
+                {
+                    DEBUG_LOG(DebugLog_Close, Region, Event->EventHeader.ThreadId, Event->EventHeader.ThreadId, CPU->LastSysEnterCounters);
+
+                    pmc_trace_result *Results = &Region->Results;
+                    u64 CloseTSC = CPU->LastSysEnterTSC;
+
+                    CloseRegionOnCPU(Tracer, CPU, Region, PMCCount);
+                    RecordTimelinePoint(Region, PMCCount, 0, CloseTSC, true);
+                    ComputeCoreCycles(Tracer, Region);
+                    Results->ThreadID = Region->OnThreadID;
+                    Results->CPUIndex = CPUID;
+
+                    if(Region->Accumulator)
+                    {
+                        AccumulateRegion(Region->Accumulator, PMCCount);
+                    }
+                    else
+                    {
+                        CheckPMCTriggers(Tracer, Region, CloseTSC);
+                        AggregateResult(Tracer, Results);
+
+                        // NOTE(casey): Make sure everything is written back before signaling completion
+                        _mm_mfence(); // NOTE(casey): This is a stronger memory barrier than necessary, but should not be harmful
+
+                        // NOTE(casey): Signal completion to anyone waiting for these results
+                        Results->Completed = true;
+
+                        ++Stats->ResultLatencyHistogram[GetLog2Bucket(__rdtsc() - TSC)];
+                    }
+                }
+                else if(Opcode == TraceMarker_Lap)
+                {
+                    DEBUG_LOG(DebugLog_Lap, Region, Event->EventHeader.ThreadId, Event->EventHeader.ThreadId, CPU->LastSysEnterCounters);
+
+                    pmc_phased_region *Phased = (pmc_phased_region *)Region;
+                    pmc_trace_result *Results = &Region->Results;
+
+                    if(!CPU->LastSysEnterValid)
+                    {
+                        TraceError(Tracer, "No ENTER for LAP event");
+                    }
+                    else if(Phased->CompletedPhaseCount >= ArrayCount(Phased->CompletedPhases))
+                    {
+                        // NOTE: There is nowhere to put another phase, so the lap is dropped and the current phase
+                        // simply keeps running. The phases still add up to the whole region.
+                        ++Phased->DroppedLapCount;
+                        CPU->LastSysEnterValid = false;
+                    }
+                    else
+                    {
+                        // NOTE: Close the finished phase and open the next one at the same snapshot, so nothing
+                        // between them goes uncounted or is counted twice. The region stays on the running list.
+                        ApplyPMCsAsClose(Region, PMCCount, CPU->LastSysEnterCounters, CPU->LastSysEnterTSC);
+                        if(Region->InKernel)
+                        {
+                            ApplyKernelPMCsAsClose(Region, PMCCount, CPU->LastSysEnterCounters, CPU->LastSysEnterTSC);
+                        }
+
+                        // NOTE: A phased region's timeline spans all of its phases, with a point at every lap
+                        RecordTimelinePoint(Region, PMCCount, 0, CPU->LastSysEnterTSC, true);
+                        if(Region->Timeline)
+                        {
+                            ResetTimelineBase(Region->Timeline);
+                        }
+
+                        pmc_trace_result *Phase = &Phased->CompletedPhases[Phased->CompletedPhaseCount++];
+                        *Phase = *Results;
+                        ComputePMCCoreCycles(Tracer, Region, Phase);
+                        Phase->ThreadID = Region->OnThreadID;
+                        Phase->CPUIndex = CPUID;
+                        Phase->Completed = true;
+
+                        u32 SiteID = Results->SiteID;
+                        *Results = {};
+                        Results->PMCCount = PMCCount;
+                        Results->InvocationCount = 1;
+                        Results->SiteID = SiteID;
+                        Results->StartTSC = TSC;
+
+                        ApplyPMCsAsOpen(Region, PMCCount, CPU->LastSysEnterCounters, CPU->LastSysEnterTSC);
+
+                        // NOTE: The lap's own syscall is charged to the new phase, in kernel as well as in total
+                        if(Region->InKernel)
+                        {
+                            ApplyKernelPMCsAsOpen(Region, PMCCount, CPU->LastSysEnterCounters, CPU->LastSysEnterTSC);
+                        }
+
+                        CPU->LastSysEnterValid = false;
+                    }
+                }
+                else if(Opcode == TraceMarker_Flush)
+                {
+                    pmc_accumulated_region *Accumulated = (pmc_accumulated_region *)Region;
+
+                    DEBUG_LOG(DebugLog_Flush, Region, Event->EventHeader.ThreadId, Event->EventHeader.ThreadId, Accumulated->Totals.Counters);
+
+                    Accumulated->Flushed = Accumulated->Totals;
+                    Accumulated->Flushed.PMCCount = PMCCount;
+                    Accumulated->Totals = {};
+
+                    _mm_mfence();
+                    Accumulated->Flushed.Completed = true;
+                }
+                else if(Opcode == TraceMarker_Suspend)
+                {
+                    DEBUG_LOG(DebugLog_Suspend, Region, Event->EventHeader.ThreadId, Event->EventHeader.ThreadId, CPU->LastSysEnterCounters);
+
+                    // NOTE: A suspended task region is on neither the running nor the suspended list, so
+                    // context switches leave it alone until the scheduler resumes it somewhere.
+                    u64 SuspendTSC = CPU->LastSysEnterTSC;
+                    CloseRegionOnCPU(Tracer, CPU, Region, PMCCount);
+                    RecordTimelinePoint(Region, PMCCount, 0, SuspendTSC, false);
+                }
+                else if(Opcode == TraceMarker_Resume)
+                {
+                    DEBUG_LOG(DebugLog_Resume, Region, Region->OnThreadID, Event->EventHeader.ThreadId, 0);
+
+                    // NOTE: The resuming thread is taken from the marker itself rather than written by the
+                    // caller, because events from the thread the task left may still be in flight.
+                    u32 ResumeThreadID = Event->EventHeader.ThreadId;
+                    if(Region->OnThreadID != ResumeThreadID)
+                    {
+                        ++Region->Results.ThreadHopCount;
+                        Region->OnThreadID = ResumeThreadID;
+                    }
+
+                    if(Region->OnCPUIndex != CPUID)
+                    {
+                        ++Region->Results.CPUMigrationCount;
+                    }
+
+                    OpenRegionOnCPU(Tracer, CPUID, Region);
+                }
+                else
+                {
+                    TraceError(Tracer, "Unrecognized ETW marker type");
+                }
+
+                if(ClientRegion)
+                {
+                    PublishClientRegion(ClientRegion, Opcode);
+                }
+            }
+        }
+        else if(GUIDsAreEqual(EventGUID, Win32ThreadEventGuid))
+        {
+            if(Opcode == WIN32_TRACE_OPCODE_SWITCH_THREAD)
+            {
+                Kind = TracerEvent_ContextSwitch;
+
+                if(Event->UserDataLength == 24)
+                {
+                    etw_thread_switch_userdata *Switch = (etw_thread_switch_userdata *)Event->UserData;
+
+                    // NOTE(casey): Get the PMC data once, since we may need it multiple times as we
+                    // process suspending and resuming regions
+                    if(CPU->FirstRunningRegion || Tracer->FirstSuspendedRegion)
+                    {
+                        Win32FindPMCData(Tracer, Event, PMCCount, PMCData);
+                    }
+
+                    // NOTE(casey): Suspend any existing regions running on this CPU core
+                    while(CPU->FirstRunningRegion)
+                    {
+                        pmc_traced_region *Region = CPU->FirstRunningRegion;
+
+                        DEBUG_LOG(DebugLog_SwitchFrom, Region, Switch->OldThreadId, Switch->NewThreadId, PMCData);
+
+                        if(Switch->OldThreadId != Region->OnThreadID)
+                        {
+                            TraceError(Tracer, "Switched thread ID mismatch");
+                        }
+
+                        // NOTE(casey): Apply the current PMCs as "ending" counters
+                        ApplyPMCsAsClose(Region, PMCCount, PMCData, TSC);
+                        if(Region->InKernel)
+                        {
+                            ApplyKernelPMCsAsClose(Region, PMCCount, PMCData, TSC);
+                        }
+
+                        // NOTE(casey): Record that this region has incurred a context switch
+                        ++Region->Results.ContextSwitchCount;
+
+                        RecordTimelinePoint(Region, PMCCount, 0, TSC, false);
+
+                        // NOTE(casey): Remove this region from the running set
+                        CPU->FirstRunningRegion = Region->Next;
+
+                        // NOTE(casey): Put this region on the suspended list
+                        Region->Next = Tracer->FirstSuspendedRegion;
+                        Tracer->FirstSuspendedRegion = Region;
+                    }
+
+                    // NOTE(casey): Look for matching region IDs that will be resumed
+                    pmc_traced_region **FindRegion = &Tracer->FirstSuspendedRegion;
+                    while(*FindRegion)
+                    {
+                        if((*FindRegion)->OnThreadID == Switch->NewThreadId)
+                        {
+                            pmc_traced_region *Region = *FindRegion;
+
+                            DEBUG_LOG(DebugLog_SwitchTo, Region, Switch->OldThreadId, Switch->NewThreadId, PMCData);
+
+                            // NOTE(casey): Apply the current PMCs as "begin" counters
+                            ApplyPMCsAsOpen(Region, PMCCount, PMCData, TSC);
+                            if(Region->InKernel)
+                            {
+                                ApplyKernelPMCsAsOpen(Region, PMCCount, PMCData, TSC);
+                            }
+
+                            // NOTE: Record whether the scheduler moved this region to a different core
+                            if(Region->OnCPUIndex != CPUID)
+                            {
+                                ++Region->Results.CPUMigrationCount;
+                                Region->OnCPUIndex = CPUID;
+                            }
+
+                            // NOTE(casey): Remove this region from the suspended list
+                            *FindRegion = (*FindRegion)->Next;
+
+                            // NOTE(casey): Put this region on the running list
+                            Region->Next = CPU->FirstRunningRegion;
+                            CPU->FirstRunningRegion = Region;
+                        }
+                        else
+                        {
+                            FindRegion = &(*FindRegion)->Next;
+                        }
+                    }
+                }
+                else
+                {
+                    TraceError(Tracer, "Unexpected CSwitch data size");
+                }
+            }
+        }
+        else if(GUIDsAreEqual(EventGUID, Win32DPCEventGuid))
+        {
+            if(Opcode == WIN32_TRACE_OPCODE_SYSTEMCALL_ENTER)
+            {
+                Kind = TracerEvent_SysEnter;
+
+                // NOTE(casey): Remember the state at this SysEnter so it can be applied to a
+                // region later if there is a following Close event.
+                if(CPU->FirstRunningRegion)
+                {
+                    CPU->LastSysEnterValid = true;
+                    CPU->LastSysEnterTSC = TSC;
+                    Win32FindPMCData(Tracer, Event, PMCCount, CPU->LastSysEnterCounters);
+
+                    // NOTE: Start a kernel span for every region already running on this core. A region that
+                    // is still waiting for its SysExit to start has nothing to split yet.
+                    for(pmc_traced_region *Region = CPU->FirstRunningRegion; Region; Region = Region->Next)
+                    {
+                        if(Region != CPU->WaitingForSysExitToStart)
+                        {
+                            ApplyKernelPMCsAsOpen(Region, PMCCount, CPU->LastSysEnterCounters, TSC);
+                            Region->InKernel = true;
+
+                            RecordTimelinePoint(Region, PMCCount, CPU->LastSysEnterCounters, TSC, false);
+                        }
+                    }
+
+                    DEBUG_LOG(DebugLog_SysEnter, CPU->FirstRunningRegion, Event->EventHeader.ThreadId, Event->EventHeader.ThreadId, CPU->LastSysEnterCounters);
+                }
+                else
+                {
+                    DEBUG_LOG(DebugLog_SysEnter, 0, Event->EventHeader.ThreadId, Event->EventHeader.ThreadId, 0);
+                }
+            }
+            else if(((Opcode == WIN32_TRACE_OPCODE_PMC_INTERRUPT) || (Opcode == WIN32_TRACE_OPCODE_SAMPLED_PROFILE)) &&
+                    Tracer->Samples)
+            {
+                if(Event->UserDataLength >= sizeof(etw_sampled_profile_userdata))
+                {
+                    etw_sampled_profile_userdata *Sample = (etw_sampled_profile_userdata *)Event->UserData;
+
+                    // NOTE: Regions are pushed on the front of the running list as they open, so the first match
+                    // is the innermost region open on the sampled thread. A region still waiting for its SysExit
+                    // hasn't started counting, so it doesn't get samples either.
+                    for(pmc_traced_region *Region = CPU->FirstRunningRegion; Region; Region = Region->Next)
+                    {
+                        if((Region->OnThreadID == Sample->ThreadId) && (Region != CPU->WaitingForSysExitToStart))
+                        {
+                            QueuePMCSample(Tracer, Region, Sample, TSC);
+                            break;
+                        }
+                    }
+                }
+                else
+                {
+                    TraceError(Tracer, "Unexpected profile sample data size");
+                }
+            }
+            else if(Opcode == WIN32_TRACE_OPCODE_SYSTEMCALL_EXIT)
+            {
+                Kind = TracerEvent_SysExit;
+
+                if(CPU->FirstRunningRegion)
+                {
+                    Win32FindPMCData(Tracer, Event, PMCCount, PMCData);
+
+                    // NOTE: End the kernel span of every region that was running when this syscall entered
+                    for(pmc_traced_region *Region = CPU->FirstRunningRegion; Region; Region = Region->Next)
+                    {
+                        if(Region->InKernel)
+                        {
+                            ApplyKernelPMCsAsClose(Region, PMCCount, PMCData, TSC);
+                            Region->InKernel = false;
+                            ++Region->Results.SysCallCount;
+
+                            RecordTimelinePoint(Region, PMCCount, PMCData, TSC, false);
+                        }
+                    }
+                }
+
+                // NOTE(casey): If there was a region waiting to open on the next syscall exit,
+                // apply the PMCs to that region
+                if(CPU->WaitingForSysExitToStart)
+                {
+                    pmc_traced_region *Region = CPU->WaitingForSysExitToStart;
+                    CPU->WaitingForSysExitToStart = 0;
+
+                    ApplyPMCsAsOpen(Region, PMCCount, PMCData, TSC);
+
+                    DEBUG_LOG(DebugLog_SysExit, Region, Event->EventHeader.ThreadId, Event->EventHeader.ThreadId, PMCData);
+                }
+                else
+                {
+                    DEBUG_LOG(DebugLog_SysExit, 0, Event->EventHeader.ThreadId, Event->EventHeader.ThreadId, 0);
+                }
+            }
+        }
+    }
+    else
+    {
+        TraceError(Tracer, "Out-of-bounds CPUID in ETW event");
+    }
+
+    pmc_tracer_event_kind_stats *KindStats = &Stats->Kinds[Kind];
+    ++KindStats->EventCount;
+    KindStats->CallbackTSC += __rdtsc() - CallbackStartTSC;
+}
+
+static DWORD CALLBACK Win32ProcessEventThread(void *Arg)
+{
+    TRACEHANDLE Session = (TRACEHANDLE)Arg;
+    ProcessTrace(&Session, 1, 0, 0);
+    return 0;
+}
+
+static ULONG WINAPI ControlCallback(WMIDPREQUESTCODE RequestCode, void *Context, ULONG *, void *Buffer)
+{
+    // NOTE: Only a daemon client registers with a context. Its markers go to whichever session the daemon
+    // enabled the marker provider on, so it keeps the logger handle it is given here.
+    pmc_tracer *Tracer = (pmc_tracer *)Context;
+    if(Tracer)
+    {
+        if(RequestCode == WMI_ENABLE_EVENTS)
+        {
+            Tracer->TraceHandle = GetTraceLoggerHandle(Buffer);
+        }
+        else if(RequestCode == WMI_DISABLE_EVENTS)
+        {
+            Tracer->TraceHandle = 0;
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+
+static b32 IsValid(pmc_source_mapping *Mapping)
+{
+    b32 Result = Mapping->Valid;
+    return Result;
+}
+
+static pmc_source_mapping MapPMCNames(pmc_name_array *SourceNames)
+{
+    pmc_source_mapping Result = {};
+
+    ULONG BufferSize;
+    TraceQueryInformation(0, TraceProfileSourceListInfo, 0, 0, &BufferSize);
+    BYTE *Buffer = (BYTE *)Win32AllocateSize(BufferSize);
+    if(Buffer)
+    {
+        if(TraceQueryInformation(0, TraceProfileSourceListInfo, Buffer, BufferSize, &BufferSize) == ERROR_SUCCESS)
+        {
+            u32 FoundCount = 0;
+
+            for(PROFILE_SOURCE_INFO *Info = (PROFILE_SOURCE_INFO *)Buffer;
+                ;
+                Info = (PROFILE_SOURCE_INFO *)((u8 *)Info + Info->NextEntryOffset))
+            {
+                for(u32 SourceNameIndex = 0; SourceNameIndex < ArrayCount(SourceNames->Strings); ++SourceNameIndex)
+                {
+                    wchar_t const *SourceString = SourceNames->Strings[SourceNameIndex];
+                    if(SourceString)
+                    {
+                        u32 CheckMax = SourceNameIndex + 1;
+                        if(Result.PMCCount < CheckMax)
+                        {
+                            Result.PMCCount = CheckMax;
+                        }
+                        if(lstrcmpW(Info->Description, SourceString) == 0)
+                        {
+                            Result.SourceIndex[SourceNameIndex] = Info->Source;
+                            ++FoundCount;
+                            break;
+                        }
+                    }
+                }
+
+                if(Info->NextEntryOffset == 0)
+                {
+                    break;
+                }
+            }
+
+            Result.Valid = (Result.PMCCount == FoundCount);
+        }
+    }
+
+    Win32Deallocate(Buffer);
+
+    // NOTE: Intel exposes a core cycle counter as UnhaltedCoreCycles, and TotalCycles is the generic profile source
+    // name for one. Either can stand in for rdpru when EnableCoreCycles is called.
+    for(u32 SourceNameIndex = 0; SourceNameIndex < Result.PMCCount; ++SourceNameIndex)
+    {
+        wchar_t const *SourceString = SourceNames->Strings[SourceNameIndex];
+        if(SourceString && !Result.HasCoreCycles &&
+           ((lstrcmpW(SourceString, L"UnhaltedCoreCycles") == 0) || (lstrcmpW(SourceString, L"TotalCycles") == 0)))
+        {
+            Result.CoreCycleIndex = SourceNameIndex;
+            Result.HasCoreCycles = true;
+        }
+    }
+
+    return Result;
+}
+
+static pmc_sampling_mapping MapPMCSamplingSource(wchar_t const *SourceName, u32 Interval)
+{
+    pmc_sampling_mapping Result = {};
+
+    ULONG BufferSize;
+    TraceQueryInformation(0, TraceProfileSourceListInfo, 0, 0, &BufferSize);
+    BYTE *Buffer = (BYTE *)Win32AllocateSize(BufferSize);
+    if(Buffer)
+    {
+        if(TraceQueryInformation(0, TraceProfileSourceListInfo, Buffer, BufferSize, &BufferSize) == ERROR_SUCCESS)
+        {
+            for(PROFILE_SOURCE_INFO *Info = (PROFILE_SOURCE_INFO *)Buffer;
+                ;
+                Info = (PROFILE_SOURCE_INFO *)((u8 *)Info + Info->NextEntryOffset))
+            {
+                if(lstrcmpW(Info->Description, SourceName) == 0)
+                {
+                    // NOTE: The interval is clamped to what the CPU supports, since asking for a tiny interval
+                    // is the one way to make sampling overhead unbounded.
+                    Result.SourceIndex = Info->Source;
+                    Result.Interval = Interval;
+                    if(Result.Interval < Info->MinInterval)
+                    {
+                        Result.Interval = Info->MinInterval;
+                    }
+                    if(Info->MaxInterval && (Result.Interval > Info->MaxInterval))
+                    {
+                        Result.Interval = Info->MaxInterval;
+                    }
+                    Result.Valid = true;
+                    break;
+                }
+
+                if(Info->NextEntryOffset == 0)
+                {
+                    break;
+                }
+            }
+        }
+    }
+
+    Win32Deallocate(Buffer);
+
+    return Result;
+}
+
+static void RestoreTraceSamplingInterval(pmc_tracer *Tracer)
+{
+    if(Tracer->SamplingIntervalSet)
+    {
+        TraceSetInformation(0, TraceSampledProfileIntervalInfo, &Tracer->SavedSamplingInterval,
+                            sizeof(Tracer->SavedSamplingInterval));
+        Tracer->SamplingIntervalSet = false;
+    }
+}
+
+static void SetTraceSamplingSource(pmc_tracer *Tracer, pmc_sampling_mapping *Sampling)
+{
+    // NOTE: The sampling interval is machine-wide rather than per session, so the previous interval is saved
+    // first and put back by StopTracing, or right here if the source can't be selected
+    TRACE_PROFILE_INTERVAL Saved = {};
+    Saved.Source = Sampling->SourceIndex;
+    ULONG SavedSize = 0;
+    ULONG QueryStatus = TraceQueryInformation(0, TraceSampledProfileIntervalInfo, &Saved, sizeof(Saved), &SavedSize);
+    if(QueryStatus == ERROR_SUCCESS)
+    {
+        TRACE_PROFILE_INTERVAL Interval = {};
+        Interval.Source = Sampling->SourceIndex;
+        Interval.Interval = Sampling->Interval;
+
+        ULONG IntervalStatus = TraceSetInformation(0, TraceSampledProfileIntervalInfo, &Interval, sizeof(Interval));
+        if(IntervalStatus == ERROR_SUCCESS)
+        {
+            Tracer->SavedSamplingInterval = Saved;
+            Tracer->SamplingIntervalSet = true;
+
+            ULONG Source = Sampling->SourceIndex;
+            ULONG SourceStatus = TraceSetInformation(Tracer->TraceHandle, TraceProfileSourceConfigInfo, &Source, sizeof(Source));
+            if(SourceStatus != ERROR_SUCCESS)
+            {
+                RestoreTraceSamplingInterval(Tracer);
+                TraceError(Tracer, "Unable to select sampling source");
+            }
+        }
+        else
+        {
+            TraceError(Tracer, "Unable to set sampling interval");
+        }
+    }
+    else
+    {
+        TraceError(Tracer, "Unable to query sampling interval");
+    }
+}
+
+static void SetTracePMCSources(pmc_tracer *Tracer, pmc_source_mapping *Mapping)
+{
+    ULONG Status = TraceSetInformation(Tracer->TraceHandle, TracePmcCounterListInfo,
+                                       Mapping->SourceIndex, Mapping->PMCCount * sizeof(Mapping->SourceIndex[0]));
+    if(Status != ERROR_SUCCESS)
+    {
+        TraceError(Tracer, "Unable to select PMCs");
+    }
+
+    CLASSIC_EVENT_ID EventIDs[] =
+    {
+        {Win32ThreadEventGuid, WIN32_TRACE_OPCODE_SWITCH_THREAD},
+        {Win32DPCEventGuid, WIN32_TRACE_OPCODE_SYSTEMCALL_ENTER},
+        {Win32DPCEventGuid, WIN32_TRACE_OPCODE_SYSTEMCALL_EXIT},
+    };
+
+    ULONG EventListStatus = TraceSetInformation(Tracer->TraceHandle, TracePmcEventListInfo, EventIDs, sizeof(EventIDs));
+    if(EventListStatus != ERROR_SUCCESS)
+    {
+        TraceError(Tracer, "Unable to select events");
+    }
+}
+
+static void Win32RegisterTraceMarker(pmc_tracer *Tracer, void *Context)
+{
+    TRACE_GUID_REGISTRATION MarkerEventClassGuids[] = {(LPGUID)&TraceMarkerCategoryGuid, 0};
+    ULONG Status = RegisterTraceGuids((WMIDPREQUEST)ControlCallback, Context, (LPGUID)&TraceMarkerProviderGuid,
+                                      sizeof(MarkerEventClassGuids)/sizeof(TRACE_GUID_REGISTRATION),
+                                      MarkerEventClassGuids,
+                                      0, 0, &Tracer->MarkerRegistrationHandle);
+    if(Status != ERROR_SUCCESS)
+    {
+        TraceError(Tracer, "ETW marker registration failed");
+    }
+}
+
+static void Win32CreateTrace(pmc_tracer *Tracer, pmc_source_mapping *SourceMapping, WCHAR const *TraceName)
+{
+    EVENT_TRACE_PROPERTIES_V2 *Props = &Tracer->Win32TraceDesc.Properties;
+    Props->Wnode.BufferSize = sizeof(Tracer->Win32TraceDesc);
+    Props->LoggerNameOffset = offsetof(win32_trace_description, Name);
+
+    // NOTE(casey): Attempt to stop any existing orphaned trace from a previous run
+    ControlTraceW(0, TraceName, (EVENT_TRACE_PROPERTIES *)Props, EVENT_TRACE_CONTROL_STOP);
+
+    /* NOTE(casey): Attempt to start the trace. Note that the fields we care about MUST
+       be filled in after the EVENT_TRACE_CONTROL_STOP ControlTraceW call, because
+       that call will overwrite the properties! */
+    Props->Wnode.ClientContext = 3;
+    Props->Wnode.Flags = WNODE_FLAG_TRACED_GUID | WNODE_FLAG_VERSIONED_PROPERTIES;
+    Props->LogFileMode = EVENT_TRACE_REAL_TIME_MODE | EVENT_TRACE_SYSTEM_LOGGER_MODE;
+    Props->VersionNumber = 2;
+    Props->EnableFlags = EVENT_TRACE_FLAG_CSWITCH | EVENT_TRACE_FLAG_NO_SYSCONFIG | EVENT_TRACE_FLAG_SYSTEMCALL;
+    if(Tracer->Sampling.Valid)
+    {
+        Props->EnableFlags |= EVENT_TRACE_FLAG_PROFILE;
+    }
+    ULONG StartStatus = StartTraceW(&Tracer->TraceHandle, TraceName, (EVENT_TRACE_PROPERTIES*)Props);
+
+    if(StartStatus != ERROR_SUCCESS)
+    {
+        TraceError(Tracer, "Unable to start trace - may occur if not run as admin");
+    }
+
+    Tracer->Mapping = *SourceMapping;
+    if(IsValid(&Tracer->Mapping))
+    {
+        SetTracePMCSources(Tracer, &Tracer->Mapping);
+    }
+    else
+    {
+        TraceError(Tracer, "PMC source mapping failed");
+    }
+
+    if(Tracer->Sampling.Valid && NoErrors(Tracer))
+    {
+        SetTraceSamplingSource(Tracer, &Tracer->Sampling);
+    }
+
+    EVENT_TRACE_LOGFILEW Log = {};
+    Log.LoggerName = Tracer->Win32TraceDesc.Name;
+    Log.EventRecordCallback = Win32ProcessETWEvent;
+    Log.ProcessTraceMode = PROCESS_TRACE_MODE_EVENT_RECORD | PROCESS_TRACE_MODE_RAW_TIMESTAMP | PROCESS_TRACE_MODE_REAL_TIME;
+    Log.Context = Tracer;
+
+    Tracer->TraceSession = OpenTraceW(&Log);
+    if(Tracer->TraceSession == INVALID_PROCESSTRACE_HANDLE)
+    {
+        TraceError(Tracer, "Unable to open trace");
+    }
+
+    Tracer->ProcessingThread = CreateThread(0, 0, Win32ProcessEventThread, (void *)Tracer->TraceSession, 0,
+                                            &Tracer->ProcessingThreadID);
+    if(Tracer->ProcessingThread == 0)
+    {
+        TraceError(Tracer, "Unable to create processing thread");
+    }
+
+    // NOTE: A tracer that failed to start may never be stopped, so it must not leave the machine-wide interval changed
+    if(!NoErrors(Tracer))
+    {
+        RestoreTraceSamplingInterval(Tracer);
+    }
+}
+
+static void Win32StartTracing(pmc_tracer *Tracer, pmc_source_mapping *SourceMapping, pmc_sampling_mapping *Sampling,
+                              WCHAR const *TraceName)
+{
+    *Tracer = {};
+
+    Tracer->TraceKey = __rdtsc();
+
+    LARGE_INTEGER StartQPC;
+    QueryPerformanceCounter(&StartQPC);
+    Tracer->StartTSC = __rdtsc();
+    Tracer->StartQPC = StartQPC.QuadPart;
+
+#if PMC_DEBUG_LOG
+    Tracer->Log = (pmc_debug_log_entry *)Win32AllocateSize(PMC_DEBUG_LOG_ENTRY_COUNT*sizeof(pmc_debug_log_entry));
+#endif
+
+    SYSTEM_INFO SysInfo = {};
+    GetSystemInfo(&SysInfo);
+    Tracer->CPUCount = SysInfo.dwNumberOfProcessors;
+
+    Tracer->CPUs = (pmc_tracer_cpu *)Win32AllocateSize(Tracer->CPUCount * sizeof(pmc_tracer_cpu));
+    Tracer->Captures = (pmc_capture *)Win32AllocateSize(PMC_CAPTURE_QUEUE_SIZE * sizeof(pmc_capture));
+    if(Sampling)
+    {
+        if(Sampling->Valid)
+        {
+            Tracer->Sampling = *Sampling;
+            Tracer->Samples = (pmc_ip_sample *)Win32AllocateSize(PMC_SAMPLE_QUEUE_SIZE * sizeof(pmc_ip_sample));
+            if(!Tracer->Samples)
+            {
+                TraceError(Tracer, "Unable to allocate memory for IP samples");
+            }
+        }
+        else
+        {
+            TraceError(Tracer, "PMC sampling source mapping failed");
+        }
+    }
+
+    if(Tracer->CPUs && Tracer->Captures)
+    {
+        Win32RegisterTraceMarker(Tracer, 0);
+        Win32CreateTrace(Tracer, SourceMapping, TraceName);
+    }
+    else
+    {
+        TraceError(Tracer, "Unable to allocate memory for CPU core tracking");
+    }
+}
+
+static void StartTracing(pmc_tracer *Tracer, pmc_source_mapping *SourceMapping, pmc_sampling_mapping *Sampling)
+{
+    Win32StartTracing(Tracer, SourceMapping, Sampling, PMC_TRACE_NAME);
+}
+
+static void StartTracing(pmc_tracer *Tracer, pmc_source_mapping *SourceMapping)
+{
+    StartTracing(Tracer, SourceMapping, 0);
+}
+
+static void Win32InsertTraceMarker(pmc_tracer *Tracer, pmc_traced_region *ResultDest, trace_marker_type Type,
+                                   char const *ErrorMessage, u64 Payload)
+{
+    pmc_tracer_etw_marker TraceMarker = {};
+    TraceMarker.Header.Size = sizeof(TraceMarker);
+    TraceMarker.Header.Flags = WNODE_FLAG_TRACED_GUID;
+    TraceMarker.Header.Guid = TraceMarkerCategoryGuid;
+    TraceMarker.Header.Class.Type = (UCHAR)Type;
+
+    TraceMarker.UserData.TraceKey = Tracer->TraceKey;
+    TraceMarker.UserData.Dest = ResultDest;
+    TraceMarker.UserData.Payload = Payload;
+
+    if(TraceEvent(Tracer->TraceHandle, &TraceMarker.Header) != ERROR_SUCCESS)
+    {
+        TraceError(Tracer, ErrorMessage);
+    }
+}
+
+static void Win32InsertTraceMarker(pmc_tracer *Tracer, pmc_traced_region *ResultDest, trace_marker_type Type,
+                                   char const *ErrorMessage)
+{
+    Win32InsertTraceMarker(Tracer, ResultDest, Type, ErrorMessage, 0);
+}
+
+static void ServePMCClients(pmc_tracer *Tracer)
+{
+    if(NoErrors(Tracer))
+    {
+        Tracer->Clients = (pmc_shared_client *)Win32AllocateSize(MAX_PMC_CLIENT_COUNT * sizeof(pmc_shared_client));
+        if(Tracer->Clients)
+        {
+            _mm_mfence();
+            Tracer->ServesClients = true;
+
+            // NOTE: Enabling the marker provider on this session is what hands every client process a logger
+            // handle for it, including clients that register later
+            ULONG Status = EnableTraceEx2(Tracer->TraceHandle, &TraceMarkerProviderGuid, EVENT_CONTROL_CODE_ENABLE_PROVIDER,
+                                          TRACE_LEVEL_VERBOSE, 0, 0, 0, 0);
+            if(Status != ERROR_SUCCESS)
+            {
+                TraceError(Tracer, "Unable to enable the marker provider for clients");
+            }
+        }
+        else
+        {
+            TraceError(Tracer, "Unable to allocate memory for the client table");
+        }
+    }
+}
+
+static void StartPMCDaemon(pmc_tracer *Tracer, pmc_source_mapping *SourceMapping)
+{
+    // NOTE: Windows releases the mutex if the daemon dies, so when it can be created fresh, any session left under
+    // the daemon's name is an orphan that Win32CreateTrace may stop
+    HANDLE Mutex = CreateMutexW(0, TRUE, PMC_DAEMON_MUTEX_NAME);
+    b32 AlreadyRunning = (Mutex && (GetLastError() == ERROR_ALREADY_EXISTS));
+    if(Mutex && !AlreadyRunning)
+    {
+        Win32StartTracing(Tracer, SourceMapping, 0, PMC_DAEMON_TRACE_NAME);
+        Tracer->DaemonMutex = Mutex;
+        if(Tracer->Mapping.HasCoreCycles)
+        {
+            Tracer->CoreCycleSource = CoreCycles_PMC;
+        }
+        ServePMCClients(Tracer);
+    }
+    else
+    {
+        *Tracer = {};
+        TraceError(Tracer, AlreadyRunning ? "A PMC trace daemon is already running" : "Unable to create the PMC trace daemon mutex");
+        if(Mutex)
+        {
+            CloseHandle(Mutex);
+        }
+    }
+}
+
+static void Win32DisconnectFromDaemon(pmc_tracer *Tracer)
+{
+    if(Tracer->TraceHandle && Tracer->SharedBase)
+    {
+        Win32InsertTraceMarker(Tracer, (pmc_traced_region *)Tracer->SharedBase, TraceMarker_Detach, "Unable to insert ETW detach marker");
+    }
+
+    if(Tracer->MarkerRegistrationHandle)
+    {
+        UnregisterTraceGuids(Tracer->MarkerRegistrationHandle);
+    }
+
+    if(Tracer->SharedBase)
+    {
+        UnmapViewOfFile(Tracer->SharedBase);
+    }
+
+    if(Tracer->SharedSection)
+    {
+        CloseHandle(Tracer->SharedSection);
+    }
+}
+
+static void StopTracing(pmc_tracer *Tracer)
+{
+    if(Tracer->IsClient)
+    {
+        Win32DisconnectFromDaemon(Tracer);
+        return;
+    }
+
+    // TODO(casey): Try to verify that 0 is never a valid trace handle - it's unclear from the documentation
+    if(Tracer->TraceHandle)
+    {
+        ControlTraceW(Tracer->TraceHandle, 0, (EVENT_TRACE_PROPERTIES *)&Tracer->Win32TraceDesc.Properties, EVENT_TRACE_CONTROL_STOP);
+    }
+
+    RestoreTraceSamplingInterval(Tracer);
+
+    if(Tracer->DaemonMutex)
+    {
+        ReleaseMutex(Tracer->DaemonMutex);
+        CloseHandle(Tracer->DaemonMutex);
+    }
+
+    if(Tracer->TraceSession != INVALID_PROCESSTRACE_HANDLE)
+    {
+        CloseTrace(Tracer->TraceSession);
+    }
+
+    if(Tracer->ProcessingThread)
+    {
+        WaitForSingleObject(Tracer->ProcessingThread, INFINITE);
+        CloseHandle(Tracer->ProcessingThread);
+    }
+
+    if(Tracer->MarkerRegistrationHandle)
+    {
+        UnregisterTraceGuids(Tracer->MarkerRegistrationHandle);
+    }
+
+    // NOTE: The processing thread has exited, so any clients still attached can be released directly
+    if(Tracer->Clients)
+    {
+        for(u32 ClientIndex = 0; ClientIndex < MAX_PMC_CLIENT_COUNT; ++ClientIndex)
+        {
+            if(Tracer->Clients[ClientIndex].TraceKey)
+            {
+                DetachClient(Tracer, &Tracer->Clients[ClientIndex]);
+            }
+        }
+    }
+
+#if PMC_DEBUG_LOG
+    Win32Deallocate(Tracer->Log);
+    while(Tracer->LogText)
+    {
+        pmc_debug_log_text *Text = Tracer->LogText;
+        Tracer->LogText = Text->Prev;
+        Win32Deallocate(Text);
+    }
+#endif
+    Win32Deallocate(Tracer->Aggregates);
+    Win32Deallocate((void *)Tracer->ReadPRU);
+    Win32Deallocate(Tracer->Clients);
+    Win32Deallocate(Tracer->Samples);
+    Win32Deallocate(Tracer->Captures);
+    Win32Deallocate(Tracer->CPUs);
+}
+
+static void ConnectToPMCDaemon(pmc_tracer *Tracer, u64 SharedMemorySize)
+{
+    *Tracer = {};
+
+    Tracer->IsClient = true;
+    Tracer->TraceKey = __rdtsc();
+
+    Tracer->SharedSize = SharedMemorySize;
+    Tracer->SharedUsed = PMC_SHARED_HEADER_SIZE;
+    Tracer->SharedSection = CreateFileMappingW(INVALID_HANDLE_VALUE, 0, PAGE_READWRITE,
+                                               (DWORD)(SharedMemorySize >> 32), (DWORD)SharedMemorySize, 0);
+    if(Tracer->SharedSection)
+    {
+        Tracer->SharedBase = (u8 *)MapViewOfFile(Tracer->SharedSection, FILE_MAP_ALL_ACCESS, 0, 0, SharedMemorySize);
+    }
+
+    if(Tracer->SharedBase)
+    {
+        pmc_shared_client_header *Header = (pmc_shared_client_header *)Tracer->SharedBase;
+        Header->Size = SharedMemorySize;
+
+        // NOTE: If a daemon is serving, registering calls ControlCallback with its logger handle right away
+        Win32RegisterTraceMarker(Tracer, Tracer);
+
+        DWORD StartTicks = GetTickCount();
+        while(NoErrors(Tracer) && !*(TRACEHANDLE volatile *)&Tracer->TraceHandle &&
+              ((GetTickCount() - StartTicks) < PMC_DAEMON_CONNECT_TIMEOUT_MS))
+        {
+            Sleep(1);
+        }
+
+        if(*(TRACEHANDLE volatile *)&Tracer->TraceHandle)
+        {
+            Win32InsertTraceMarker(Tracer, (pmc_traced_region *)Tracer->SharedBase, TraceMarker_Attach,
+                                   "Unable to insert ETW attach marker", (u64)Tracer->SharedSection);
+            while(NoErrors(Tracer) && !Header->Attached &&
+                  ((GetTickCount() - StartTicks) < PMC_DAEMON_CONNECT_TIMEOUT_MS))
+            {
+                Sleep(1);
+            }
+
+            if(Header->Attached)
+            {
+                _mm_mfence();
+                Tracer->Mapping.PMCCount = Header->PMCCount;
+                Tracer->Mapping.CoreCycleIndex = Header->CoreCycleIndex;
+                Tracer->Mapping.HasCoreCycles = Header->HasCoreCycles;
+                Tracer->Mapping.Valid = true;
+            }
+            else
+            {
+                TraceError(Tracer, "PMC trace daemon did not attach this client");
+            }
+        }
+        else
+        {
+            TraceError(Tracer, "No PMC trace daemon is running");
+        }
+    }
+    else
+    {
+        TraceError(Tracer, "Unable to create shared memory for the PMC trace daemon");
+    }
+}
+
+static void *AllocateSharedPMCMemory(pmc_tracer *Tracer, u64 Size)
+{
+    void *Result = 0;
+    if(Tracer->IsClient)
+    {
+        // NOTE: Allocations are cache-line aligned and never freed, so this is just a bump of the used size
+        u64 AlignedSize = (Size + 63) & ~63ull;
+        u64 Offset = InterlockedExchangeAdd64((LONG64 volatile *)&Tracer->SharedUsed, (LONG64)AlignedSize);
+        if((Offset + AlignedSize) <= Tracer->SharedSize)
+        {
+            Result = Tracer->SharedBase + Offset;
+        }
+    }
+
+    return Result;
+}
+
+static void StartTimelinePMCs(pmc_tracer *Tracer, pmc_traced_region *ResultDest, u32 SiteID, pmc_timeline *Timeline)
+{
+    if(Timeline)
+    {
+        Timeline->PointCount = 0;
+        Timeline->Stride = 1;
+        ResetTimelineBase(Timeline);
+    }
+    ResultDest->Timeline = Timeline;
+
+    /* TODO(casey): Is this necessary, or is it safe to pick up the thread index from the OPEN marker?
+       If we never see an error where the open marker differs from the thread ID recorded here, then
+       presumably this is not necessary, */
+    ResultDest->OnThreadID = GetCurrentThreadId();
+    ResultDest->Results = {};
+    ResultDest->Results.PMCCount = Tracer->Mapping.PMCCount;
+    ResultDest->Results.InvocationCount = 1;
+    ResultDest->Results.SiteID = SiteID;
+
+    ResultDest->CoreCycleSource = Tracer->CoreCycleSource;
+    if(Tracer->CoreCycleSource == CoreCycles_APERF)
+    {
+        __rdtscp(&ResultDest->StartCPU);
+        ResultDest->StartMPERF = Tracer->ReadPRU(RDPRU_MPERF);
+        ResultDest->StartAPERF = Tracer->ReadPRU(RDPRU_APERF);
+    }
+
+    Win32InsertTraceMarker(Tracer, ResultDest, TraceMarker_Open, "Unable to insert ETW open marker");
+}
+
+static void StartCountingPMCs(pmc_tracer *Tracer, pmc_traced_region *ResultDest, u32 SiteID)
+{
+    StartTimelinePMCs(Tracer, ResultDest, SiteID, 0);
+}
+
+static void StartCountingPMCs(pmc_tracer *Tracer, pmc_traced_region *ResultDest)
+{
+    StartCountingPMCs(Tracer, ResultDest, 0);
+}
+
+static void StopCountingPMCs(pmc_tracer *Tracer, pmc_traced_region *ResultDest)
+{
+    /* TODO(casey): In some circumstances, I believe this can fail due to ETW's internal buffers being
+       full. In that case, I _think_ it should be possible to mark the particular trace results as
+       invalid, but keep trying to issue the TraceEvent, succeed, and then continune without having
+       to error out of the entire run. However, I have not found a reliable repro case for this
+       yet, so I haven't yet tried to implement such a recovery case. */
+    if(Tracer->CoreCycleSource == CoreCycles_APERF)
+    {
+        ResultDest->StopAPERF = Tracer->ReadPRU(RDPRU_APERF);
+        ResultDest->StopMPERF = Tracer->ReadPRU(RDPRU_MPERF);
+        __rdtscp(&ResultDest->StopCPU);
+    }
+
+    Win32InsertTraceMarker(Tracer, ResultDest, TraceMarker_Close, "Unable to insert ETW close marker");
+}
+
+static void SuspendCountingPMCs(pmc_tracer *Tracer, pmc_traced_region *ResultDest)
+{
+    Win32InsertTraceMarker(Tracer, ResultDest, TraceMarker_Suspend, "Unable to insert ETW suspend marker");
+}
+
+static void ResumeCountingPMCs(pmc_tracer *Tracer, pmc_traced_region *ResultDest)
+{
+    // NOTE: OnThreadID is deliberately not touched here - the processing thread updates it from the resume
+    // marker, since it may still be handling events from the thread the task was suspended on.
+    Win32InsertTraceMarker(Tracer, ResultDest, TraceMarker_Resume, "Unable to insert ETW resume marker");
+}
+
+static void StartAccumulatingPMCs(pmc_tracer *Tracer, pmc_accumulated_region *Accumulated)
+{
+    // NOTE: This is the same value every time, so rewriting it while an earlier pair is processed is harmless
+    Accumulated->Region.CoreCycleSource = Tracer->CoreCycleSource;
+    Win32InsertTraceMarker(Tracer, &Accumulated->Region, TraceMarker_OpenAccumulating, "Unable to insert ETW open marker");
+}
+
+static void StopAccumulatingPMCs(pmc_tracer *Tracer, pmc_accumulated_region *Accumulated)
+{
+    Win32InsertTraceMarker(Tracer, &Accumulated->Region, TraceMarker_Close, "Unable to insert ETW close marker");
+}
+
+static void FlushAccumulatedPMCs(pmc_tracer *Tracer, pmc_accumulated_region *Accumulated)
+{
+    Accumulated->Flushed.Completed = false;
+    Win32InsertTraceMarker(Tracer, &Accumulated->Region, TraceMarker_Flush, "Unable to insert ETW flush marker");
+}
+
+static void StartPhasedPMCs(pmc_tracer *Tracer, pmc_phased_region *Phased, u32 SiteID, pmc_timeline *Timeline)
+{
+    Phased->CompletedPhaseCount = 0;
+    Phased->DroppedLapCount = 0;
+    StartTimelinePMCs(Tracer, &Phased->Region, SiteID, Timeline);
+}
+
+static void StartPhasedPMCs(pmc_tracer *Tracer, pmc_phased_region *Phased, u32 SiteID)
+{
+    StartPhasedPMCs(Tracer, Phased, SiteID, 0);
+}
+
+static void LapPMCs(pmc_tracer *Tracer, pmc_phased_region *Phased)
+{
+    Win32InsertTraceMarker(Tracer, &Phased->Region, TraceMarker_Lap, "Unable to insert ETW lap marker");
+}
+
+static void StopPhasedPMCs(pmc_tracer *Tracer, pmc_phased_region *Phased)
+{
+    StopCountingPMCs(Tracer, &Phased->Region);
+}
+
+static b32 IsComplete(pmc_traced_region *Region)
+{
+    b32 Result = Region->Results.Completed;
+    return Result;
+}
+
+static pmc_trace_result GetOrWaitForResult(pmc_tracer *Tracer, pmc_traced_region *Region)
+{
+    while(NoErrors(Tracer) && !IsComplete(Region))
+    {
+        /* NOTE(casey): This is a spin-lock loop on purpose, because if there was a Sleep() in here
+           or some other yield, it might cause Windows to demote this region, which we don't want.
+           Ideally, we rarely spin here, because there are enough traces in flight to ensure that,
+           whenever we check for results, there are some waiting, except perhaps at the very end of a
+           batch. */
+
+        _mm_pause();
+    }
+
+    _mm_mfence(); // NOTE(casey): This is a stronger memory barrier than necessary, but should not be harmful
+
+    pmc_trace_result Result = Region->Results;
+    return Result;
+}
+
+static pmc_trace_result GetOrWaitForFlushedResult(pmc_tracer *Tracer, pmc_accumulated_region *Accumulated)
+{
+    while(NoErrors(Tracer) && !Accumulated->Flushed.Completed)
+    {
+        // NOTE: Spins for the same reason as GetOrWaitForResult
+        _mm_pause();
+    }
+
+    _mm_mfence();
+
+    pmc_trace_result Result = Accumulated->Flushed;
+    return Result;
+}
+
+static pmc_phased_result GetOrWaitForPhasedResult(pmc_tracer *Tracer, pmc_phased_region *Phased)
+{
+    pmc_phased_result Result = {};
+
+    // NOTE: The last phase completes with the region itself, and every earlier phase was written before it
+    pmc_trace_result LastPhase = GetOrWaitForResult(Tracer, &Phased->Region);
+
+    u32 CompletedPhaseCount = Phased->CompletedPhaseCount;
+    for(u32 PhaseIndex = 0; PhaseIndex < CompletedPhaseCount; ++PhaseIndex)
+    {
+        Result.Phases[Result.PhaseCount++] = Phased->CompletedPhases[PhaseIndex];
+    }
+    Result.Phases[Result.PhaseCount++] = LastPhase;
+    Result.DroppedLapCount = Phased->DroppedLapCount;
+
+    return Result;
 }
 
-static b32 IsValid(pmc_source_mapping *Mapping)
+// NOTE: Enough work that the few hundred instructions between the async open and the first rdpmc are well inside
+// the tolerance, and few enough tries that a machine which keeps switching threads away doesn't stall the caller
+#define PMC_SYNC_CHECK_WORK_COUNT (1024*1024)
+#define PMC_SYNC_CHECK_TRY_COUNT 4
+
+static u64 RunSyncCheckWork(void)
 {
-    b32 Result = Mapping->Valid;
-    return Result;
+    u64 volatile Sum = 0;
+    for(u64 Index = 0; Index < PMC_SYNC_CHECK_WORK_COUNT; ++Index)
+    {
+        Sum += Index;
+    }
+    return Sum;
 }
 
-static pmc_source_mapping MapPMCNames(pmc_name_array *SourceNames)
+static b32 CrossCheckSyncPMCs(pmc_tracer *Tracer)
 {
-    pmc_source_mapping Result = {};
+    // NOTE: rdpmc takes a hardware counter index, and nothing documents that ETW programs the mapped sources into
+    // counters 0 to PMCCount-1 in order. So the same work is measured both ways, and every counter has to agree
+    // to within 5% (plus a little for the reads themselves). Tries that were switched away or migrated
+    // don't count either way.
+    pmc_traced_region LocalRegion;
+    pmc_traced_region *Region = &LocalRegion;
+    if(Tracer->IsClient)
+    {
+        Region = (pmc_traced_region *)AllocateSharedPMCMemory(Tracer, sizeof(pmc_traced_region));
+    }
 
-    ULONG BufferSize;
-    TraceQueryInformation(0, TraceProfileSourceListInfo, 0, 0, &BufferSize);
-    BYTE *Buffer = (BYTE *)Win32AllocateSize(BufferSize);
-    if(Buffer)
+    b32 Result = false;
+    for(u32 TryIndex = 0; Region && NoErrors(Tracer) && (TryIndex < PMC_SYNC_CHECK_TRY_COUNT); ++TryIndex)
     {
-        if(TraceQueryInformation(0, TraceProfileSourceListInfo, Buffer, BufferSize, &BufferSize) == ERROR_SUCCESS)
+        pmc_sync_region Sync;
+
+        Tracer->SyncPMCsEnabled = true;
+        StartCountingPMCs(Tracer, Region);
+        StartSyncPMCs(Tracer, &Sync, 0);
+        RunSyncCheckWork();
+        pmc_trace_result SyncResult = StopSyncPMCs(Tracer, &Sync);
+        StopCountingPMCs(Tracer, Region);
+        Tracer->SyncPMCsEnabled = false;
+
+        pmc_trace_result AsyncResult = GetOrWaitForResult(Tracer, Region);
+        if(NoErrors(Tracer) && !AsyncResult.ContextSwitchCount && !SyncResult.CPUMigrationCount)
         {
-            u32 FoundCount = 0;
-
-            for(PROFILE_SOURCE_INFO *Info = (PROFILE_SOURCE_INFO *)Buffer;
-                ;
-                Info = (PROFILE_SOURCE_INFO *)((u8 *)Info + Info->NextEntryOffset))
+            Result = true;
+            for(u32 CI = 0; CI < Tracer->Mapping.PMCCount; ++CI)
             {
-                for(u32 SourceNameIndex = 0; SourceNameIndex < ArrayCount(SourceNames->Strings); ++SourceNameIndex)
-                {
-                    wchar_t const *SourceString = SourceNames->Strings[SourceNameIndex];
-                    if(SourceString)
-                    {
-                        u32 CheckMax = SourceNameIndex + 1;
-                        if(Result.PMCCount < CheckMax)
-                        {
-                            Result.PMCCount = CheckMax;
-                        }
-                        if(lstrcmpW(Info->Description, SourceString) == 0)
-                        {
-                            Result.SourceIndex[SourceNameIndex] = Info->Source;
-                            ++FoundCount;
-                            break;
-                        }
-                    }
-                }
-
-                if(Info->NextEntryOffset == 0)
+                u64 Async = AsyncResult.Counters[CI];
+                u64 Sync = SyncResult.Counters[CI];
+                u64 Larger = (Async > Sync) ? Async : Sync;
+                u64 Difference = Larger - ((Async > Sync) ? Sync : Async);
+                if(Difference > ((Larger / 20) + 1000))
                 {
-                    break;
+                    Result = false;
                 }
             }
-
-            Result.Valid = (Result.PMCCount == FoundCount);
+            break;
         }
     }
 
-    Win32Deallocate(Buffer);
-
     return Result;
 }
 
-static void SetTracePMCSources(pmc_tracer *Tracer, pmc_source_mapping *Mapping)
+static b32 EnableSyncPMCs(pmc_tracer *Tracer)
 {
-    ULONG Status = TraceSetInformation(Tracer->TraceHandle, TracePmcCounterListInfo,
-                                       Mapping->SourceIndex, Mapping->PMCCount * sizeof(Mapping->SourceIndex[0]));
-    if(Status != ERROR_SUCCESS)
+    // NOTE: rdpmc faults in user mode unless the OS has set CR4.PCE, so each counter is probed once here
+    // under SEH rather than letting the first sync region crash
+    b32 Readable = true;
+    __try
     {
-        TraceError(Tracer, "Unable to select PMCs");
+        for(u32 CI = 0; CI < Tracer->Mapping.PMCCount; ++CI)
+        {
+            __readpmc(CI);
+        }
     }
-
-    CLASSIC_EVENT_ID EventIDs[] =
+    __except(EXCEPTION_EXECUTE_HANDLER)
     {
-        {Win32ThreadEventGuid, WIN32_TRACE_OPCODE_SWITCH_THREAD},
-        {Win32DPCEventGuid, WIN32_TRACE_OPCODE_SYSTEMCALL_ENTER},
-        {Win32DPCEventGuid, WIN32_TRACE_OPCODE_SYSTEMCALL_EXIT},
-    };
+        Readable = false;
+    }
 
-    ULONG EventListStatus = TraceSetInformation(Tracer->TraceHandle, TracePmcEventListInfo, EventIDs, sizeof(EventIDs));
-    if(EventListStatus != ERROR_SUCCESS)
+    Tracer->SyncPMCsEnabled = false;
+    if(Readable && Tracer->Mapping.PMCCount)
     {
-        TraceError(Tracer, "Unable to select events");
+        Tracer->SyncPMCsEnabled = CrossCheckSyncPMCs(Tracer);
     }
+
+    return Tracer->SyncPMCsEnabled;
 }
 
-static void Win32RegisterTraceMarker(pmc_tracer *Tracer)
+static void StartSyncPMCs(pmc_tracer *Tracer, pmc_sync_region *Region, u32 SiteID)
 {
-    TRACE_GUID_REGISTRATION MarkerEventClassGuids[] = {(LPGUID)&TraceMarkerCategoryGuid, 0};
-    ULONG Status = RegisterTraceGuids((WMIDPREQUEST)ControlCallback, 0, (LPGUID)&TraceMarkerProviderGuid,
-                                      sizeof(MarkerEventClassGuids)/sizeof(TRACE_GUID_REGISTRATION),
-                                      MarkerEventClassGuids,
-                                      0, 0, &Tracer->MarkerRegistrationHandle);
-    if(Status != ERROR_SUCCESS)
+    if(Tracer->SyncPMCsEnabled)
     {
-        TraceError(Tracer, "ETW marker registration failed");
+        Region->SiteID = SiteID;
+
+        u32 PMCCount = Tracer->Mapping.PMCCount;
+        for(u32 CI = 0; CI < PMCCount; ++CI)
+        {
+            Region->StartCounters[CI] = __readpmc(CI);
+        }
+
+        // NOTE: The TSC is read last on the way in and first on the way out, so the counter reads are
+        // mostly outside the measured time
+        Region->StartTSC = __rdtscp(&Region->StartCPU);
+    }
+    else
+    {
+        TraceError(Tracer, "Synchronous PMC reads are not enabled");
     }
 }
 
-static void Win32CreateTrace(pmc_tracer *Tracer, pmc_source_mapping *SourceMapping)
+static pmc_trace_result StopSyncPMCs(pmc_tracer *Tracer, pmc_sync_region *Region)
 {
-    const WCHAR TraceName[] = L"Win32PMCTrace";
-
-    EVENT_TRACE_PROPERTIES_V2 *Props = &Tracer->Win32TraceDesc.Properties;
-    Props->Wnode.BufferSize = sizeof(Tracer->Win32TraceDesc);
-    Props->LoggerNameOffset = offsetof(win32_trace_description, Name);
-
-    // NOTE(casey): Attempt to stop any existing orphaned trace from a previous run
-    ControlTraceW(0, TraceName, (EVENT_TRACE_PROPERTIES *)Props, EVENT_TRACE_CONTROL_STOP);
-
-    /* NOTE(casey): Attempt to start the trace. Note that the fields we care about MUST
-       be filled in after the EVENT_TRACE_CONTROL_STOP ControlTraceW call, because
-       that call will overwrite the properties! */
-    Props->Wnode.ClientContext = 3;
-    Props->Wnode.Flags = WNODE_FLAG_TRACED_GUID | WNODE_FLAG_VERSIONED_PROPERTIES;
-    Props->LogFileMode = EVENT_TRACE_REAL_TIME_MODE | EVENT_TRACE_SYSTEM_LOGGER_MODE;
-    Props->VersionNumber = 2;
-    Props->EnableFlags = EVENT_TRACE_FLAG_CSWITCH | EVENT_TRACE_FLAG_NO_SYSCONFIG | EVENT_TRACE_FLAG_SYSTEMCALL;
-    ULONG StartStatus = StartTraceW(&Tracer->TraceHandle, TraceName, (EVENT_TRACE_PROPERTIES*)Props);
+    u32 StopCPU;
+    u64 StopTSC = __rdtscp(&StopCPU);
 
-    if(StartStatus != ERROR_SUCCESS)
+    pmc_trace_result Result = {};
+    if(Tracer->SyncPMCsEnabled)
     {
-        TraceError(Tracer, "Unable to start trace - may occur if not run as admin");
-    }
+        // NOTE: Hardware counters are 48 bits wide on current AMD and Intel cores, so the delta is taken
+        // modulo 2^48 to survive a wrap
+        u32 PMCCount = Tracer->Mapping.PMCCount;
+        for(u32 CI = 0; CI < PMCCount; ++CI)
+        {
+            Result.Counters[CI] = (__readpmc(CI) - Region->StartCounters[CI]) & ((1ull << 48) - 1);
+        }
 
-    Tracer->Mapping = *SourceMapping;
-    if(IsValid(&Tracer->Mapping))
-    {
-        SetTracePMCSources(Tracer, &Tracer->Mapping);
+        Result.StartTSC = Region->StartTSC;
+        Result.TSCElapsed = StopTSC - Region->StartTSC;
+        Result.CPUMigrationCount = (StopCPU != Region->StartCPU);
+        Result.InvocationCount = 1;
+        Result.SiteID = Region->SiteID;
+        Result.ThreadID = GetCurrentThreadId();
+        Result.CPUIndex = StopCPU & 0xfff;
+        Result.PMCCount = PMCCount;
+        Result.Completed = true;
     }
     else
     {
-        TraceError(Tracer, "PMC source mapping failed");
+        TraceError(Tracer, "Synchronous PMC reads are not enabled");
     }
 
-    EVENT_TRACE_LOGFILEW Log = {};
-    Log.LoggerName = Tracer->Win32TraceDesc.Name;
-    Log.EventRecordCallback = Win32ProcessETWEvent;
-    Log.ProcessTraceMode = PROCESS_TRACE_MODE_EVENT_RECORD | PROCESS_TRACE_MODE_RAW_TIMESTAMP | PROCESS_TRACE_MODE_REAL_TIME;
-    Log.Context = Tracer;
+    return Result;
+}
 
-    Tracer->TraceSession = OpenTraceW(&Log);
-    if(Tracer->TraceSession == INVALID_PROCESSTRACE_HANDLE)
+static pmc_core_cycle_source EnableCoreCycles(pmc_tracer *Tracer)
+{
+    if(Tracer->Mapping.HasCoreCycles)
     {
-        TraceError(Tracer, "Unable to open trace");
+        Tracer->CoreCycleSource = CoreCycles_PMC;
     }
-
-    Tracer->ProcessingThread = CreateThread(0, 0, Win32ProcessEventThread, (void *)Tracer->TraceSession, 0, 0);
-    if(Tracer->ProcessingThread == 0)
+    else
     {
-        TraceError(Tracer, "Unable to create processing thread");
-    }
-}
+        // NOTE: rdpru is reported by CPUID 0x80000008 EBX bit 4
+        int CPUInfo[4] = {};
+        __cpuid(CPUInfo, 0x80000000);
+        b32 HasRDPRU = false;
+        if((u32)CPUInfo[0] >= 0x80000008)
+        {
+            __cpuid(CPUInfo, 0x80000008);
+            HasRDPRU = ((CPUInfo[1] >> 4) & 1);
+        }
 
-static void StartTracing(pmc_tracer *Tracer, pmc_source_mapping *SourceMapping)
-{
-    *Tracer = {};
+        if(HasRDPRU && !Tracer->ReadPRU)
+        {
+            /* NOTE: The compiler offers no rdpru intrinsic and x64 has no inline assembly, so the instruction lives
+               in a tiny thunk: rdpru (reads the register in ECX into EDX:EAX), shl rdx, 32, or rax, rdx, ret */
+            u8 const Thunk[] = {0x0F, 0x01, 0xFD, 0x48, 0xC1, 0xE2, 0x20, 0x48, 0x09, 0xD0, 0xC3};
+            u8 *Code = (u8 *)Win32AllocateSize(sizeof(Thunk));
+            DWORD OldProtect;
+            if(Code)
+            {
+                for(u32 ByteIndex = 0; ByteIndex < sizeof(Thunk); ++ByteIndex)
+                {
+                    Code[ByteIndex] = Thunk[ByteIndex];
+                }
 
-    Tracer->TraceKey = __rdtsc();
+                if(VirtualProtect(Code, sizeof(Thunk), PAGE_EXECUTE_READ, &OldProtect))
+                {
+                    Tracer->ReadPRU = (rdpru_function *)Code;
+                }
+                else
+                {
+                    Win32Deallocate(Code);
+                }
+            }
+        }
 
-#if PMC_DEBUG_LOG
-    u64 RequestedLogSize = 1024*1024*1024;
-    Tracer->Log = Tracer->LogAt = (char *)Win32AllocateSize(RequestedLogSize);
-    if(Tracer->Log)
-    {
-        Tracer->LogEnd = Tracer->Log + RequestedLogSize;
+        // NOTE: The OS can still disable user-mode rdpru, so it is tried once under SEH
+        b32 Readable = false;
+        if(Tracer->ReadPRU)
+        {
+            __try
+            {
+                Tracer->ReadPRU(RDPRU_MPERF);
+                Tracer->ReadPRU(RDPRU_APERF);
+                Readable = true;
+            }
+            __except(EXCEPTION_EXECUTE_HANDLER)
+            {
+                Readable = false;
+            }
+        }
+
+        Tracer->CoreCycleSource = Readable ? CoreCycles_APERF : CoreCycles_None;
     }
-#endif
 
-    SYSTEM_INFO SysInfo = {};
-    GetSystemInfo(&SysInfo);
-    Tracer->CPUCount = SysInfo.dwNumberOfProcessors;
+    return Tracer->CoreCycleSource;
+}
 
-    Tracer->CPUs = (pmc_tracer_cpu *)Win32AllocateSize(Tracer->CPUCount * sizeof(pmc_tracer_cpu));
-    if(Tracer->CPUs)
-    {
-        Win32RegisterTraceMarker(Tracer);
-        Win32CreateTrace(Tracer, SourceMapping);
-    }
-    else
+static f64 GetEffectiveGHz(pmc_trace_result *Result, u64 TSCFrequency)
+{
+    f64 GHz = 0;
+    if(Result->CoreCycleSource && Result->TSCElapsed)
     {
-        TraceError(Tracer, "Unable to allocate memory for CPU core tracking");
+        GHz = ((f64)Result->CoreCycles / (f64)Result->TSCElapsed) * ((f64)TSCFrequency / 1e9);
     }
+
+    return GHz;
 }
 
-static void StopTracing(pmc_tracer *Tracer)
+static f64 GetPerCoreCycle(pmc_trace_result *Result, u32 CounterIndex)
 {
-    // TODO(casey): Try to verify that 0 is never a valid trace handle - it's unclear from the documentation
-    if(Tracer->TraceHandle)
+    f64 PerCycle = 0;
+    if(Result->CoreCycleSource && Result->CoreCycles && (CounterIndex < Result->PMCCount))
     {
-        ControlTraceW(Tracer->TraceHandle, 0, (EVENT_TRACE_PROPERTIES *)&Tracer->Win32TraceDesc.Properties, EVENT_TRACE_CONTROL_STOP);
+        PerCycle = (f64)Result->Counters[CounterIndex] / (f64)Result->CoreCycles;
     }
 
-    if(Tracer->TraceSession != INVALID_PROCESSTRACE_HANDLE)
+    return PerCycle;
+}
+
+static b32 EnablePMCAggregates(pmc_tracer *Tracer)
+{
+    if(!Tracer->Aggregates)
     {
-        CloseTrace(Tracer->TraceSession);
+        pmc_site_aggregates *Aggregates = (pmc_site_aggregates *)Win32AllocateSize(2*sizeof(pmc_site_aggregates));
+        if(Aggregates)
+        {
+            _mm_mfence();
+            Tracer->Aggregates = Aggregates;
+        }
+        else
+        {
+            TraceError(Tracer, "Unable to allocate memory for PMC aggregates");
+        }
     }
 
-    if(Tracer->ProcessingThread)
+    b32 Result = (Tracer->Aggregates != 0);
+    return Result;
+}
+
+static void TakePMCAggregates(pmc_tracer *Tracer, pmc_site_aggregates *Dest)
+{
+    *Dest = {};
+    if(Tracer->Aggregates)
     {
-        WaitForSingleObject(Tracer->ProcessingThread, INFINITE);
-        CloseHandle(Tracer->ProcessingThread);
+        u32 Retired = Tracer->ActiveAggregateIndex;
+        Tracer->ActiveAggregateIndex = Retired ^ 1;
+        _mm_mfence();
+
+        // NOTE: At most one region's worth of adds can still be landing in the retired buffer
+        while(Tracer->AggregateInUse == (Retired + 1))
+        {
+            _mm_pause();
+        }
+        _mm_mfence();
+
+        *Dest = Tracer->Aggregates[Retired];
+        Tracer->Aggregates[Retired] = {};
     }
+}
 
-    if(Tracer->MarkerRegistrationHandle)
+static b32 AddPMCTrigger(pmc_tracer *Tracer, pmc_trigger *Trigger)
+{
+    b32 Result = false;
+
+    u32 TriggerIndex = (u32)(InterlockedIncrement(&Tracer->ReservedTriggerCount) - 1);
+    if(TriggerIndex < MAX_PMC_TRIGGER_COUNT)
     {
-        UnregisterTraceGuids(Tracer->MarkerRegistrationHandle);
+        Tracer->Triggers[TriggerIndex] = *Trigger;
+
+        // NOTE: Counts are published in slot order, so a caller that got an earlier slot but has not finished
+        // writing it is never exposed by a later one. The interlocked exchange is a full barrier, so the
+        // processing thread cannot see the new count before the trigger it covers.
+        while(Tracer->TriggerCount != TriggerIndex)
+        {
+            _mm_pause();
+        }
+        InterlockedExchange((LONG volatile *)&Tracer->TriggerCount, (LONG)(TriggerIndex + 1));
+
+        Result = true;
     }
 
-#if PMC_DEBUG_LOG
-    Win32Deallocate(Tracer->Log);
-#endif
-    Win32Deallocate(Tracer->CPUs);
+    return Result;
 }
 
-static void StartCountingPMCs(pmc_tracer *Tracer, pmc_traced_region *ResultDest)
+static b32 GetNextPMCCapture(pmc_tracer *Tracer, pmc_capture *Dest)
 {
-    pmc_tracer_etw_marker TraceMarker = {};
-    TraceMarker.Header.Size = sizeof(TraceMarker);
-    TraceMarker.Header.Flags = WNODE_FLAG_TRACED_GUID;
-    TraceMarker.Header.Guid = TraceMarkerCategoryGuid;
-    TraceMarker.Header.Class.Type = TraceMarker_Open;
+    b32 Result = false;
 
-    TraceMarker.UserData.TraceKey = Tracer->TraceKey;
-    TraceMarker.UserData.Dest = ResultDest;
+    u64 ReadIndex = Tracer->CaptureReadIndex;
+    if(Tracer->Captures && (ReadIndex != Tracer->CaptureWriteIndex))
+    {
+        _mm_lfence();
+        *Dest = Tracer->Captures[ReadIndex % PMC_CAPTURE_QUEUE_SIZE];
 
-    /* TODO(casey): Is this necessary, or is it safe to pick up the thread index from the OPEN marker?
-       If we never see an error where the open marker differs from the thread ID recorded here, then
-       presumably this is not necessary, */
-    ResultDest->OnThreadID = GetCurrentThreadId();
-    ResultDest->Results = {};
-    ResultDest->Results.PMCCount = Tracer->Mapping.PMCCount;
+        // NOTE: The capture must be fully read before the processing thread is allowed to reuse its slot
+        _mm_mfence();
+        Tracer->CaptureReadIndex = ReadIndex + 1;
 
-    if(TraceEvent(Tracer->TraceHandle, &TraceMarker.Header) != ERROR_SUCCESS)
-    {
-        TraceError(Tracer, "Unable to insert ETW open marker");
+        Result = true;
     }
+
+    return Result;
 }
 
-static void StopCountingPMCs(pmc_tracer *Tracer, pmc_traced_region *ResultDest)
+static u64 GetDroppedPMCCaptureCount(pmc_tracer *Tracer)
 {
-    pmc_tracer_etw_marker TraceMarker = {};
-    TraceMarker.Header.Size = sizeof(TraceMarker);
-    TraceMarker.Header.Flags = WNODE_FLAG_TRACED_GUID;
-    TraceMarker.Header.Guid = TraceMarkerCategoryGuid;
-    TraceMarker.Header.Class.Type = TraceMarker_Close;
+    u64 Result = Tracer->DroppedCaptureCount;
+    return Result;
+}
 
-    TraceMarker.UserData.TraceKey = Tracer->TraceKey;
-    TraceMarker.UserData.Dest = ResultDest;
+static u32 DrainPMCSamples(pmc_tracer *Tracer, pmc_ip_sample *Dest, u32 MaxCount)
+{
+    u32 Result = 0;
 
-    /* TODO(casey): In some circumstances, I believe this can fail due to ETW's internal buffers being
-       full. In that case, I _think_ it should be possible to mark the particular trace results as
-       invalid, but keep trying to issue the TraceEvent, succeed, and then continune without having
-       to error out of the entire run. However, I have not found a reliable repro case for this
-       yet, so I haven't yet tried to implement such a recovery case. */
-    if(TraceEvent(Tracer->TraceHandle, &TraceMarker.Header) != ERROR_SUCCESS)
+    if(Tracer->Samples)
     {
-        TraceError(Tracer, "Unable to insert ETW close marker");
+        u64 ReadIndex = Tracer->SampleReadIndex;
+        u64 WriteIndex = Tracer->SampleWriteIndex;
+        _mm_lfence();
+
+        while((ReadIndex != WriteIndex) && (Result < MaxCount))
+        {
+            Dest[Result++] = Tracer->Samples[ReadIndex++ % PMC_SAMPLE_QUEUE_SIZE];
+        }
+
+        // NOTE: The samples must be fully read before the processing thread is allowed to reuse their slots
+        _mm_mfence();
+        Tracer->SampleReadIndex = ReadIndex;
     }
+
+    return Result;
 }
 
-static b32 IsComplete(pmc_traced_region *Region)
+static u64 GetDroppedPMCSampleCount(pmc_tracer *Tracer)
 {
-    b32 Result = Region->Results.Completed;
+    u64 Result = Tracer->DroppedSampleCount;
     return Result;
 }
 
-static pmc_trace_result GetOrWaitForResult(pmc_tracer *Tracer, pmc_traced_region *Region)
+static pmc_tracer_stats GetTracerStats(pmc_tracer *Tracer)
 {
-    while(NoErrors(Tracer) && !IsComplete(Region))
+    pmc_tracer_stats Result = Tracer->Stats;
+    Result.RejectedClientMarkerCount = Tracer->RejectedClientMarkerCount;
+
+    LARGE_INTEGER QPC, QPCFrequency;
+    QueryPerformanceCounter(&QPC);
+    QueryPerformanceFrequency(&QPCFrequency);
+    u64 TSCElapsed = __rdtsc() - Tracer->StartTSC;
+    u64 QPCElapsed = QPC.QuadPart - Tracer->StartQPC;
+
+    if(QPCElapsed && QPCFrequency.QuadPart)
     {
-        /* NOTE(casey): This is a spin-lock loop on purpose, because if there was a Sleep() in here
-           or some other yield, it might cause Windows to demote this region, which we don't want.
-           Ideally, we rarely spin here, because there are enough traces in flight to ensure that,
-           whenever we check for results, there are some waiting, except perhaps at the very end of a
-           batch. */
+        Result.ElapsedSeconds = (f64)QPCElapsed / (f64)QPCFrequency.QuadPart;
+        Result.EstimatedTSCFrequency = (u64)((f64)TSCElapsed / Result.ElapsedSeconds);
 
-        _mm_pause();
+        for(u32 KindIndex = 0; KindIndex < TracerEvent_Count; ++KindIndex)
+        {
+            pmc_tracer_event_kind_stats *KindStats = &Result.Kinds[KindIndex];
+            KindStats->EventsPerSecond = (f64)KindStats->EventCount / Result.ElapsedSeconds;
+        }
     }
 
-    _mm_mfence(); // NOTE(casey): This is a stronger memory barrier than necessary, but should not be harmful
-
-    pmc_trace_result Result = Region->Results;
     return Result;
-}
\ No newline at end of file
+}
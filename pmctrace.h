@@ -27,23 +27,221 @@ struct pmc_source_mapping
     u32 SourceIndex[MAX_TRACE_PMC_COUNT];
     u32 PMCCount;
     b32 Valid;
+
+    // NOTE: Set by MapPMCNames when one of the names is a core cycle counter
+    u32 CoreCycleIndex;
+    b32 HasCoreCycles;
+};
+
+struct pmc_sampling_mapping
+{
+    u32 SourceIndex;
+    u32 Interval;
+    b32 Valid;
 };
 
+struct pmc_ip_sample
+{
+    u64 InstructionPointer;
+    u64 TSC;
+    u32 SiteID;
+    u32 ThreadID;
+};
+
+#define PMC_SAMPLE_QUEUE_SIZE (256*1024)
+
+enum pmc_core_cycle_source : u32
+{
+    CoreCycles_None,
+
+    CoreCycles_PMC, // NOTE: Counted directly by a mapped PMC, exact across context switches
+    CoreCycles_APERF, // NOTE: TSCElapsed scaled by the APERF/MPERF ratio over the region, read with rdpru
+
+    CoreCycles_Count,
+};
+
+// NOTE: Counters and TSCElapsed include everything the region's thread did, in both user and kernel mode.
+// KernelCounters and KernelTSCElapsed are the part of that spent inside the SysCallCount system calls the
+// region made, so subtracting them gives the user-mode portion. The marker system calls that open and close a
+// region are excluded from that region, but the markers of any region nested inside it are counted like any other
+// system call, in both its Kernel* values and its SysCallCount.
+// Kernel time that is not a system call, such as interrupts and DPCs, is not separated out.
 struct pmc_trace_result
 {
     u64 Counters[MAX_TRACE_PMC_COUNT];
+    u64 KernelCounters[MAX_TRACE_PMC_COUNT];
 
+    u64 StartTSC; // NOTE: When the open marker was logged
     u64 TSCElapsed;
+    u64 KernelTSCElapsed;
+    u64 CoreCycles; // NOTE: Only valid when CoreCycleSource is not CoreCycles_None
+    u64 SysCallCount;
     u64 ContextSwitchCount;
+    u64 ThreadHopCount;
+    u64 CPUMigrationCount;
+    u64 InvocationCount;
+    u64 SampleCount;
+    u32 SiteID;
+    u32 ThreadID;
+    u32 CPUIndex; // NOTE: The core the region closed on
     u32 PMCCount;
+    u32 CoreCycleSource;
     b32 Completed;
 };
 
+#define PMC_TIMELINE_MAX_POINTS 256
+
+struct pmc_timeline_point
+{
+    // NOTE: Each point covers the span since the previous point (or the start of the region) and ends at TSC
+    u64 TSC;
+    u64 TSCElapsed;
+    u64 Counters[MAX_TRACE_PMC_COUNT];
+};
+
+struct pmc_timeline
+{
+    pmc_timeline_point Points[PMC_TIMELINE_MAX_POINTS];
+    u32 PointCount;
+
+    // NOTE: How many observed boundaries each new point spans. It starts at 1 and doubles every time the
+    // timeline fills up and adjacent points are merged, so memory stays fixed however long the region runs.
+    u32 Stride;
+
+    u32 SkippedBoundaryCount;
+    u64 LastTSCElapsed;
+    u64 LastCounters[MAX_TRACE_PMC_COUNT];
+};
+
+struct pmc_accumulated_region;
 struct pmc_traced_region
 {
     pmc_trace_result Results;
     pmc_traced_region *Next;
+    pmc_timeline *Timeline;
+    pmc_accumulated_region *Accumulator; // NOTE: Only touched by the processing thread
     u32 OnThreadID;
+    u32 OnCPUIndex;
+    b32 InKernel; // NOTE: Only touched by the processing thread
+
+    // NOTE: The core cycle source of the tracer that started the region, which is not the one processing it for
+    // a daemon client. The APERF/MPERF values are only written at Start and Stop when that source is APERF.
+    u32 CoreCycleSource;
+    u64 StartAPERF;
+    u64 StartMPERF;
+    u64 StopAPERF;
+    u64 StopMPERF;
+    u32 StartCPU;
+    u32 StopCPU;
+};
+
+struct pmc_accumulated_region
+{
+    pmc_traced_region Region; // NOTE: The Start/Stop pair currently in flight
+    pmc_trace_result Totals; // NOTE: Pairs completed since the last flush, owned by the processing thread
+    pmc_trace_result Flushed; // NOTE: The totals published by the most recent flush
+};
+
+#define MAX_PMC_PHASE_COUNT 16
+
+struct pmc_phased_result
+{
+    pmc_trace_result Phases[MAX_PMC_PHASE_COUNT];
+    u32 PhaseCount;
+    u32 DroppedLapCount; // NOTE: Laps past the last phase, which were merged into it
+};
+
+struct pmc_phased_region
+{
+    pmc_traced_region Region; // NOTE: The phase currently running
+    pmc_trace_result CompletedPhases[MAX_PMC_PHASE_COUNT - 1]; // NOTE: Written by the processing thread at each lap
+    u32 CompletedPhaseCount;
+    u32 DroppedLapCount;
+};
+
+#define MAX_PMC_AGGREGATE_SITE_COUNT 256
+#define PMC_AGGREGATE_HISTOGRAM_BUCKET_COUNT 48
+struct pmc_site_aggregate
+{
+    u64 RegionCount;
+    u64 TSCElapsed;
+    u64 ContextSwitchCount;
+    u64 Counters[MAX_TRACE_PMC_COUNT];
+    u64 TSCHistogram[PMC_AGGREGATE_HISTOGRAM_BUCKET_COUNT]; // NOTE: Bucket N counts regions of [2^N, 2^(N+1)) TSC
+};
+
+struct pmc_site_aggregates
+{
+    pmc_site_aggregate Sites[MAX_PMC_AGGREGATE_SITE_COUNT];
+    u64 DroppedRegionCount; // NOTE: Regions whose SiteID was too large to aggregate
+};
+
+struct pmc_sync_region
+{
+    u64 StartTSC;
+    u64 StartCounters[MAX_TRACE_PMC_COUNT];
+    u32 StartCPU;
+    u32 SiteID;
+};
+
+#define MAX_PMC_TRIGGER_COUNT 16
+#define PMC_CAPTURE_QUEUE_SIZE 256
+
+struct pmc_trigger
+{
+    u32 SiteID;
+
+    // NOTE: A threshold of 0 is ignored. The trigger fires when any non-zero threshold is exceeded.
+    u64 MaxTSCElapsed;
+    u64 MaxCounters[MAX_TRACE_PMC_COUNT];
+
+    // NOTE: Rate limit, so a slow period doesn't flood the capture queue
+    u64 MinTSCBetweenCaptures;
+};
+
+struct pmc_capture
+{
+    pmc_trace_result Result;
+    u64 CloseTSC;
+    u32 TriggerIndex; // NOTE: The first trigger that fired
+    u32 TriggerMask; // NOTE: Bit N is set for every trigger N that fired
+};
+
+enum pmc_tracer_event_kind : u32
+{
+    TracerEvent_Marker,
+    TracerEvent_ContextSwitch,
+    TracerEvent_SysEnter,
+    TracerEvent_SysExit,
+    TracerEvent_Other,
+
+    TracerEvent_Count,
+};
+
+struct pmc_tracer_event_kind_stats
+{
+    u64 EventCount;
+    u64 CallbackTSC; // NOTE: Total TSC spent inside the processing callback for this kind of event
+    f64 EventsPerSecond; // NOTE: Averaged since StartTracing
+};
+
+#define PMC_LATENCY_HISTOGRAM_BUCKET_COUNT 64
+struct pmc_tracer_stats
+{
+    pmc_tracer_event_kind_stats Kinds[TracerEvent_Count];
+
+    // NOTE: Bucket N counts results whose latency, from the close marker's TSC to Completed becoming visible,
+    // was in [2^N, 2^(N+1)) TSC ticks.
+    u64 ResultLatencyHistogram[PMC_LATENCY_HISTOGRAM_BUCKET_COUNT];
+
+    // NOTE: How far behind the current rdtsc the event timestamps were when they were processed
+    u64 LastLagTSC;
+    u64 MaxLagTSC;
+
+    f64 ElapsedSeconds;
+    u64 EstimatedTSCFrequency;
+
+    u64 RejectedClientMarkerCount; // NOTE: Daemon only - client markers that were malformed or out of order
 };
 
 struct pmc_tracer;
@@ -59,16 +257,134 @@ static char const *GetErrorMessage(pmc_tracer *Tracer);
 
 // NOTE(casey): By default, no debug log is kept, so GetDebugLog will return 0. To enable logging, you must
 // build with PMC_DEBUG_LOG defined to 1.
+// NOTE: The log is a flight recorder of binary records holding the most recent PMC_DEBUG_LOG_ENTRY_COUNT events.
+// GetDebugLog formats it to text on each call, and every string it returns stays valid until StopTracing.
+// SaveDebugLog writes the raw records out for pmctrace_debug_decode to format offline, and returns false if
+// logging is disabled or the write fails. Events that arrive while either one is reading the ring are dropped.
 static char const *GetDebugLog(pmc_tracer *Tracer);
+static b32 SaveDebugLog(pmc_tracer *Tracer, char const *FileName);
 
 static void StartTracing(pmc_tracer *Tracer, pmc_source_mapping *Mapping);
+
+// NOTE: Optional instruction pointer sampling. MapPMCSamplingSource picks a profile source by name (for example
+// L"BranchMispredictions") and clamps the interval to what the CPU allows; the CPU interrupts once every Interval
+// events, which is what bounds the overhead. Samples are only kept when they land on a thread that has a region
+// open, and they are attributed to the innermost such region (its SampleCount and SiteID). The processing thread
+// queues them without ever stopping the instrumented threads; drain them from one thread with DrainPMCSamples.
+// Samples that arrive while the queue is full are dropped and counted.
+static pmc_sampling_mapping MapPMCSamplingSource(wchar_t const *SourceName, u32 Interval);
+static void StartTracing(pmc_tracer *Tracer, pmc_source_mapping *Mapping, pmc_sampling_mapping *Sampling);
+static u32 DrainPMCSamples(pmc_tracer *Tracer, pmc_ip_sample *Dest, u32 MaxCount);
+static u64 GetDroppedPMCSampleCount(pmc_tracer *Tracer);
 static void StopTracing(pmc_tracer *Tracer);
 
+// NOTE: Only one process can own the kernel logger session, so several instrumented processes on one machine should
+// share it through a daemon. The daemon (run as admin) calls StartPMCDaemon instead of StartTracing; its session has
+// a name of its own, so a plain StartTracing elsewhere does not stop it, and only one daemon can run at a time. Each
+// client process calls ConnectToPMCDaemon instead of StartTracing, which does not need admin rights, and then uses
+// the same region calls as a process with its own session. However, every region, accumulated region, phased region
+// or timeline a client passes to the tracer must be allocated with AllocateSharedPMCMemory, because the daemon copies
+// results into that section. It returns 0 when the section is full, and when called on a tracer that is not a client.
+// The daemon does not trust its clients: it keeps its own copy of each client region, keyed by its offset in the
+// section, and only ever writes result values back at offsets it has checked. Markers that don't fit a region's
+// state are rejected and counted. A client can use up to MAX_PMC_CLIENT_REGION_COUNT distinct regions, and its slot
+// is reclaimed when its process exits, even if it never called StopTracing.
+static void StartPMCDaemon(pmc_tracer *Tracer, pmc_source_mapping *Mapping);
+static void ConnectToPMCDaemon(pmc_tracer *Tracer, u64 SharedMemorySize);
+static void *AllocateSharedPMCMemory(pmc_tracer *Tracer, u64 Size);
+
 static void StartCountingPMCs(pmc_tracer *Tracer, pmc_traced_region *ResultDest);
+static void StartCountingPMCs(pmc_tracer *Tracer, pmc_traced_region *ResultDest, u32 SiteID);
 static void StopCountingPMCs(pmc_tracer *Tracer, pmc_traced_region *ResultDest);
 
+// NOTE: A timeline region additionally records a time series for long-running regions. Every context switch and
+// system call boundary the processing thread sees while the region runs ends a point, and the point deltas
+// always sum to the region's total. The timeline must stay valid until the region's results are complete.
+static void StartTimelinePMCs(pmc_tracer *Tracer, pmc_traced_region *ResultDest, u32 SiteID, pmc_timeline *Timeline);
+
+// NOTE: For task-based work that may move between threads, the scheduler can call SuspendCountingPMCs on the
+// thread the task is leaving and ResumeCountingPMCs on the thread it is picked up by. Counters accumulate across
+// every segment the task runs, and ThreadHopCount records how many times it resumed on a different thread.
+// While suspended, the region does not count anything, so calls must be strictly paired between Start and Stop.
+static void SuspendCountingPMCs(pmc_tracer *Tracer, pmc_traced_region *ResultDest);
+static void ResumeCountingPMCs(pmc_tracer *Tracer, pmc_traced_region *ResultDest);
+
+// NOTE: A sync region reads the counters directly with rdpmc at Start and Stop, so StopSyncPMCs returns final
+// results with no marker, no system call and no wait for the processing thread. This only works where the OS has
+// enabled user-mode rdpmc, which Windows does not do by default; EnableSyncPMCs checks for it and returns false
+// when it is unavailable, in which case the Start/Stop calls raise a tracer error. Sync regions assume ETW programs
+// the mapped sources into hardware counters 0 to PMCCount-1 in order, so EnableSyncPMCs also measures a short loop
+// with a sync region inside an ordinary one, waits for the result, and returns false unless every counter agrees.
+// Nothing tracks context switches here, so the counters include any other thread that ran on the core in between.
+// ContextSwitchCount is always 0, and CPUMigrationCount is 1 when the region stopped on a different core than it
+// started on (discard those).
+static b32 EnableSyncPMCs(pmc_tracer *Tracer);
+static void StartSyncPMCs(pmc_tracer *Tracer, pmc_sync_region *Region, u32 SiteID);
+static pmc_trace_result StopSyncPMCs(pmc_tracer *Tracer, pmc_sync_region *Region);
+
 // NOTE(casey): Region results can be read as soon as IsComplete returns true. GetOrWaitForResult will read results
 // instantly if they are complete, so if you already know the results are complete via IsComplete, you can call
 // GetOrWaitForResult to retrieve the results without waiting - it only waits when the results are incomplete.
 static b32 IsComplete(pmc_traced_region *Region);
 static pmc_trace_result GetOrWaitForResult(pmc_tracer *Tracer, pmc_traced_region *Region);
+
+// NOTE: An accumulated region sums any number of Start/Stop pairs into one slot, with InvocationCount recording
+// how many pairs were added. Nothing is zeroed per pair, so the pmc_accumulated_region must be zero-initialized
+// before its first use. FlushAccumulatedPMCs publishes everything completed so far and starts a new total; a pair
+// that is still open when the flush is processed is counted in the next flush. Wait for each flush's result with
+// GetOrWaitForFlushedResult before flushing the same region again.
+static void StartAccumulatingPMCs(pmc_tracer *Tracer, pmc_accumulated_region *Accumulated);
+static void StopAccumulatingPMCs(pmc_tracer *Tracer, pmc_accumulated_region *Accumulated);
+static void FlushAccumulatedPMCs(pmc_tracer *Tracer, pmc_accumulated_region *Accumulated);
+static pmc_trace_result GetOrWaitForFlushedResult(pmc_tracer *Tracer, pmc_accumulated_region *Accumulated);
+
+// NOTE: A phased region measures consecutive phases with a single marker per boundary. LapPMCs closes the current
+// phase and opens the next at the same counter snapshot, so the phases add up exactly to the whole region with
+// no gap between them. The cost of each lap's marker lands in the phase it opens, where a Stop/Start pair would
+// charge it to neither. Up to MAX_PMC_PHASE_COUNT phases are supported; further laps are dropped (the last phase
+// runs on to Stop) and counted in DroppedLapCount. A phased region can also record a timeline, which then spans
+// every phase and ends a point at each lap, so its points sum to the sum of the phases.
+static void StartPhasedPMCs(pmc_tracer *Tracer, pmc_phased_region *Phased, u32 SiteID);
+static void StartPhasedPMCs(pmc_tracer *Tracer, pmc_phased_region *Phased, u32 SiteID, pmc_timeline *Timeline);
+static void LapPMCs(pmc_tracer *Tracer, pmc_phased_region *Phased);
+static void StopPhasedPMCs(pmc_tracer *Tracer, pmc_phased_region *Phased);
+static pmc_phased_result GetOrWaitForPhasedResult(pmc_tracer *Tracer, pmc_phased_region *Phased);
+
+// NOTE: Triggers capture the full result of any region on the trigger's SiteID that exceeds one of its
+// thresholds, so the slow tail can be kept without retaining every result. Triggers can be added from any thread
+// at any time after StartTracing, but not removed. Each trigger has its own rate limit, and a region that fires
+// several triggers is captured once. Captures are queued by the processing thread and should be drained
+// regularly with GetNextPMCCapture (from one thread only); captures that don't fit in the queue are dropped
+// and counted. AddPMCTrigger returns false if there is no room for another trigger.
+static b32 AddPMCTrigger(pmc_tracer *Tracer, pmc_trigger *Trigger);
+static b32 GetNextPMCCapture(pmc_tracer *Tracer, pmc_capture *Dest);
+static u64 GetDroppedPMCCaptureCount(pmc_tracer *Tracer);
+
+// NOTE: TSCElapsed runs at a fixed rate, so turbo and power states change how much work fits in it. EnableCoreCycles
+// makes regions also report CoreCycles, the cycles the core actually ran. If the mapping includes a core cycle PMC
+// (UnhaltedCoreCycles or TotalCycles), that counter is used, and it is tracked across context switches like any
+// other. Otherwise, on CPUs with rdpru, the instrumented thread reads APERF and MPERF at Start and Stop, and
+// the processing thread scales the region's TSCElapsed by their ratio. That is an average over the region's
+// wall-clock span, and it is dropped if the region stops on a different core than it started on. Accumulated
+// regions only get core cycles from a PMC. Every phase of a phased region gets them from a PMC, but APERF and MPERF
+// are only read at Start and Stop, so with them only the final phase gets core cycles, scaled by the ratio over the
+// whole region rather than over that phase. EnableCoreCycles
+// returns the source that will be used; call it once, after StartTracing and before any region starts. A daemon
+// uses its core cycle PMC whenever its mapping has one, and a client of it then gets that PMC from EnableCoreCycles;
+// otherwise each client reads APERF for its own regions.
+static pmc_core_cycle_source EnableCoreCycles(pmc_tracer *Tracer);
+static f64 GetEffectiveGHz(pmc_trace_result *Result, u64 TSCFrequency);
+static f64 GetPerCoreCycle(pmc_trace_result *Result, u32 CounterIndex);
+
+// NOTE: Once aggregates are enabled, the processing thread adds every completed region to a per-site total for its
+// SiteID, so always-on instrumentation does not need to keep individual results. The totals are double-buffered:
+// TakePMCAggregates swaps buffers and returns everything added since the previous take, and it only waits (briefly)
+// if the processing thread is part way through adding a region to the buffer being retired. Instrumented threads
+// never touch the aggregates. Take from one thread only, for example the one run by StartPMCExporter.
+static b32 EnablePMCAggregates(pmc_tracer *Tracer);
+static void TakePMCAggregates(pmc_tracer *Tracer, pmc_site_aggregates *Dest);
+
+// NOTE: GetTracerStats is a plain copy of counters the processing thread maintains, so it is cheap enough to
+// call from a monitoring loop. Because it does not synchronize with the processing thread, fields may be
+// off by the event that was being processed at the time of the copy.
+static pmc_tracer_stats GetTracerStats(pmc_tracer *Tracer);
@@ -0,0 +1,470 @@
+/* ========================================================================
+
+   (C) Copyright 2024 by Molly Rocket, Inc., All Rights Reserved.
+
+   This software is provided 'as-is', without any express or implied
+   warranty. In no event will the authors be held liable for any damages
+   arising from the use of this software.
+
+   Please see https://computerenhance.com for more information
+
+   ======================================================================== */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+typedef int32_t s32;
+
+typedef int32_t b32;
+
+typedef float f32;
+typedef double f64;
+
+#define ArrayCount(Array) (sizeof(Array)/sizeof((Array)[0]))
+
+#include "pmctrace.h"
+#include "pmctrace_results.h"
+#include "pmctrace_results.cpp"
+
+#define BOOTSTRAP_RESAMPLE_COUNT 2000
+
+struct ranked_value
+{
+    f64 Value;
+    b32 FromBaseline;
+};
+
+struct metric_comparison
+{
+    f64 BaselineMedian;
+    f64 CandidateMedian;
+    f64 DeltaPercent;
+    f64 LowPercent;
+    f64 HighPercent;
+    f64 PValue;
+};
+
+static int CompareF64(void const *A, void const *B)
+{
+    f64 ValueA = *(f64 const *)A;
+    f64 ValueB = *(f64 const *)B;
+    int Result = (ValueA < ValueB) ? -1 : ((ValueA > ValueB) ? 1 : 0);
+    return Result;
+}
+
+static int CompareRanked(void const *A, void const *B)
+{
+    int Result = CompareF64(&((ranked_value const *)A)->Value, &((ranked_value const *)B)->Value);
+    return Result;
+}
+
+/* NOTE: Quickselect - partially orders Values so that Values[K] holds the value it would have if sorted, with
+   everything before it no larger. The bootstrap takes thousands of medians per metric, so this runs in linear
+   time rather than sorting. */
+static f64 SelectKth(f64 *Values, u64 Count, u64 K)
+{
+    u64 Low = 0;
+    u64 High = Count - 1;
+    while(Low < High)
+    {
+        f64 Pivot = Values[Low + (High - Low)/2];
+        u64 I = Low;
+        u64 J = High;
+        while(I <= J)
+        {
+            while(Values[I] < Pivot) ++I;
+            while(Values[J] > Pivot) --J;
+            if(I <= J)
+            {
+                f64 Temp = Values[I];
+                Values[I] = Values[J];
+                Values[J] = Temp;
+                ++I;
+                if(J == 0)
+                {
+                    break;
+                }
+                --J;
+            }
+        }
+
+        if(K <= J)
+        {
+            High = J;
+        }
+        else if(K >= I)
+        {
+            Low = I;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    f64 Result = Values[K];
+    return Result;
+}
+
+static f64 Median(f64 *Values, u64 Count, f64 *Scratch)
+{
+    f64 Result = 0;
+    if(Count)
+    {
+        memcpy(Scratch, Values, Count*sizeof(f64));
+        Result = SelectKth(Scratch, Count, Count/2);
+        if(!(Count & 1))
+        {
+            // NOTE: After the select, the lower middle value is the largest of everything before the upper one
+            f64 Lower = Scratch[0];
+            for(u64 Index = 1; Index < Count/2; ++Index)
+            {
+                if(Lower < Scratch[Index])
+                {
+                    Lower = Scratch[Index];
+                }
+            }
+            Result = 0.5*(Lower + Result);
+        }
+    }
+    return Result;
+}
+
+static u64 RandomU64(u64 *State)
+{
+    // NOTE: xorshift64* - a fixed seed keeps the confidence intervals reproducible between runs of the tool
+    u64 X = *State;
+    X ^= X >> 12;
+    X ^= X << 25;
+    X ^= X >> 27;
+    *State = X;
+    u64 Result = X * 0x2545F4914F6CDD1Dull;
+    return Result;
+}
+
+/* NOTE: Two-sided Mann-Whitney U test using the normal approximation with tie correction. This makes no
+   assumption about the shape of the distributions, which matters because PMC samples are usually skewed by
+   the occasional interrupt or context switch. */
+static f64 MannWhitneyPValue(f64 *Baseline, u64 BaselineCount, f64 *Candidate, u64 CandidateCount)
+{
+    u64 TotalCount = BaselineCount + CandidateCount;
+    ranked_value *Ranked = (ranked_value *)malloc(TotalCount*sizeof(ranked_value));
+
+    f64 Result = 1.0;
+    if(Ranked && (BaselineCount > 1) && (CandidateCount > 1))
+    {
+        for(u64 Index = 0; Index < BaselineCount; ++Index)
+        {
+            Ranked[Index].Value = Baseline[Index];
+            Ranked[Index].FromBaseline = true;
+        }
+        for(u64 Index = 0; Index < CandidateCount; ++Index)
+        {
+            Ranked[BaselineCount + Index].Value = Candidate[Index];
+            Ranked[BaselineCount + Index].FromBaseline = false;
+        }
+        qsort(Ranked, TotalCount, sizeof(ranked_value), CompareRanked);
+
+        f64 BaselineRankSum = 0;
+        f64 TieSum = 0;
+        for(u64 First = 0; First < TotalCount;)
+        {
+            u64 OnePastLast = First + 1;
+            while((OnePastLast < TotalCount) && (Ranked[OnePastLast].Value == Ranked[First].Value))
+            {
+                ++OnePastLast;
+            }
+
+            // NOTE: Tied values all get the average of the ranks they span (ranks are 1-based)
+            f64 TieCount = (f64)(OnePastLast - First);
+            f64 AverageRank = 0.5*(f64)(First + 1 + OnePastLast);
+            for(u64 Index = First; Index < OnePastLast; ++Index)
+            {
+                if(Ranked[Index].FromBaseline)
+                {
+                    BaselineRankSum += AverageRank;
+                }
+            }
+            TieSum += TieCount*TieCount*TieCount - TieCount;
+
+            First = OnePastLast;
+        }
+
+        f64 N1 = (f64)BaselineCount;
+        f64 N2 = (f64)CandidateCount;
+        f64 N = N1 + N2;
+        f64 U = BaselineRankSum - 0.5*N1*(N1 + 1);
+        f64 Mean = 0.5*N1*N2;
+        f64 Variance = (N1*N2/12.0)*((N + 1) - TieSum/(N*(N - 1)));
+
+        if(Variance > 0)
+        {
+            f64 Distance = fabs(U - Mean) - 0.5;
+            if(Distance < 0)
+            {
+                Distance = 0;
+            }
+
+            f64 Z = Distance / sqrt(Variance);
+            Result = erfc(Z / sqrt(2.0));
+        }
+    }
+
+    free(Ranked);
+    return Result;
+}
+
+static metric_comparison CompareMetric(f64 *Baseline, u64 BaselineCount, f64 *Candidate, u64 CandidateCount)
+{
+    metric_comparison Result = {};
+
+    u64 MaxCount = (BaselineCount > CandidateCount) ? BaselineCount : CandidateCount;
+    f64 *Scratch = (f64 *)malloc(MaxCount*sizeof(f64));
+    f64 *Resample = (f64 *)malloc(MaxCount*sizeof(f64));
+    f64 *Deltas = (f64 *)malloc(BOOTSTRAP_RESAMPLE_COUNT*sizeof(f64));
+
+    if(Scratch && Resample && Deltas)
+    {
+        Result.BaselineMedian = Median(Baseline, BaselineCount, Scratch);
+        Result.CandidateMedian = Median(Candidate, CandidateCount, Scratch);
+        Result.PValue = MannWhitneyPValue(Baseline, BaselineCount, Candidate, CandidateCount);
+
+        if(Result.BaselineMedian != 0)
+        {
+            f64 Scale = 100.0 / Result.BaselineMedian;
+            Result.DeltaPercent = Scale*(Result.CandidateMedian - Result.BaselineMedian);
+
+            // NOTE: Percentile bootstrap of the difference in medians, expressed relative to the baseline median
+            u64 RandomState = 0x9E3779B97F4A7C15ull;
+            for(u32 ResampleIndex = 0; ResampleIndex < BOOTSTRAP_RESAMPLE_COUNT; ++ResampleIndex)
+            {
+                for(u64 Index = 0; Index < BaselineCount; ++Index)
+                {
+                    Resample[Index] = Baseline[RandomU64(&RandomState) % BaselineCount];
+                }
+                f64 BaselineMedian = Median(Resample, BaselineCount, Scratch);
+
+                for(u64 Index = 0; Index < CandidateCount; ++Index)
+                {
+                    Resample[Index] = Candidate[RandomU64(&RandomState) % CandidateCount];
+                }
+                f64 CandidateMedian = Median(Resample, CandidateCount, Scratch);
+
+                Deltas[ResampleIndex] = Scale*(CandidateMedian - BaselineMedian);
+            }
+            qsort(Deltas, BOOTSTRAP_RESAMPLE_COUNT, sizeof(f64), CompareF64);
+
+            Result.LowPercent = Deltas[(BOOTSTRAP_RESAMPLE_COUNT*25)/1000];
+            Result.HighPercent = Deltas[(BOOTSTRAP_RESAMPLE_COUNT*975)/1000];
+        }
+    }
+
+    free(Deltas);
+    free(Resample);
+    free(Scratch);
+
+    return Result;
+}
+
+static void GatherMetric(pmc_results_sample *Samples, u64 Count, s32 PMCIndex, f64 *Dest)
+{
+    for(u64 SampleIndex = 0; SampleIndex < Count; ++SampleIndex)
+    {
+        pmc_results_sample *Sample = Samples + SampleIndex;
+        Dest[SampleIndex] = (PMCIndex < 0) ? (f64)Sample->TSCElapsed : (f64)Sample->Counters[PMCIndex];
+    }
+}
+
+static s32 FindPMCByName(pmc_results_file *File, char const *Name)
+{
+    s32 Result = -1;
+    for(u32 PMCIndex = 0; PMCIndex < File->Header.PMCCount; ++PMCIndex)
+    {
+        if(strcmp(File->Header.Names[PMCIndex], Name) == 0)
+        {
+            Result = (s32)PMCIndex;
+            break;
+        }
+    }
+
+    return Result;
+}
+
+static int CompareSampleSites(void const *A, void const *B)
+{
+    u32 SiteA = ((pmc_results_sample const *)A)->SiteID;
+    u32 SiteB = ((pmc_results_sample const *)B)->SiteID;
+    int Result = (SiteA < SiteB) ? -1 : ((SiteA > SiteB) ? 1 : 0);
+    return Result;
+}
+
+static u64 FindSiteEnd(pmc_results_file *File, u64 First)
+{
+    u64 Result = First;
+    while((Result < File->Header.SampleCount) && (File->Samples[Result].SiteID == File->Samples[First].SiteID))
+    {
+        ++Result;
+    }
+
+    return Result;
+}
+
+int main(int ArgCount, char **Args)
+{
+    f64 Alpha = 0.01;
+    f64 ThresholdPercent = 1.0;
+    char const *FileNames[2] = {};
+    u32 FileNameCount = 0;
+
+    b32 UsageError = false;
+    for(int ArgIndex = 1; ArgIndex < ArgCount; ++ArgIndex)
+    {
+        if((strcmp(Args[ArgIndex], "-alpha") == 0) && ((ArgIndex + 1) < ArgCount))
+        {
+            Alpha = atof(Args[++ArgIndex]);
+        }
+        else if((strcmp(Args[ArgIndex], "-threshold") == 0) && ((ArgIndex + 1) < ArgCount))
+        {
+            ThresholdPercent = atof(Args[++ArgIndex]);
+        }
+        else if(FileNameCount < ArrayCount(FileNames))
+        {
+            FileNames[FileNameCount++] = Args[ArgIndex];
+        }
+        else
+        {
+            UsageError = true;
+        }
+    }
+
+    if(UsageError || (FileNameCount != 2))
+    {
+        fprintf(stderr, "USAGE: %s [-alpha 0.01] [-threshold 1.0] [baseline results] [candidate results]\n", Args[0]);
+        fprintf(stderr, "  Exits with 1 if any metric regressed by more than threshold percent with p < alpha.\n");
+        return 2;
+    }
+
+    pmc_results_file Baseline, Candidate;
+    if(!LoadResultsFile(&Baseline, FileNames[0]))
+    {
+        fprintf(stderr, "ERROR: Unable to load results from %s\n", FileNames[0]);
+        return 2;
+    }
+    if(!LoadResultsFile(&Candidate, FileNames[1]))
+    {
+        fprintf(stderr, "ERROR: Unable to load results from %s\n", FileNames[1]);
+        FreeResultsFile(&Baseline);
+        return 2;
+    }
+
+    u64 MaxSampleCount = (Baseline.Header.SampleCount > Candidate.Header.SampleCount) ?
+        Baseline.Header.SampleCount : Candidate.Header.SampleCount;
+    f64 *BaselineValues = (f64 *)malloc(MaxSampleCount*sizeof(f64) + 1);
+    f64 *CandidateValues = (f64 *)malloc(MaxSampleCount*sizeof(f64) + 1);
+    if(!BaselineValues || !CandidateValues)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate comparison memory\n");
+        free(CandidateValues);
+        free(BaselineValues);
+        FreeResultsFile(&Candidate);
+        FreeResultsFile(&Baseline);
+        return 2;
+    }
+
+    // NOTE: Both runs are sorted by site once, so each site's samples are one contiguous span, and the two runs
+    // can be walked side by side
+    qsort(Baseline.Samples, Baseline.Header.SampleCount, sizeof(pmc_results_sample), CompareSampleSites);
+    qsort(Candidate.Samples, Candidate.Header.SampleCount, sizeof(pmc_results_sample), CompareSampleSites);
+
+    u32 RegressionCount = 0;
+    u64 BaselineFirst = 0;
+    u64 CandidateFirst = 0;
+    while((BaselineFirst < Baseline.Header.SampleCount) || (CandidateFirst < Candidate.Header.SampleCount))
+    {
+        u64 BaselineEnd = FindSiteEnd(&Baseline, BaselineFirst);
+        u64 CandidateEnd = FindSiteEnd(&Candidate, CandidateFirst);
+        b32 InBaseline = (BaselineFirst < BaselineEnd);
+        b32 InCandidate = (CandidateFirst < CandidateEnd);
+        u32 BaselineSite = InBaseline ? Baseline.Samples[BaselineFirst].SiteID : 0;
+        u32 CandidateSite = InCandidate ? Candidate.Samples[CandidateFirst].SiteID : 0;
+
+        if(!InBaseline || (InCandidate && (CandidateSite < BaselineSite)))
+        {
+            printf("SITE %u:\n  (site not in baseline)\n", CandidateSite);
+            CandidateFirst = CandidateEnd;
+            continue;
+        }
+
+        u32 SiteID = BaselineSite;
+        printf("SITE %u:\n", SiteID);
+
+        u64 BaselineCount = BaselineEnd - BaselineFirst;
+        u64 CandidateCount = 0;
+        if(InCandidate && (CandidateSite == SiteID))
+        {
+            CandidateCount = CandidateEnd - CandidateFirst;
+        }
+
+        // NOTE: Metric -1 is TSCElapsed, the rest are the baseline's counters, matched by name in the candidate
+        for(s32 BaselinePMC = -1; BaselinePMC < (s32)Baseline.Header.PMCCount; ++BaselinePMC)
+        {
+            char const *Name = (BaselinePMC < 0) ? "TSCElapsed" : Baseline.Header.Names[BaselinePMC];
+            s32 CandidatePMC = (BaselinePMC < 0) ? -1 : FindPMCByName(&Candidate, Name);
+            if((BaselinePMC >= 0) && (CandidatePMC < 0))
+            {
+                printf("  %-24s (not in candidate)\n", Name);
+                continue;
+            }
+
+            if(CandidateCount == 0)
+            {
+                printf("  (site not in candidate)\n");
+                break;
+            }
+
+            GatherMetric(Baseline.Samples + BaselineFirst, BaselineCount, BaselinePMC, BaselineValues);
+            GatherMetric(Candidate.Samples + CandidateFirst, CandidateCount, CandidatePMC, CandidateValues);
+
+            metric_comparison Compare = CompareMetric(BaselineValues, BaselineCount, CandidateValues, CandidateCount);
+
+            b32 Significant = (Compare.PValue < Alpha);
+            b32 Regressed = Significant && (Compare.LowPercent > ThresholdPercent);
+            b32 Improved = Significant && (Compare.HighPercent < -ThresholdPercent);
+            if(Regressed)
+            {
+                ++RegressionCount;
+            }
+
+            printf("  %-24s %14.0f -> %14.0f %+7.2f%% [95%% CI %+7.2f%% .. %+7.2f%%] p=%.4f%s\n",
+                   Name, Compare.BaselineMedian, Compare.CandidateMedian, Compare.DeltaPercent,
+                   Compare.LowPercent, Compare.HighPercent, Compare.PValue,
+                   Regressed ? " REGRESSION" : (Improved ? " improved" : ""));
+        }
+
+        BaselineFirst = BaselineEnd;
+        if(CandidateCount)
+        {
+            CandidateFirst = CandidateEnd;
+        }
+    }
+
+    printf("\n%u significant regression%s (alpha %g, threshold %g%%)\n", RegressionCount,
+           (RegressionCount != 1) ? "s" : "", Alpha, ThresholdPercent);
+
+    free(CandidateValues);
+    free(BaselineValues);
+    FreeResultsFile(&Candidate);
+    FreeResultsFile(&Baseline);
+
+    int Result = (RegressionCount > 0) ? 1 : 0;
+    return Result;
+}
@@ -0,0 +1,106 @@
+/* ========================================================================
+
+   (C) Copyright 2024 by Molly Rocket, Inc., All Rights Reserved.
+
+   This software is provided 'as-is', without any express or implied
+   warranty. In no event will the authors be held liable for any damages
+   arising from the use of this software.
+
+   Please see https://computerenhance.com for more information
+
+   ======================================================================== */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <intrin.h>
+#include <windows.h>
+#include <psapi.h>
+#include <evntrace.h>
+#include <evntcons.h>
+
+#pragma comment (lib, "advapi32.lib")
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+typedef int32_t b32;
+
+typedef float f32;
+typedef double f64;
+
+#define ArrayCount(Array) (sizeof(Array)/sizeof((Array)[0]))
+
+#include "pmctrace.h"
+#include "pmctrace.cpp"
+
+// NOTE: Owns the one kernel logger session on this machine and serves every process that calls
+// ConnectToPMCDaemon (for example pmctrace_simple_test -daemon), so they no longer stop each other's sessions.
+// Its session is named separately from the one StartTracing uses, so a plain tracer started elsewhere can't stop it.
+int main(void)
+{
+    pmc_name_array AMDNameArray =
+    {
+        L"TotalIssues",
+        L"BranchMispredictions",
+        L"DcacheMisses",
+        L"IcacheMisses",
+    };
+
+    pmc_name_array IntelNameArray =
+    {
+        L"TotalIssues",
+        L"UnhaltedCoreCycles",
+        L"BranchInstructions",
+        L"BranchMispredictions",
+    };
+
+    pmc_name_array *UsedNames = &AMDNameArray;
+    pmc_source_mapping PMCMapping = MapPMCNames(&AMDNameArray);
+    if(!IsValid(&PMCMapping))
+    {
+        UsedNames = &IntelNameArray;
+        PMCMapping = MapPMCNames(&IntelNameArray);
+    }
+
+    int ExitCode = 0;
+    if(IsValid(&PMCMapping))
+    {
+        pmc_tracer Tracer;
+        StartPMCDaemon(&Tracer, &PMCMapping);
+
+        if(NoErrors(&Tracer))
+        {
+            printf("Serving PMC clients with");
+            for(u32 NameIndex = 0; NameIndex < PMCMapping.PMCCount; ++NameIndex)
+            {
+                printf(" %S", UsedNames->Strings[NameIndex]);
+            }
+            printf(" - press Enter to stop\n");
+
+            getchar();
+
+            pmc_tracer_stats Stats = GetTracerStats(&Tracer);
+            printf("Served %llu markers in %.2f seconds (%llu client markers rejected)\n",
+                   Stats.Kinds[TracerEvent_Marker].EventCount, Stats.ElapsedSeconds, Stats.RejectedClientMarkerCount);
+        }
+
+        if(!NoErrors(&Tracer))
+        {
+            printf("ERROR: %s\n", GetErrorMessage(&Tracer));
+            ExitCode = 1;
+        }
+
+        StopTracing(&Tracer);
+    }
+    else
+    {
+        printf("ERROR: Unable to find suitable ETW PMCs\n");
+        ExitCode = 1;
+    }
+
+    return ExitCode;
+}
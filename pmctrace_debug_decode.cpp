@@ -0,0 +1,115 @@
+/* ========================================================================
+
+   (C) Copyright 2024 by Molly Rocket, Inc., All Rights Reserved.
+
+   This software is provided 'as-is', without any express or implied
+   warranty. In no event will the authors be held liable for any damages
+   arising from the use of this software.
+
+   Please see https://computerenhance.com for more information
+
+   ======================================================================== */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <intrin.h>
+#include <windows.h>
+#include <psapi.h>
+#include <evntrace.h>
+#include <evntcons.h>
+
+#pragma comment (lib, "advapi32.lib")
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+typedef int32_t b32;
+
+typedef float f32;
+typedef double f64;
+
+#define ArrayCount(Array) (sizeof(Array)/sizeof((Array)[0]))
+
+#include "pmctrace.h"
+#include "pmctrace.cpp"
+
+int main(int ArgCount, char **Args)
+{
+    int Result = 1;
+
+    if(ArgCount == 2)
+    {
+        FILE *File = fopen(Args[1], "rb");
+        if(File)
+        {
+            pmc_debug_log_file_header Header = {};
+            static char MessageText[PMC_DEBUG_LOG_MESSAGE_COUNT*256];
+            if((fread(&Header, sizeof(Header), 1, File) == 1) &&
+               (Header.Magic == PMC_DEBUG_LOG_FILE_MAGIC) &&
+               (Header.Version == PMC_DEBUG_LOG_FILE_VERSION) &&
+               (Header.EntrySize == sizeof(pmc_debug_log_entry)) &&
+               (Header.MessageCount <= PMC_DEBUG_LOG_MESSAGE_COUNT) &&
+               (Header.MessageSize <= sizeof(MessageText)) &&
+               (fread(MessageText, 1, Header.MessageSize, File) == Header.MessageSize))
+            {
+                // NOTE: The messages are stored back to back, each with its terminator. A count that the text does
+                // not actually hold leaves the missing ones unknown rather than pointing past the text.
+                char const *Messages[PMC_DEBUG_LOG_MESSAGE_COUNT];
+                u32 MessageCount = 0;
+                for(u32 At = 0; (At < Header.MessageSize) && (MessageCount < Header.MessageCount); ++MessageCount)
+                {
+                    Messages[MessageCount] = MessageText + At;
+                    while((At < Header.MessageSize) && MessageText[At])
+                    {
+                        ++At;
+                    }
+                    if(At == Header.MessageSize)
+                    {
+                        break;
+                    }
+                    ++At;
+                }
+
+                char Text[1024];
+                pmc_debug_log_entry Entry;
+
+                u64 EntryIndex = 0;
+                while((EntryIndex < Header.EntryCount) && (fread(&Entry, sizeof(Entry), 1, File) == 1))
+                {
+                    FormatDebugLogEntry(Text, sizeof(Text), &Entry, Header.PMCCount, Messages, MessageCount);
+                    fputs(Text, stdout);
+                    ++EntryIndex;
+                }
+
+                if(EntryIndex == Header.EntryCount)
+                {
+                    Result = 0;
+                }
+                else
+                {
+                    fprintf(stderr, "ERROR: Log truncated after %llu of %llu entries\n", EntryIndex, Header.EntryCount);
+                }
+            }
+            else
+            {
+                fprintf(stderr, "ERROR: %s is not a pmctrace debug log\n", Args[1]);
+            }
+
+            fclose(File);
+        }
+        else
+        {
+            fprintf(stderr, "ERROR: Unable to open %s\n", Args[1]);
+        }
+    }
+    else
+    {
+        fprintf(stderr, "USAGE: %s [debug log file]\n", Args[0]);
+    }
+
+    return Result;
+}
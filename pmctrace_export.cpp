@@ -0,0 +1,266 @@
+/* ========================================================================
+
+   (C) Copyright 2024 by Molly Rocket, Inc., All Rights Reserved.
+
+   This software is provided 'as-is', without any express or implied
+   warranty. In no event will the authors be held liable for any damages
+   arising from the use of this software.
+
+   Please see https://computerenhance.com for more information
+
+   ======================================================================== */
+
+static f64 FileTimeToSeconds(FILETIME Time)
+{
+    u64 Ticks = ((u64)Time.dwHighDateTime << 32) | Time.dwLowDateTime;
+    f64 Result = (f64)Ticks * 1e-7;
+    return Result;
+}
+
+static b32 WritePMCMetrics(pmc_exporter *Exporter, f64 IntervalSeconds)
+{
+    pmc_site_aggregates *Totals = Exporter->Totals;
+    pmc_site_aggregates *Interval = Exporter->Interval;
+
+    FILE *File = fopen(Exporter->TempFileName, "wb");
+    if(File)
+    {
+        fprintf(File, "# TYPE pmctrace_regions counter\n");
+        for(u32 SiteID = 0; SiteID < MAX_PMC_AGGREGATE_SITE_COUNT; ++SiteID)
+        {
+            if(Totals->Sites[SiteID].RegionCount)
+            {
+                fprintf(File, "pmctrace_regions_total{site=\"%u\"} %llu\n", SiteID, Totals->Sites[SiteID].RegionCount);
+            }
+        }
+
+        fprintf(File, "# TYPE pmctrace_region_rate_hertz gauge\n");
+        fprintf(File, "# UNIT pmctrace_region_rate_hertz hertz\n");
+        for(u32 SiteID = 0; SiteID < MAX_PMC_AGGREGATE_SITE_COUNT; ++SiteID)
+        {
+            if(Totals->Sites[SiteID].RegionCount)
+            {
+                f64 Rate = (IntervalSeconds > 0) ? ((f64)Interval->Sites[SiteID].RegionCount / IntervalSeconds) : 0;
+                fprintf(File, "pmctrace_region_rate_hertz{site=\"%u\"} %.3f\n", SiteID, Rate);
+            }
+        }
+
+        fprintf(File, "# TYPE pmctrace_context_switches counter\n");
+        for(u32 SiteID = 0; SiteID < MAX_PMC_AGGREGATE_SITE_COUNT; ++SiteID)
+        {
+            if(Totals->Sites[SiteID].RegionCount)
+            {
+                fprintf(File, "pmctrace_context_switches_total{site=\"%u\"} %llu\n", SiteID, Totals->Sites[SiteID].ContextSwitchCount);
+            }
+        }
+
+        fprintf(File, "# TYPE pmctrace_pmc counter\n");
+        for(u32 SiteID = 0; SiteID < MAX_PMC_AGGREGATE_SITE_COUNT; ++SiteID)
+        {
+            if(Totals->Sites[SiteID].RegionCount)
+            {
+                for(u32 CI = 0; CI < Exporter->PMCCount; ++CI)
+                {
+                    fprintf(File, "pmctrace_pmc_total{site=\"%u\",pmc=\"%s\"} %llu\n", SiteID, Exporter->Names[CI],
+                            Totals->Sites[SiteID].Counters[CI]);
+                }
+            }
+        }
+
+        fprintf(File, "# TYPE pmctrace_pmc_rate gauge\n");
+        for(u32 SiteID = 0; SiteID < MAX_PMC_AGGREGATE_SITE_COUNT; ++SiteID)
+        {
+            if(Totals->Sites[SiteID].RegionCount)
+            {
+                for(u32 CI = 0; CI < Exporter->PMCCount; ++CI)
+                {
+                    f64 Rate = (IntervalSeconds > 0) ? ((f64)Interval->Sites[SiteID].Counters[CI] / IntervalSeconds) : 0;
+                    fprintf(File, "pmctrace_pmc_rate{site=\"%u\",pmc=\"%s\"} %.3f\n", SiteID, Exporter->Names[CI], Rate);
+                }
+            }
+        }
+
+        // NOTE: The histogram is cumulative over the whole run, as OpenMetrics requires, with power-of-two bounds
+        fprintf(File, "# TYPE pmctrace_region_tsc histogram\n");
+        for(u32 SiteID = 0; SiteID < MAX_PMC_AGGREGATE_SITE_COUNT; ++SiteID)
+        {
+            pmc_site_aggregate *Site = &Totals->Sites[SiteID];
+            if(Site->RegionCount)
+            {
+                u64 Cumulative = 0;
+                for(u32 Bucket = 0; Bucket < (PMC_AGGREGATE_HISTOGRAM_BUCKET_COUNT - 1); ++Bucket)
+                {
+                    Cumulative += Site->TSCHistogram[Bucket];
+                    if(Site->TSCHistogram[Bucket])
+                    {
+                        fprintf(File, "pmctrace_region_tsc_bucket{site=\"%u\",le=\"%llu\"} %llu\n", SiteID,
+                                (2ull << Bucket) - 1, Cumulative);
+                    }
+                }
+                fprintf(File, "pmctrace_region_tsc_bucket{site=\"%u\",le=\"+Inf\"} %llu\n", SiteID, Site->RegionCount);
+                fprintf(File, "pmctrace_region_tsc_count{site=\"%u\"} %llu\n", SiteID, Site->RegionCount);
+                fprintf(File, "pmctrace_region_tsc_sum{site=\"%u\"} %llu\n", SiteID, Site->TSCElapsed);
+            }
+        }
+
+        fprintf(File, "# TYPE pmctrace_dropped_regions counter\n");
+        fprintf(File, "pmctrace_dropped_regions_total %llu\n", Totals->DroppedRegionCount);
+
+        fprintf(File, "# TYPE pmctrace_exporter_cpu_seconds counter\n");
+        fprintf(File, "# UNIT pmctrace_exporter_cpu_seconds seconds\n");
+        fprintf(File, "pmctrace_exporter_cpu_seconds_total %.6f\n", Exporter->Stats.CPUSeconds);
+        fprintf(File, "# TYPE pmctrace_exporter_memory_bytes gauge\n");
+        fprintf(File, "# UNIT pmctrace_exporter_memory_bytes bytes\n");
+        fprintf(File, "pmctrace_exporter_memory_bytes %llu\n", Exporter->Stats.MemoryBytes);
+        fprintf(File, "# EOF\n");
+    }
+
+    b32 Result = (File && (fclose(File) == 0) &&
+                  MoveFileExA(Exporter->TempFileName, Exporter->FileName, MOVEFILE_REPLACE_EXISTING));
+    return Result;
+}
+
+static void ExportPMCSnapshot(pmc_exporter *Exporter)
+{
+    LARGE_INTEGER NowQPC;
+    QueryPerformanceCounter(&NowQPC);
+    f64 IntervalSeconds = (f64)(NowQPC.QuadPart - Exporter->LastSnapshotQPC) / (f64)Exporter->QPCFrequency;
+    Exporter->LastSnapshotQPC = NowQPC.QuadPart;
+
+    TakePMCAggregates(Exporter->Tracer, Exporter->Interval);
+
+    pmc_site_aggregates *Totals = Exporter->Totals;
+    pmc_site_aggregates *Interval = Exporter->Interval;
+    for(u32 SiteID = 0; SiteID < MAX_PMC_AGGREGATE_SITE_COUNT; ++SiteID)
+    {
+        pmc_site_aggregate *Total = &Totals->Sites[SiteID];
+        pmc_site_aggregate *Delta = &Interval->Sites[SiteID];
+        if(Delta->RegionCount)
+        {
+            Total->RegionCount += Delta->RegionCount;
+            Total->TSCElapsed += Delta->TSCElapsed;
+            Total->ContextSwitchCount += Delta->ContextSwitchCount;
+            for(u32 CI = 0; CI < MAX_TRACE_PMC_COUNT; ++CI)
+            {
+                Total->Counters[CI] += Delta->Counters[CI];
+            }
+            for(u32 Bucket = 0; Bucket < PMC_AGGREGATE_HISTOGRAM_BUCKET_COUNT; ++Bucket)
+            {
+                Total->TSCHistogram[Bucket] += Delta->TSCHistogram[Bucket];
+            }
+        }
+    }
+    Totals->DroppedRegionCount += Interval->DroppedRegionCount;
+
+    // NOTE: The CPU time is sampled before writing, so each file reports the cost of every snapshot before it
+    FILETIME Creation, Exit, Kernel, User;
+    if(GetThreadTimes(GetCurrentThread(), &Creation, &Exit, &Kernel, &User))
+    {
+        Exporter->Stats.CPUSeconds = FileTimeToSeconds(Kernel) + FileTimeToSeconds(User);
+    }
+
+    if(!WritePMCMetrics(Exporter, IntervalSeconds))
+    {
+        ++Exporter->Stats.FailedWriteCount;
+    }
+    ++Exporter->Stats.SnapshotCount;
+}
+
+static DWORD CALLBACK PMCExporterThread(void *Arg)
+{
+    pmc_exporter *Exporter = (pmc_exporter *)Arg;
+    while(WaitForSingleObject(Exporter->StopEvent, Exporter->IntervalMS) == WAIT_TIMEOUT)
+    {
+        ExportPMCSnapshot(Exporter);
+    }
+
+    ExportPMCSnapshot(Exporter);
+    return 0;
+}
+
+static b32 StartPMCExporter(pmc_exporter *Exporter, pmc_tracer *Tracer, pmc_name_array *Names, char const *FileName,
+                            u32 IntervalMS)
+{
+    *Exporter = {};
+    Exporter->Tracer = Tracer;
+    Exporter->IntervalMS = IntervalMS;
+    Exporter->PMCCount = Tracer->Mapping.PMCCount;
+
+    snprintf(Exporter->FileName, sizeof(Exporter->FileName), "%s", FileName);
+    snprintf(Exporter->TempFileName, sizeof(Exporter->TempFileName), "%s.tmp", FileName);
+
+    // NOTE: PMC names are plain ASCII, so narrowing them is lossless in practice
+    for(u32 PMCIndex = 0; PMCIndex < Exporter->PMCCount; ++PMCIndex)
+    {
+        wchar_t const *Name = Names->Strings[PMCIndex];
+        for(u32 CharIndex = 0; Name && Name[CharIndex] && (CharIndex < (PMC_EXPORT_NAME_LENGTH - 1)); ++CharIndex)
+        {
+            Exporter->Names[PMCIndex][CharIndex] = (char)Name[CharIndex];
+        }
+    }
+
+    LARGE_INTEGER Frequency, NowQPC;
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&NowQPC);
+    Exporter->QPCFrequency = Frequency.QuadPart;
+    Exporter->LastSnapshotQPC = NowQPC.QuadPart;
+
+    u64 BufferSize = 2*sizeof(pmc_site_aggregates);
+    u8 *Buffers = (u8 *)VirtualAlloc(0, BufferSize, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+    if(Buffers && EnablePMCAggregates(Tracer))
+    {
+        Exporter->Interval = (pmc_site_aggregates *)Buffers;
+        Exporter->Totals = (pmc_site_aggregates *)(Buffers + sizeof(pmc_site_aggregates));
+
+        // NOTE: The tracer's two aggregate buffers exist only because of the exporter, so they count against it too
+        Exporter->Stats.MemoryBytes = BufferSize + 2*sizeof(pmc_site_aggregates) + sizeof(*Exporter);
+
+        Exporter->StopEvent = CreateEventA(0, TRUE, FALSE, 0);
+        if(Exporter->StopEvent)
+        {
+            Exporter->Thread = CreateThread(0, 0, PMCExporterThread, Exporter, 0, 0);
+        }
+    }
+
+    b32 Result = (Exporter->Thread != 0);
+    if(!Result)
+    {
+        if(Exporter->StopEvent)
+        {
+            CloseHandle(Exporter->StopEvent);
+        }
+
+        if(Buffers)
+        {
+            VirtualFree(Buffers, 0, MEM_RELEASE);
+        }
+
+        *Exporter = {};
+    }
+
+    return Result;
+}
+
+static void StopPMCExporter(pmc_exporter *Exporter)
+{
+    if(Exporter->Thread)
+    {
+        SetEvent(Exporter->StopEvent);
+        WaitForSingleObject(Exporter->Thread, INFINITE);
+        CloseHandle(Exporter->Thread);
+        CloseHandle(Exporter->StopEvent);
+
+        // NOTE: Interval and Totals share one allocation
+        VirtualFree(Exporter->Interval, 0, MEM_RELEASE);
+
+        Exporter->Thread = 0;
+        Exporter->Interval = 0;
+        Exporter->Totals = 0;
+    }
+}
+
+static pmc_exporter_stats GetPMCExporterStats(pmc_exporter *Exporter)
+{
+    pmc_exporter_stats Result = Exporter->Stats;
+    return Result;
+}
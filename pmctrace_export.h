@@ -0,0 +1,59 @@
+/* ========================================================================
+
+   (C) Copyright 2024 by Molly Rocket, Inc., All Rights Reserved.
+
+   This software is provided 'as-is', without any express or implied
+   warranty. In no event will the authors be held liable for any damages
+   arising from the use of this software.
+
+   Please see https://computerenhance.com for more information
+
+   ======================================================================== */
+
+//
+// NOTE: Periodic metrics export
+//
+
+// NOTE: The exporter runs its own thread, which takes the tracer's per-site aggregates every IntervalMS and
+// rewrites an OpenMetrics text file with cumulative per-site totals, rates over the last interval, and a TSC
+// histogram per site. Only sites that have completed a region appear. The file is written to a temporary name and
+// renamed over the old one, so a scraper never sees a partial file. The exporter also reports its own cost:
+// the CPU time of its thread and the memory it allocated.
+
+#define PMC_EXPORT_NAME_LENGTH 64
+#define PMC_EXPORT_FILE_NAME_LENGTH 260
+
+struct pmc_exporter_stats
+{
+    u64 SnapshotCount;
+    u64 FailedWriteCount;
+    u64 MemoryBytes;
+    f64 CPUSeconds;
+};
+
+struct pmc_exporter
+{
+    pmc_tracer *Tracer;
+    HANDLE Thread;
+    HANDLE StopEvent;
+    u32 IntervalMS;
+
+    char FileName[PMC_EXPORT_FILE_NAME_LENGTH];
+    char TempFileName[PMC_EXPORT_FILE_NAME_LENGTH + 4];
+    char Names[MAX_TRACE_PMC_COUNT][PMC_EXPORT_NAME_LENGTH];
+    u32 PMCCount;
+
+    pmc_site_aggregates *Interval;
+    pmc_site_aggregates *Totals;
+    u64 LastSnapshotQPC;
+    u64 QPCFrequency;
+
+    pmc_exporter_stats Stats;
+};
+
+// NOTE: StartPMCExporter returns false if aggregates could not be enabled or the thread could not be started.
+// StopPMCExporter writes one last snapshot before returning.
+static b32 StartPMCExporter(pmc_exporter *Exporter, pmc_tracer *Tracer, pmc_name_array *Names, char const *FileName,
+                            u32 IntervalMS);
+static void StopPMCExporter(pmc_exporter *Exporter);
+static pmc_exporter_stats GetPMCExporterStats(pmc_exporter *Exporter);
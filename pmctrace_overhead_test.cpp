@@ -0,0 +1,233 @@
+/* ========================================================================
+
+   (C) Copyright 2024 by Molly Rocket, Inc., All Rights Reserved.
+
+   This software is provided 'as-is', without any express or implied
+   warranty. In no event will the authors be held liable for any damages
+   arising from the use of this software.
+
+   Please see https://computerenhance.com for more information
+
+   ======================================================================== */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <intrin.h>
+#include <windows.h>
+#include <psapi.h>
+#include <evntrace.h>
+#include <evntcons.h>
+
+#pragma comment (lib, "advapi32.lib")
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+typedef int32_t b32;
+
+typedef float f32;
+typedef double f64;
+
+#define ArrayCount(Array) (sizeof(Array)/sizeof((Array)[0]))
+
+#include "pmctrace.h"
+#include "pmctrace.cpp"
+
+// NOTE: Measures what an empty region costs the calling thread with each region mode. "Caller" is the TSC
+// spent inside the Start/Stop calls, "floor" is the smallest TSCElapsed an empty region reports, and for the
+// asynchronous paths "latency" is how long after Stop (or Flush) the result became readable.
+
+#define BATCH_SIZE 256
+#define BATCH_COUNT 64
+
+static void PrintCounters(pmc_name_array *Names, pmc_trace_result *Result)
+{
+    for(u32 CI = 0; CI < Result->PMCCount; ++CI)
+    {
+        printf("    %llu %S\n", Result->Counters[CI], Names->Strings[CI]);
+    }
+}
+
+int main(void)
+{
+    pmc_name_array AMDNameArray =
+    {
+        L"TotalIssues",
+        L"BranchMispredictions",
+        L"DcacheMisses",
+        L"IcacheMisses",
+    };
+
+    pmc_name_array IntelNameArray =
+    {
+        L"TotalIssues",
+        L"UnhaltedCoreCycles",
+        L"BranchInstructions",
+        L"BranchMispredictions",
+    };
+
+    pmc_name_array *UsedNames = &AMDNameArray;
+    pmc_source_mapping PMCMapping = MapPMCNames(&AMDNameArray);
+    if(!IsValid(&PMCMapping))
+    {
+        UsedNames = &IntelNameArray;
+        PMCMapping = MapPMCNames(&IntelNameArray);
+    }
+
+    if(!IsValid(&PMCMapping))
+    {
+        printf("ERROR: Unable to find suitable ETW PMCs\n");
+        return 1;
+    }
+
+    pmc_tracer Tracer;
+    StartTracing(&Tracer, &PMCMapping);
+
+    int ExitCode = 0;
+
+    static pmc_traced_region Regions[BATCH_SIZE];
+    static u64 StopTSC[BATCH_SIZE];
+
+    u64 AsyncCallerTSC = 0;
+    u64 AsyncLatencyTSC = 0;
+    u64 AsyncCount = 0;
+    pmc_trace_result AsyncFloor = {};
+    AsyncFloor.TSCElapsed = (u64)-1ll;
+    for(u32 BatchIndex = 0; NoErrors(&Tracer) && (BatchIndex < BATCH_COUNT); ++BatchIndex)
+    {
+        for(u32 RegionIndex = 0; RegionIndex < BATCH_SIZE; ++RegionIndex)
+        {
+            u64 BeginTSC = __rdtsc();
+            StartCountingPMCs(&Tracer, &Regions[RegionIndex]);
+            StopCountingPMCs(&Tracer, &Regions[RegionIndex]);
+            StopTSC[RegionIndex] = __rdtsc();
+            AsyncCallerTSC += StopTSC[RegionIndex] - BeginTSC;
+        }
+
+        for(u32 RegionIndex = 0; NoErrors(&Tracer) && (RegionIndex < BATCH_SIZE); ++RegionIndex)
+        {
+            pmc_trace_result Result = GetOrWaitForResult(&Tracer, &Regions[RegionIndex]);
+            u64 ReadyTSC = __rdtsc();
+
+            // NOTE: Only the first result of a batch is actually waited on from its Stop, since the rest
+            // are often already complete by the time the loop reaches them
+            if(RegionIndex == 0)
+            {
+                AsyncLatencyTSC += ReadyTSC - StopTSC[RegionIndex];
+            }
+
+            if(AsyncFloor.TSCElapsed > Result.TSCElapsed)
+            {
+                AsyncFloor = Result;
+            }
+            ++AsyncCount;
+        }
+    }
+
+    if(NoErrors(&Tracer))
+    {
+        printf("ASYNC - %llu empty regions:\n", AsyncCount);
+        printf("  %.0f TSC caller, %.0f TSC latency, %llu TSC floor\n", (f64)AsyncCallerTSC / AsyncCount,
+               (f64)AsyncLatencyTSC / BATCH_COUNT, AsyncFloor.TSCElapsed);
+        PrintCounters(UsedNames, &AsyncFloor);
+
+        // NOTE: An accumulated region takes the same markers per pair, but only one result per batch, which
+        // must account for every pair in it
+        static pmc_accumulated_region Accumulated;
+        u64 AccumulatedCallerTSC = 0;
+        u64 AccumulatedLatencyTSC = 0;
+        u64 AccumulatedCount = 0;
+        pmc_trace_result AccumulatedTotal = {};
+        for(u32 BatchIndex = 0; NoErrors(&Tracer) && (BatchIndex < BATCH_COUNT); ++BatchIndex)
+        {
+            for(u32 RegionIndex = 0; RegionIndex < BATCH_SIZE; ++RegionIndex)
+            {
+                u64 BeginTSC = __rdtsc();
+                StartAccumulatingPMCs(&Tracer, &Accumulated);
+                StopAccumulatingPMCs(&Tracer, &Accumulated);
+                AccumulatedCallerTSC += __rdtsc() - BeginTSC;
+            }
+
+            u64 FlushTSC = __rdtsc();
+            FlushAccumulatedPMCs(&Tracer, &Accumulated);
+            pmc_trace_result Result = GetOrWaitForFlushedResult(&Tracer, &Accumulated);
+            AccumulatedLatencyTSC += __rdtsc() - FlushTSC;
+
+            if(NoErrors(&Tracer) && (Result.InvocationCount != BATCH_SIZE))
+            {
+                printf("ERROR: Flush %u accounted for %llu of %u pairs\n", BatchIndex, Result.InvocationCount, BATCH_SIZE);
+                ExitCode = 1;
+            }
+
+            AccumulatedCount += Result.InvocationCount;
+            AccumulatedTotal.TSCElapsed += Result.TSCElapsed;
+            AccumulatedTotal.PMCCount = Result.PMCCount;
+            for(u32 CI = 0; CI < Result.PMCCount; ++CI)
+            {
+                AccumulatedTotal.Counters[CI] += Result.Counters[CI];
+            }
+        }
+
+        if(NoErrors(&Tracer) && AccumulatedCount)
+        {
+            // NOTE: An accumulated region has no per-pair floor, so the mean per pair is shown instead
+            printf("\nACCUMULATED - %llu empty regions in %u flushes:\n", AccumulatedCount, BATCH_COUNT);
+            printf("  %.0f TSC caller, %.0f TSC flush latency, %.0f TSC mean\n", (f64)AccumulatedCallerTSC / AccumulatedCount,
+                   (f64)AccumulatedLatencyTSC / BATCH_COUNT, (f64)AccumulatedTotal.TSCElapsed / AccumulatedCount);
+            for(u32 CI = 0; CI < AccumulatedTotal.PMCCount; ++CI)
+            {
+                printf("    %.1f %S\n", (f64)AccumulatedTotal.Counters[CI] / AccumulatedCount, UsedNames->Strings[CI]);
+            }
+        }
+
+        if(EnableSyncPMCs(&Tracer))
+        {
+            u64 SyncCallerTSC = 0;
+            u64 SyncCount = 0;
+            u64 SyncMigrationCount = 0;
+            pmc_trace_result SyncFloor = {};
+            SyncFloor.TSCElapsed = (u64)-1ll;
+            for(u32 Index = 0; NoErrors(&Tracer) && (Index < (BATCH_SIZE*BATCH_COUNT)); ++Index)
+            {
+                pmc_sync_region Region;
+
+                u64 BeginTSC = __rdtsc();
+                StartSyncPMCs(&Tracer, &Region, 0);
+                pmc_trace_result Result = StopSyncPMCs(&Tracer, &Region);
+                SyncCallerTSC += __rdtsc() - BeginTSC;
+
+                if(Result.CPUMigrationCount)
+                {
+                    ++SyncMigrationCount;
+                }
+                else if(SyncFloor.TSCElapsed > Result.TSCElapsed)
+                {
+                    SyncFloor = Result;
+                }
+                ++SyncCount;
+            }
+
+            printf("\nSYNC - %llu empty regions (%llu migrated):\n", SyncCount, SyncMigrationCount);
+            printf("  %.0f TSC caller, 0 TSC latency, %llu TSC floor\n", (f64)SyncCallerTSC / SyncCount, SyncFloor.TSCElapsed);
+            PrintCounters(UsedNames, &SyncFloor);
+        }
+        else
+        {
+            printf("\nSYNC - unavailable: user-mode rdpmc is not enabled on this machine\n");
+        }
+    }
+
+    if(!NoErrors(&Tracer))
+    {
+        printf("ERROR: %s\n", GetErrorMessage(&Tracer));
+        ExitCode = 1;
+    }
+
+    StopTracing(&Tracer);
+
+    return ExitCode;
+}
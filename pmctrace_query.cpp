@@ -0,0 +1,290 @@
+/* ========================================================================
+
+   (C) Copyright 2024 by Molly Rocket, Inc., All Rights Reserved.
+
+   This software is provided 'as-is', without any express or implied
+   warranty. In no event will the authors be held liable for any damages
+   arising from the use of this software.
+
+   Please see https://computerenhance.com for more information
+
+   ======================================================================== */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+typedef int32_t b32;
+
+typedef float f32;
+typedef double f64;
+
+#define ArrayCount(Array) (sizeof(Array)/sizeof((Array)[0]))
+
+#include "pmctrace.h"
+#include "pmctrace_store.h"
+#include "pmctrace_store.cpp"
+
+// NOTE: Must be a power of two, and larger than the number of distinct groups a query can produce
+#define QUERY_GROUP_TABLE_SIZE 65536
+
+enum query_group_by : u32
+{
+    GroupBy_Site,
+    GroupBy_Thread,
+    GroupBy_CPU,
+    GroupBy_None,
+
+    GroupBy_Count,
+};
+
+struct query_group
+{
+    b32 Used;
+    u32 Key;
+
+    u64 RowCount;
+    u64 TSCElapsed;
+    u64 MinTSCElapsed;
+    u64 MaxTSCElapsed;
+    u64 ContextSwitchCount;
+    u64 Counters[MAX_TRACE_PMC_COUNT];
+};
+
+static u32 GetGroupKey(pmc_store_row *Row, query_group_by GroupBy)
+{
+    u32 Result = 0;
+    switch(GroupBy)
+    {
+        case GroupBy_Site: {Result = Row->SiteID;} break;
+        case GroupBy_Thread: {Result = Row->ThreadID;} break;
+        case GroupBy_CPU: {Result = Row->CPUIndex;} break;
+        default: {} break;
+    }
+    return Result;
+}
+
+static query_group *FindGroup(query_group *Groups, u32 Key)
+{
+    query_group *Result = 0;
+
+    u32 Mask = QUERY_GROUP_TABLE_SIZE - 1;
+    u32 Slot = (Key * 2654435761u) & Mask;
+    for(u32 Probe = 0; Probe < QUERY_GROUP_TABLE_SIZE; ++Probe)
+    {
+        query_group *Group = Groups + ((Slot + Probe) & Mask);
+        if(!Group->Used)
+        {
+            Group->Used = true;
+            Group->Key = Key;
+            Group->MinTSCElapsed = (u64)-1ll;
+            Result = Group;
+            break;
+        }
+        else if(Group->Key == Key)
+        {
+            Result = Group;
+            break;
+        }
+    }
+
+    return Result;
+}
+
+static int CompareGroups(void const *A, void const *B)
+{
+    query_group const *GroupA = (query_group const *)A;
+    query_group const *GroupB = (query_group const *)B;
+
+    // NOTE: Unused slots sort to the end
+    int Result = 0;
+    if(GroupA->Used != GroupB->Used)
+    {
+        Result = GroupA->Used ? -1 : 1;
+    }
+    else if(GroupA->Key != GroupB->Key)
+    {
+        Result = (GroupA->Key < GroupB->Key) ? -1 : 1;
+    }
+    return Result;
+}
+
+static b32 ParseRange(char const *Text, u64 *Min, u64 *Max)
+{
+    char *End;
+    *Min = strtoull(Text, &End, 0);
+    *Max = *Min;
+    if(*End == ':')
+    {
+        *Max = strtoull(End + 1, &End, 0);
+    }
+
+    b32 Result = ((*End == 0) && (*Min <= *Max));
+    return Result;
+}
+
+static b32 ParseValue(char const *Text, u64 *Value)
+{
+    char *End;
+    *Value = strtoull(Text, &End, 0);
+
+    b32 Result = ((*Text != 0) && (*End == 0));
+    return Result;
+}
+
+int main(int ArgCount, char **Args)
+{
+    pmc_store_query Query = DefaultStoreQuery();
+    query_group_by GroupBy = GroupBy_Site;
+    char const *GroupByNames[GroupBy_Count] = {"site", "thread", "cpu", "none"};
+    char const *FileName = 0;
+
+    b32 UsageError = false;
+    for(int ArgIndex = 1; !UsageError && (ArgIndex < ArgCount); ++ArgIndex)
+    {
+        u64 Min, Max;
+        if((strcmp(Args[ArgIndex], "-site") == 0) && ((ArgIndex + 1) < ArgCount))
+        {
+            UsageError = !ParseRange(Args[++ArgIndex], &Min, &Max);
+            Query.MinSiteID = (u32)Min;
+            Query.MaxSiteID = (u32)Max;
+        }
+        else if((strcmp(Args[ArgIndex], "-thread") == 0) && ((ArgIndex + 1) < ArgCount))
+        {
+            UsageError = !ParseRange(Args[++ArgIndex], &Min, &Max);
+            Query.MinThreadID = (u32)Min;
+            Query.MaxThreadID = (u32)Max;
+        }
+        else if((strcmp(Args[ArgIndex], "-from") == 0) && ((ArgIndex + 1) < ArgCount))
+        {
+            UsageError = !ParseValue(Args[++ArgIndex], &Query.MinStartTSC);
+        }
+        else if((strcmp(Args[ArgIndex], "-to") == 0) && ((ArgIndex + 1) < ArgCount))
+        {
+            UsageError = !ParseValue(Args[++ArgIndex], &Query.MaxStartTSC);
+        }
+        else if((strcmp(Args[ArgIndex], "-by") == 0) && ((ArgIndex + 1) < ArgCount))
+        {
+            char const *Name = Args[++ArgIndex];
+            GroupBy = GroupBy_Count;
+            for(u32 GroupIndex = 0; GroupIndex < GroupBy_Count; ++GroupIndex)
+            {
+                if(strcmp(Name, GroupByNames[GroupIndex]) == 0)
+                {
+                    GroupBy = (query_group_by)GroupIndex;
+                }
+            }
+            UsageError = (GroupBy == GroupBy_Count);
+        }
+        else if(!FileName)
+        {
+            FileName = Args[ArgIndex];
+        }
+        else
+        {
+            UsageError = true;
+        }
+    }
+
+    // NOTE: -from and -to can come in either order, so their range is only checked once both are known
+    if(UsageError || !FileName || (Query.MinStartTSC > Query.MaxStartTSC))
+    {
+        fprintf(stderr, "USAGE: %s [-site N[:M]] [-thread N[:M]] [-from TSC] [-to TSC] [-by site|thread|cpu|none] [store]\n", Args[0]);
+        fprintf(stderr, "  Aggregates the stored regions that match every filter, grouped by -by (default site).\n");
+        return 2;
+    }
+
+    pmc_store_reader Reader;
+    if(!OpenStoreForQuery(&Reader, FileName))
+    {
+        fprintf(stderr, "ERROR: Unable to open store %s\n", FileName);
+        return 2;
+    }
+
+    int ExitCode = 0;
+    pmc_store_cursor Cursor;
+    query_group *Groups = (query_group *)calloc(QUERY_GROUP_TABLE_SIZE, sizeof(query_group));
+    if(Groups && BeginStoreQuery(&Cursor, &Reader, &Query))
+    {
+        u64 MatchCount = 0;
+        u64 DroppedCount = 0;
+        pmc_store_row Row;
+        while(NextStoreRow(&Cursor, &Row))
+        {
+            ++MatchCount;
+            query_group *Group = FindGroup(Groups, GetGroupKey(&Row, GroupBy));
+            if(Group)
+            {
+                ++Group->RowCount;
+                Group->TSCElapsed += Row.TSCElapsed;
+                if(Group->MinTSCElapsed > Row.TSCElapsed) Group->MinTSCElapsed = Row.TSCElapsed;
+                if(Group->MaxTSCElapsed < Row.TSCElapsed) Group->MaxTSCElapsed = Row.TSCElapsed;
+                Group->ContextSwitchCount += Row.ContextSwitchCount;
+                for(u32 CI = 0; CI < Reader.Header.PMCCount; ++CI)
+                {
+                    Group->Counters[CI] += Row.Counters[CI];
+                }
+            }
+            else
+            {
+                ++DroppedCount;
+            }
+        }
+
+        if(Cursor.Error)
+        {
+            fprintf(stderr, "ERROR: Unable to read store %s\n", FileName);
+            ExitCode = 2;
+        }
+        else
+        {
+            printf("%llu of %llu regions matched (%llu of %llu blocks read, %llu skipped by the index)\n",
+                   MatchCount, Reader.Header.RowCount, Cursor.BlocksRead, Reader.Header.BlockCount, Cursor.BlocksSkipped);
+            if(DroppedCount)
+            {
+                printf("WARNING: %llu regions were not aggregated because there were too many groups\n", DroppedCount);
+            }
+
+            qsort(Groups, QUERY_GROUP_TABLE_SIZE, sizeof(query_group), CompareGroups);
+            for(u32 GroupIndex = 0; (GroupIndex < QUERY_GROUP_TABLE_SIZE) && Groups[GroupIndex].Used; ++GroupIndex)
+            {
+                query_group *Group = Groups + GroupIndex;
+                f64 Count = (f64)Group->RowCount;
+
+                if(GroupBy == GroupBy_None)
+                {
+                    printf("\nALL - %llu regions:\n", Group->RowCount);
+                }
+                else
+                {
+                    printf("\n%s %u - %llu regions:\n", GroupByNames[GroupBy], Group->Key, Group->RowCount);
+                }
+                printf("  %.0f TSC mean, %llu min, %llu max [%.2f switches]\n", (f64)Group->TSCElapsed / Count,
+                       Group->MinTSCElapsed, Group->MaxTSCElapsed, (f64)Group->ContextSwitchCount / Count);
+                for(u32 CI = 0; CI < Reader.Header.PMCCount; ++CI)
+                {
+                    printf("  %.1f %s\n", (f64)Group->Counters[CI] / Count, Reader.Header.Names[CI]);
+                }
+            }
+        }
+
+        EndStoreQuery(&Cursor);
+    }
+    else
+    {
+        fprintf(stderr, "ERROR: Unable to allocate query memory\n");
+        ExitCode = 2;
+    }
+
+    free(Groups);
+    CloseStoreForQuery(&Reader);
+
+    return ExitCode;
+}
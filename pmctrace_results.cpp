@@ -0,0 +1,149 @@
+/* ========================================================================
+
+   (C) Copyright 2024 by Molly Rocket, Inc., All Rights Reserved.
+
+   This software is provided 'as-is', without any express or implied
+   warranty. In no event will the authors be held liable for any damages
+   arising from the use of this software.
+
+   Please see https://computerenhance.com for more information
+
+   ======================================================================== */
+
+// NOTE: Results files can grow past 2GB, which plain fseek/ftell cannot address on Windows
+#if defined(_WIN32)
+#define ResultsSeek _fseeki64
+#define ResultsTell _ftelli64
+#else
+#define ResultsSeek fseeko
+#define ResultsTell ftello
+#endif
+
+static b32 OpenResultsFile(pmc_results_writer *Writer, char const *FileName, pmc_name_array *Names, u32 PMCCount)
+{
+    *Writer = {};
+
+    pmc_results_file_header *Header = &Writer->Header;
+    Header->Magic = PMC_RESULTS_FILE_MAGIC;
+    Header->Version = PMC_RESULTS_FILE_VERSION;
+    Header->PMCCount = PMCCount;
+    Header->SampleSize = sizeof(pmc_results_sample);
+
+    // NOTE: PMC names are plain ASCII, so narrowing them is lossless in practice
+    for(u32 PMCIndex = 0; (PMCIndex < PMCCount) && (PMCIndex < MAX_TRACE_PMC_COUNT); ++PMCIndex)
+    {
+        wchar_t const *Name = Names->Strings[PMCIndex];
+        for(u32 CharIndex = 0; Name && Name[CharIndex] && (CharIndex < (PMC_RESULTS_NAME_LENGTH - 1)); ++CharIndex)
+        {
+            Header->Names[PMCIndex][CharIndex] = (char)Name[CharIndex];
+        }
+    }
+
+    Writer->File = fopen(FileName, "wb");
+    Writer->Error = !Writer->File || (fwrite(Header, sizeof(*Header), 1, Writer->File) != 1);
+
+    b32 Result = !Writer->Error;
+    return Result;
+}
+
+static void WriteResult(pmc_results_writer *Writer, pmc_trace_result *Result)
+{
+    if(!Writer->Error)
+    {
+        pmc_results_sample Sample = {};
+        Sample.SiteID = Result->SiteID;
+        Sample.PMCCount = Result->PMCCount;
+        Sample.TSCElapsed = Result->TSCElapsed;
+        Sample.ContextSwitchCount = Result->ContextSwitchCount;
+        for(u32 PMCIndex = 0; (PMCIndex < Result->PMCCount) && (PMCIndex < MAX_TRACE_PMC_COUNT); ++PMCIndex)
+        {
+            Sample.Counters[PMCIndex] = Result->Counters[PMCIndex];
+        }
+
+        if(fwrite(&Sample, sizeof(Sample), 1, Writer->File) == 1)
+        {
+            ++Writer->Header.SampleCount;
+        }
+        else
+        {
+            Writer->Error = true;
+        }
+    }
+}
+
+static b32 CloseResultsFile(pmc_results_writer *Writer)
+{
+    if(Writer->File)
+    {
+        // NOTE: The sample count isn't known until the end, so the header is rewritten in place
+        if((fseek(Writer->File, 0, SEEK_SET) != 0) ||
+           (fwrite(&Writer->Header, sizeof(Writer->Header), 1, Writer->File) != 1))
+        {
+            Writer->Error = true;
+        }
+
+        if(fclose(Writer->File) != 0)
+        {
+            Writer->Error = true;
+        }
+
+        Writer->File = 0;
+    }
+
+    b32 Result = !Writer->Error;
+    return Result;
+}
+
+static b32 LoadResultsFile(pmc_results_file *Dest, char const *FileName)
+{
+    *Dest = {};
+    b32 Result = false;
+
+    FILE *File = fopen(FileName, "rb");
+    if(File)
+    {
+        pmc_results_file_header *Header = &Dest->Header;
+        if((fread(Header, sizeof(*Header), 1, File) == 1) &&
+           (Header->Magic == PMC_RESULTS_FILE_MAGIC) &&
+           (Header->Version == PMC_RESULTS_FILE_VERSION) &&
+           (Header->SampleSize == sizeof(pmc_results_sample)) &&
+           (Header->PMCCount <= MAX_TRACE_PMC_COUNT))
+        {
+            // NOTE: The sample count is checked against what the file actually holds before it sizes anything
+            u64 SampleBytes = 0;
+            if(ResultsSeek(File, 0, SEEK_END) == 0)
+            {
+                u64 FileSize = (u64)ResultsTell(File);
+                if((FileSize != (u64)-1ll) && (FileSize >= sizeof(*Header)))
+                {
+                    SampleBytes = FileSize - sizeof(*Header);
+                }
+            }
+
+            if((Header->SampleCount <= (SampleBytes / sizeof(pmc_results_sample))) &&
+               (ResultsSeek(File, sizeof(*Header), SEEK_SET) == 0))
+            {
+                Dest->Samples = (pmc_results_sample *)malloc(Header->SampleCount*sizeof(pmc_results_sample) + 1);
+                if(Dest->Samples)
+                {
+                    Result = (fread(Dest->Samples, sizeof(pmc_results_sample), Header->SampleCount, File) == Header->SampleCount);
+                }
+            }
+        }
+
+        fclose(File);
+    }
+
+    if(!Result)
+    {
+        FreeResultsFile(Dest);
+    }
+
+    return Result;
+}
+
+static void FreeResultsFile(pmc_results_file *File)
+{
+    free(File->Samples);
+    *File = {};
+}
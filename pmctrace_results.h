@@ -0,0 +1,64 @@
+/* ========================================================================
+
+   (C) Copyright 2024 by Molly Rocket, Inc., All Rights Reserved.
+
+   This software is provided 'as-is', without any express or implied
+   warranty. In no event will the authors be held liable for any damages
+   arising from the use of this software.
+
+   Please see https://computerenhance.com for more information
+
+   ======================================================================== */
+
+//
+// NOTE: Saved results files
+//
+
+// NOTE: A results file holds every sample of a run, tagged with its SiteID, so that two runs can be compared
+// site-by-site with pmctrace_compare. It only depends on pmctrace.h, so tools that read results files do not
+// need ETW. Counter names are stored with the samples so runs with different PMC selections can still be aligned.
+
+#define PMC_RESULTS_FILE_MAGIC 0x52434d50 // NOTE: "PMCR"
+#define PMC_RESULTS_FILE_VERSION 1
+#define PMC_RESULTS_NAME_LENGTH 64
+
+struct pmc_results_file_header
+{
+    u32 Magic;
+    u32 Version;
+    u32 PMCCount;
+    u32 SampleSize;
+    u64 SampleCount;
+    char Names[MAX_TRACE_PMC_COUNT][PMC_RESULTS_NAME_LENGTH];
+};
+
+struct pmc_results_sample
+{
+    u32 SiteID;
+    u32 PMCCount;
+    u64 TSCElapsed;
+    u64 ContextSwitchCount;
+    u64 Counters[MAX_TRACE_PMC_COUNT];
+};
+
+struct pmc_results_writer
+{
+    FILE *File;
+    pmc_results_file_header Header;
+    b32 Error;
+};
+
+struct pmc_results_file
+{
+    pmc_results_file_header Header;
+    pmc_results_sample *Samples; // NOTE: [Header.SampleCount]
+};
+
+static b32 OpenResultsFile(pmc_results_writer *Writer, char const *FileName, pmc_name_array *Names, u32 PMCCount);
+static void WriteResult(pmc_results_writer *Writer, pmc_trace_result *Result);
+static b32 CloseResultsFile(pmc_results_writer *Writer);
+
+// NOTE: LoadResultsFile returns false if the file is missing, truncated, or from an incompatible version.
+// The samples must be released with FreeResultsFile.
+static b32 LoadResultsFile(pmc_results_file *Dest, char const *FileName);
+static void FreeResultsFile(pmc_results_file *File);
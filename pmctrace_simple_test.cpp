@@ -15,6 +15,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <intrin.h>
 #include <windows.h>
 #include <psapi.h>
@@ -37,8 +38,234 @@ typedef double f64;
 #include "pmctrace.h"
 #include "pmctrace.cpp"
 
-int main(void)
+// NOTE: Enough work that the cost of the suspend and resume markers themselves is small next to it
+#define KNOWN_WORK_COUNT (16*1024*1024)
+
+static u64 DoKnownWork(u64 Count)
+{
+    u64 volatile Sum = 0;
+    for(u64 Index = 0; Index < Count; ++Index)
+    {
+        Sum += Index;
+    }
+    return Sum;
+}
+
+static b32 CheckSuspendExcludesWork(pmc_tracer *Tracer, pmc_name_array *Names)
+{
+    // NOTE: Both regions count the known work once, but the second one also runs it a second time while suspended.
+    // If suspending works, the second region matches the first instead of counting twice as much.
+    pmc_traced_region Once, Suspended;
+
+    StartCountingPMCs(Tracer, &Once);
+    DoKnownWork(KNOWN_WORK_COUNT);
+    StopCountingPMCs(Tracer, &Once);
+
+    StartCountingPMCs(Tracer, &Suspended);
+    DoKnownWork(KNOWN_WORK_COUNT);
+    SuspendCountingPMCs(Tracer, &Suspended);
+    DoKnownWork(KNOWN_WORK_COUNT);
+    ResumeCountingPMCs(Tracer, &Suspended);
+    StopCountingPMCs(Tracer, &Suspended);
+
+    pmc_trace_result OnceResult = GetOrWaitForResult(Tracer, &Once);
+    pmc_trace_result SuspendedResult = GetOrWaitForResult(Tracer, &Suspended);
+
+    b32 Result = NoErrors(Tracer);
+    if(Result)
+    {
+        printf("\nSUSPEND - work counted once / work counted once with a suspended repeat:\n");
+        printf("  %llu / %llu TSC elapsed\n", OnceResult.TSCElapsed, SuspendedResult.TSCElapsed);
+        for(u32 CI = 0; CI < OnceResult.PMCCount; ++CI)
+        {
+            printf("  %llu / %llu %S\n", OnceResult.Counters[CI], SuspendedResult.Counters[CI], Names->Strings[CI]);
+        }
+
+        // NOTE: The first counter is TotalIssues in both name arrays, which scales directly with the work
+        Result = ((2*SuspendedResult.Counters[0]) < (3*OnceResult.Counters[0]));
+        printf("  %s: the suspended repeat was %s\n", Result ? "PASS" : "FAIL", Result ? "excluded" : "counted");
+    }
+
+    return Result;
+}
+
+struct hop_thread_context
+{
+    pmc_tracer *Tracer;
+    pmc_traced_region *Region;
+};
+
+static DWORD CALLBACK ResumeOnOtherThread(void *Arg)
+{
+    hop_thread_context *Context = (hop_thread_context *)Arg;
+
+    ResumeCountingPMCs(Context->Tracer, Context->Region);
+    DoKnownWork(KNOWN_WORK_COUNT);
+    StopCountingPMCs(Context->Tracer, Context->Region);
+
+    return 0;
+}
+
+static b32 CheckSuspendAcrossThreads(pmc_tracer *Tracer, pmc_name_array *Names)
 {
+    // NOTE: Both regions count the known work twice. The second one does the first half on this thread, suspends,
+    // runs the work again while suspended, and has a worker thread resume it for the second half. If the hop works,
+    // it matches the first region, hopped exactly once, and did not count the suspended repeat.
+    pmc_traced_region Twice, Hopped;
+
+    StartCountingPMCs(Tracer, &Twice);
+    DoKnownWork(KNOWN_WORK_COUNT);
+    DoKnownWork(KNOWN_WORK_COUNT);
+    StopCountingPMCs(Tracer, &Twice);
+
+    StartCountingPMCs(Tracer, &Hopped);
+    DoKnownWork(KNOWN_WORK_COUNT);
+    SuspendCountingPMCs(Tracer, &Hopped);
+    DoKnownWork(KNOWN_WORK_COUNT);
+
+    hop_thread_context Context = {Tracer, &Hopped};
+    HANDLE Worker = CreateThread(0, 0, ResumeOnOtherThread, &Context, 0, 0);
+    if(Worker)
+    {
+        WaitForSingleObject(Worker, INFINITE);
+        CloseHandle(Worker);
+    }
+    else
+    {
+        // NOTE: Stop it here so there is still a result to wait for, which then fails the hop check
+        ResumeCountingPMCs(Tracer, &Hopped);
+        StopCountingPMCs(Tracer, &Hopped);
+    }
+
+    pmc_trace_result TwiceResult = GetOrWaitForResult(Tracer, &Twice);
+    pmc_trace_result HoppedResult = GetOrWaitForResult(Tracer, &Hopped);
+
+    b32 Result = NoErrors(Tracer);
+    if(Result)
+    {
+        printf("\nTHREAD HOP - work counted twice / work counted twice across a hop with a suspended repeat:\n");
+        printf("  %llu / %llu TSC elapsed [%llu thread hop%s]\n", TwiceResult.TSCElapsed, HoppedResult.TSCElapsed,
+               HoppedResult.ThreadHopCount, (HoppedResult.ThreadHopCount != 1) ? "s" : "");
+        for(u32 CI = 0; CI < TwiceResult.PMCCount; ++CI)
+        {
+            printf("  %llu / %llu %S\n", TwiceResult.Counters[CI], HoppedResult.Counters[CI], Names->Strings[CI]);
+        }
+
+        // NOTE: Counting the suspended repeat would make the hopped region half again as large as the first one
+        b32 DidHop = (HoppedResult.ThreadHopCount == 1);
+        b32 Excluded = ((4*HoppedResult.Counters[0]) < (5*TwiceResult.Counters[0]));
+        Result = (DidHop && Excluded);
+        printf("  %s: the region %s threads and the suspended repeat was %s\n", Result ? "PASS" : "FAIL",
+               DidHop ? "hopped" : "did not hop", Excluded ? "excluded" : "counted");
+    }
+
+    return Result;
+}
+
+static b32 CheckPhasedTimeline(pmc_tracer *Tracer, pmc_name_array *Names)
+{
+    // NOTE: Three phases of the same work, with a timeline over all of them. The timeline ends a point at each
+    // lap and at every boundary in between, and its points have to add up to exactly the sum of the phases.
+    static pmc_phased_region Phased;
+    static pmc_timeline Timeline;
+
+    StartPhasedPMCs(Tracer, &Phased, 0, &Timeline);
+    DoKnownWork(KNOWN_WORK_COUNT);
+    LapPMCs(Tracer, &Phased);
+    DoKnownWork(KNOWN_WORK_COUNT);
+    LapPMCs(Tracer, &Phased);
+    DoKnownWork(KNOWN_WORK_COUNT);
+    StopPhasedPMCs(Tracer, &Phased);
+
+    pmc_phased_result PhasedResult = GetOrWaitForPhasedResult(Tracer, &Phased);
+
+    b32 Result = NoErrors(Tracer);
+    if(Result)
+    {
+        pmc_timeline_point PhaseSum = {};
+        for(u32 PhaseIndex = 0; PhaseIndex < PhasedResult.PhaseCount; ++PhaseIndex)
+        {
+            pmc_trace_result *Phase = &PhasedResult.Phases[PhaseIndex];
+            PhaseSum.TSCElapsed += Phase->TSCElapsed;
+            for(u32 CI = 0; CI < Phase->PMCCount; ++CI)
+            {
+                PhaseSum.Counters[CI] += Phase->Counters[CI];
+            }
+        }
+
+        pmc_timeline_point PointSum = {};
+        for(u32 PointIndex = 0; PointIndex < Timeline.PointCount; ++PointIndex)
+        {
+            pmc_timeline_point *Point = &Timeline.Points[PointIndex];
+            PointSum.TSCElapsed += Point->TSCElapsed;
+            for(u32 CI = 0; CI < MAX_TRACE_PMC_COUNT; ++CI)
+            {
+                PointSum.Counters[CI] += Point->Counters[CI];
+            }
+        }
+
+        printf("\nPHASED TIMELINE - %u phases / %u timeline points (stride %u):\n", PhasedResult.PhaseCount,
+               Timeline.PointCount, Timeline.Stride);
+        printf("  %llu / %llu TSC elapsed\n", PhaseSum.TSCElapsed, PointSum.TSCElapsed);
+        Result = ((PhasedResult.PhaseCount == 3) && (PhaseSum.TSCElapsed == PointSum.TSCElapsed));
+        for(u32 CI = 0; CI < PhasedResult.Phases[0].PMCCount; ++CI)
+        {
+            printf("  %llu / %llu %S\n", PhaseSum.Counters[CI], PointSum.Counters[CI], Names->Strings[CI]);
+            Result = Result && (PhaseSum.Counters[CI] == PointSum.Counters[CI]);
+        }
+        printf("  %s: the timeline %s the phases\n", Result ? "PASS" : "FAIL", Result ? "matches" : "does not match");
+    }
+
+    return Result;
+}
+
+static void RunClient(void)
+{
+    // NOTE: The same two regions as below, measured through a running pmctrace_daemon instead of a session
+    // of our own. The regions have to live in the section shared with the daemon.
+    pmc_tracer Tracer;
+
+    printf("Connecting to daemon...\n");
+    ConnectToPMCDaemon(&Tracer, 64*1024);
+
+    pmc_traced_region *Region = (pmc_traced_region *)AllocateSharedPMCMemory(&Tracer, 2*sizeof(pmc_traced_region));
+    if(NoErrors(&Tracer) && Region)
+    {
+        StartCountingPMCs(&Tracer, &Region[0]);
+        printf("... This printf is measured only by Region[0].\n");
+        StartCountingPMCs(&Tracer, &Region[1]);
+        printf("... This printf is measured by both.\n");
+        StopCountingPMCs(&Tracer, &Region[0]);
+        StopCountingPMCs(&Tracer, &Region[1]);
+
+        for(u32 ResultIndex = 0; NoErrors(&Tracer) && (ResultIndex < 2); ++ResultIndex)
+        {
+            pmc_trace_result Result = GetOrWaitForResult(&Tracer, &Region[ResultIndex]);
+            printf("\n%llu TSC elapsed [%llu context switch%s]\n", Result.TSCElapsed, Result.ContextSwitchCount,
+                   (Result.ContextSwitchCount != 1) ? "es" : "");
+            for(u32 CI = 0; CI < Result.PMCCount; ++CI)
+            {
+                printf("  %llu (daemon PMC %u)\n", Result.Counters[CI], CI);
+            }
+        }
+    }
+
+    if(!NoErrors(&Tracer))
+    {
+        printf("ERROR: %s\n", GetErrorMessage(&Tracer));
+    }
+
+    StopTracing(&Tracer);
+}
+
+int main(int ArgCount, char **Args)
+{
+    if((ArgCount > 1) && (strcmp(Args[1], "-daemon") == 0))
+    {
+        RunClient();
+        return 0;
+    }
+
     pmc_name_array AMDNameArray =
     {
         L"TotalIssues",
@@ -69,6 +296,8 @@ int main(void)
     // NOTE(casey): Collect PMCs
     //
 
+    int ExitCode = 0;
+
     if(IsValid(&PMCMapping))
     {
         pmc_tracer Tracer;
@@ -76,6 +305,10 @@ int main(void)
         printf("Starting trace...\n");
         StartTracing(&Tracer, &PMCMapping);
 
+        char const *CoreCycleSourceNames[CoreCycles_Count] = {"unavailable", "PMC", "APERF/MPERF"};
+        pmc_core_cycle_source CoreCycleSource = EnableCoreCycles(&Tracer);
+        printf("Core cycles: %s\n", CoreCycleSourceNames[CoreCycleSource]);
+
         pmc_traced_region Region[2];
 
         StartCountingPMCs(&Tracer, &Region[0]);
@@ -91,12 +324,25 @@ int main(void)
             pmc_trace_result Result = GetOrWaitForResult(&Tracer, &Region[ResultIndex]);
             if(NoErrors(&Tracer))
             {
-                printf("\n%llu TSC elapsed [%llu context switch%s]\n",
+                printf("\n%llu TSC elapsed [%llu context switch%s, %llu in %llu syscall%s]\n",
                        Result.TSCElapsed, Result.ContextSwitchCount,
-                       (Result.ContextSwitchCount != 1) ? "es" : "");
+                       (Result.ContextSwitchCount != 1) ? "es" : "",
+                       Result.KernelTSCElapsed, Result.SysCallCount,
+                       (Result.SysCallCount != 1) ? "s" : "");
+                if(Result.CoreCycleSource)
+                {
+                    pmc_tracer_stats Stats = GetTracerStats(&Tracer);
+                    printf("  %llu core cycles (%.2f GHz effective)\n", Result.CoreCycles,
+                           GetEffectiveGHz(&Result, Stats.EstimatedTSCFrequency));
+                }
                 for(u32 CI = 0; CI < Result.PMCCount; ++CI)
                 {
-                    printf("  %llu %S\n", Result.Counters[CI], UsedNames->Strings[CI]);
+                    printf("  %llu %S (%llu kernel", Result.Counters[CI], UsedNames->Strings[CI], Result.KernelCounters[CI]);
+                    if(Result.CoreCycleSource)
+                    {
+                        printf(", %.3f per core cycle", GetPerCoreCycle(&Result, CI));
+                    }
+                    printf(")\n");
                 }
             }
             else
@@ -107,6 +353,21 @@ int main(void)
             }
         }
 
+        if(NoErrors(&Tracer) && !CheckSuspendExcludesWork(&Tracer, UsedNames))
+        {
+            ExitCode = 1;
+        }
+
+        if(NoErrors(&Tracer) && !CheckSuspendAcrossThreads(&Tracer, UsedNames))
+        {
+            ExitCode = 1;
+        }
+
+        if(NoErrors(&Tracer) && !CheckPhasedTimeline(&Tracer, UsedNames))
+        {
+            ExitCode = 1;
+        }
+
         printf("Stopping trace...\n");
         StopTracing(&Tracer);
     }
@@ -115,5 +376,5 @@ int main(void)
         printf("ERROR: Unable to find suitable ETW PMCs\n");
     }
 
-    return 0;
+    return ExitCode;
 }
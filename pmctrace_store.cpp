@@ -0,0 +1,507 @@
+/* ========================================================================
+
+   (C) Copyright 2024 by Molly Rocket, Inc., All Rights Reserved.
+
+   This software is provided 'as-is', without any express or implied
+   warranty. In no event will the authors be held liable for any damages
+   arising from the use of this software.
+
+   Please see https://computerenhance.com for more information
+
+   ======================================================================== */
+
+// NOTE: Stores can grow past 2GB, which plain fseek cannot address on Windows
+#if defined(_WIN32)
+#define StoreSeek _fseeki64
+#define StoreTell _ftelli64
+#else
+#define StoreSeek fseeko
+#define StoreTell ftello
+#endif
+
+// NOTE: Worst case for one block: the column size table plus a 10-byte varint for every value
+#define PMC_STORE_MAX_BLOCK_SIZE (StoreColumn_Count*sizeof(u32) + StoreColumn_Count*PMC_STORE_BLOCK_ROW_COUNT*10)
+
+static u32 GetStoreColumnCount(u32 PMCCount)
+{
+    u32 Result = StoreColumn_FirstCounter + PMCCount;
+    return Result;
+}
+
+static u64 GetStoreColumnValue(pmc_store_row *Row, u32 Column)
+{
+    u64 Result = 0;
+    switch(Column)
+    {
+        case StoreColumn_SiteID: {Result = Row->SiteID;} break;
+        case StoreColumn_ThreadID: {Result = Row->ThreadID;} break;
+        case StoreColumn_CPUIndex: {Result = Row->CPUIndex;} break;
+        case StoreColumn_StartTSC: {Result = Row->StartTSC;} break;
+        case StoreColumn_TSCElapsed: {Result = Row->TSCElapsed;} break;
+        case StoreColumn_ContextSwitchCount: {Result = Row->ContextSwitchCount;} break;
+        default: {Result = Row->Counters[Column - StoreColumn_FirstCounter];} break;
+    }
+    return Result;
+}
+
+static void SetStoreColumnValue(pmc_store_row *Row, u32 Column, u64 Value)
+{
+    switch(Column)
+    {
+        case StoreColumn_SiteID: {Row->SiteID = (u32)Value;} break;
+        case StoreColumn_ThreadID: {Row->ThreadID = (u32)Value;} break;
+        case StoreColumn_CPUIndex: {Row->CPUIndex = (u32)Value;} break;
+        case StoreColumn_StartTSC: {Row->StartTSC = Value;} break;
+        case StoreColumn_TSCElapsed: {Row->TSCElapsed = Value;} break;
+        case StoreColumn_ContextSwitchCount: {Row->ContextSwitchCount = Value;} break;
+        default: {Row->Counters[Column - StoreColumn_FirstCounter] = Value;} break;
+    }
+}
+
+static u8 *WriteVarint(u8 *At, u64 Value)
+{
+    while(Value >= 0x80)
+    {
+        *At++ = (u8)(Value | 0x80);
+        Value >>= 7;
+    }
+    *At++ = (u8)Value;
+    return At;
+}
+
+static b32 ReadVarint(u8 **At, u8 *End, u64 *Value)
+{
+    u64 Result = 0;
+    for(u32 Shift = 0; (*At < End) && (Shift < 64); Shift += 7)
+    {
+        u8 Byte = *(*At)++;
+        Result |= (u64)(Byte & 0x7f) << Shift;
+        if(!(Byte & 0x80))
+        {
+            *Value = Result;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// NOTE: Results are not strictly ordered by start time, so start TSC deltas are zigzag-encoded to keep small
+// negative deltas small
+static u64 ZigZagEncode(u64 Delta)
+{
+    u64 Result = (Delta << 1) ^ (0 - (Delta >> 63));
+    return Result;
+}
+
+static u64 ZigZagDecode(u64 Value)
+{
+    u64 Result = (Value >> 1) ^ (0 - (Value & 1));
+    return Result;
+}
+
+static b32 OpenStoreFile(pmc_store_writer *Writer, char const *FileName, pmc_name_array *Names, u32 PMCCount)
+{
+    *Writer = {};
+
+    pmc_store_file_header *Header = &Writer->Header;
+    Header->Magic = PMC_STORE_FILE_MAGIC;
+    Header->Version = PMC_STORE_FILE_VERSION;
+    Header->PMCCount = (PMCCount < MAX_TRACE_PMC_COUNT) ? PMCCount : MAX_TRACE_PMC_COUNT;
+    Header->BlockRowCount = PMC_STORE_BLOCK_ROW_COUNT;
+
+    // NOTE: PMC names are plain ASCII, so narrowing them is lossless in practice
+    for(u32 PMCIndex = 0; PMCIndex < Header->PMCCount; ++PMCIndex)
+    {
+        wchar_t const *Name = Names->Strings[PMCIndex];
+        for(u32 CharIndex = 0; Name && Name[CharIndex] && (CharIndex < (PMC_STORE_NAME_LENGTH - 1)); ++CharIndex)
+        {
+            Header->Names[PMCIndex][CharIndex] = (char)Name[CharIndex];
+        }
+    }
+
+    Writer->Rows = (pmc_store_row *)malloc(PMC_STORE_BLOCK_ROW_COUNT*sizeof(pmc_store_row));
+    Writer->Scratch = (u8 *)malloc(PMC_STORE_MAX_BLOCK_SIZE);
+    Writer->File = fopen(FileName, "wb");
+    Writer->Error = (!Writer->Rows || !Writer->Scratch || !Writer->File ||
+                     (fwrite(Header, sizeof(*Header), 1, Writer->File) != 1));
+    Writer->WriteOffset = sizeof(*Header);
+
+    b32 Result = !Writer->Error;
+    return Result;
+}
+
+static void FlushStoreBlock(pmc_store_writer *Writer)
+{
+    if(!Writer->Error && Writer->RowCount)
+    {
+        pmc_store_block_index Block = {};
+        Block.Offset = Writer->WriteOffset;
+        Block.RowCount = Writer->RowCount;
+        Block.MinSiteID = Block.MinThreadID = 0xffffffff;
+        Block.MinStartTSC = (u64)-1ll;
+
+        for(u32 RowIndex = 0; RowIndex < Writer->RowCount; ++RowIndex)
+        {
+            pmc_store_row *Row = Writer->Rows + RowIndex;
+            if(Block.MinSiteID > Row->SiteID) Block.MinSiteID = Row->SiteID;
+            if(Block.MaxSiteID < Row->SiteID) Block.MaxSiteID = Row->SiteID;
+            if(Block.MinThreadID > Row->ThreadID) Block.MinThreadID = Row->ThreadID;
+            if(Block.MaxThreadID < Row->ThreadID) Block.MaxThreadID = Row->ThreadID;
+            if(Block.MinStartTSC > Row->StartTSC) Block.MinStartTSC = Row->StartTSC;
+            if(Block.MaxStartTSC < Row->StartTSC) Block.MaxStartTSC = Row->StartTSC;
+        }
+
+        // NOTE: The block begins with the byte size of each column, so a reader can decode only the columns it needs
+        u32 ColumnCount = GetStoreColumnCount(Writer->Header.PMCCount);
+        u32 *ColumnSizes = (u32 *)Writer->Scratch;
+        u8 *At = Writer->Scratch + ColumnCount*sizeof(u32);
+        for(u32 Column = 0; Column < ColumnCount; ++Column)
+        {
+            u8 *ColumnStart = At;
+            u64 Previous = 0;
+            for(u32 RowIndex = 0; RowIndex < Writer->RowCount; ++RowIndex)
+            {
+                u64 Value = GetStoreColumnValue(Writer->Rows + RowIndex, Column);
+                if(Column == StoreColumn_StartTSC)
+                {
+                    At = WriteVarint(At, ZigZagEncode(Value - Previous));
+                    Previous = Value;
+                }
+                else
+                {
+                    At = WriteVarint(At, Value);
+                }
+            }
+            ColumnSizes[Column] = (u32)(At - ColumnStart);
+        }
+
+        Block.Size = (u32)(At - Writer->Scratch);
+        if(fwrite(Writer->Scratch, Block.Size, 1, Writer->File) == 1)
+        {
+            if(Writer->Header.BlockCount == Writer->BlockCapacity)
+            {
+                u64 NewCapacity = Writer->BlockCapacity ? 2*Writer->BlockCapacity : 256;
+                pmc_store_block_index *NewBlocks =
+                    (pmc_store_block_index *)realloc(Writer->Blocks, NewCapacity*sizeof(pmc_store_block_index));
+                if(NewBlocks)
+                {
+                    Writer->Blocks = NewBlocks;
+                    Writer->BlockCapacity = NewCapacity;
+                }
+            }
+
+            if(Writer->Header.BlockCount < Writer->BlockCapacity)
+            {
+                Writer->Blocks[Writer->Header.BlockCount++] = Block;
+                Writer->Header.RowCount += Block.RowCount;
+                Writer->WriteOffset += Block.Size;
+            }
+            else
+            {
+                Writer->Error = true;
+            }
+        }
+        else
+        {
+            Writer->Error = true;
+        }
+    }
+
+    Writer->RowCount = 0;
+}
+
+static void StoreResult(pmc_store_writer *Writer, pmc_trace_result *Result)
+{
+    if(!Writer->Error)
+    {
+        pmc_store_row *Row = Writer->Rows + Writer->RowCount++;
+        *Row = {};
+        Row->SiteID = Result->SiteID;
+        Row->ThreadID = Result->ThreadID;
+        Row->CPUIndex = Result->CPUIndex;
+        Row->StartTSC = Result->StartTSC;
+        Row->TSCElapsed = Result->TSCElapsed;
+        Row->ContextSwitchCount = Result->ContextSwitchCount;
+        for(u32 PMCIndex = 0; (PMCIndex < Result->PMCCount) && (PMCIndex < Writer->Header.PMCCount); ++PMCIndex)
+        {
+            Row->Counters[PMCIndex] = Result->Counters[PMCIndex];
+        }
+
+        if(Writer->RowCount == PMC_STORE_BLOCK_ROW_COUNT)
+        {
+            FlushStoreBlock(Writer);
+        }
+    }
+}
+
+static b32 CloseStoreFile(pmc_store_writer *Writer)
+{
+    if(Writer->File)
+    {
+        FlushStoreBlock(Writer);
+
+        // NOTE: The index goes after the last block, and the header is rewritten in place to point at it
+        Writer->Header.IndexOffset = Writer->WriteOffset;
+        if(!Writer->Error &&
+           ((Writer->Header.BlockCount &&
+             (fwrite(Writer->Blocks, sizeof(pmc_store_block_index), Writer->Header.BlockCount, Writer->File) != Writer->Header.BlockCount)) ||
+            (StoreSeek(Writer->File, 0, SEEK_SET) != 0) ||
+            (fwrite(&Writer->Header, sizeof(Writer->Header), 1, Writer->File) != 1)))
+        {
+            Writer->Error = true;
+        }
+
+        if(fclose(Writer->File) != 0)
+        {
+            Writer->Error = true;
+        }
+        Writer->File = 0;
+    }
+
+    free(Writer->Blocks);
+    free(Writer->Scratch);
+    free(Writer->Rows);
+    Writer->Blocks = 0;
+    Writer->Scratch = 0;
+    Writer->Rows = 0;
+
+    b32 Result = !Writer->Error;
+    return Result;
+}
+
+static b32 OpenStoreForQuery(pmc_store_reader *Reader, char const *FileName)
+{
+    *Reader = {};
+    b32 Result = false;
+
+    Reader->File = fopen(FileName, "rb");
+    if(Reader->File)
+    {
+        pmc_store_file_header *Header = &Reader->Header;
+        if((fread(Header, sizeof(*Header), 1, Reader->File) == 1) &&
+           (Header->Magic == PMC_STORE_FILE_MAGIC) &&
+           (Header->Version == PMC_STORE_FILE_VERSION) &&
+           (Header->PMCCount <= MAX_TRACE_PMC_COUNT) &&
+           (Header->BlockRowCount == PMC_STORE_BLOCK_ROW_COUNT) &&
+           (Header->IndexOffset >= sizeof(*Header)))
+        {
+            // NOTE: The block count is checked against what the file actually holds after the index before it
+            // sizes anything
+            u64 IndexBytes = 0;
+            if(StoreSeek(Reader->File, 0, SEEK_END) == 0)
+            {
+                u64 FileSize = (u64)StoreTell(Reader->File);
+                if((FileSize != (u64)-1ll) && (FileSize >= Header->IndexOffset))
+                {
+                    IndexBytes = FileSize - Header->IndexOffset;
+                }
+            }
+
+            if((Header->BlockCount <= (IndexBytes / sizeof(pmc_store_block_index))) &&
+               (StoreSeek(Reader->File, Header->IndexOffset, SEEK_SET) == 0))
+            {
+                Reader->Blocks = (pmc_store_block_index *)malloc(Header->BlockCount*sizeof(pmc_store_block_index) + 1);
+                if(Reader->Blocks)
+                {
+                    Result = (fread(Reader->Blocks, sizeof(pmc_store_block_index), Header->BlockCount, Reader->File) == Header->BlockCount);
+                }
+            }
+        }
+    }
+
+    if(!Result)
+    {
+        CloseStoreForQuery(Reader);
+    }
+
+    return Result;
+}
+
+static void CloseStoreForQuery(pmc_store_reader *Reader)
+{
+    if(Reader->File)
+    {
+        fclose(Reader->File);
+    }
+    free(Reader->Blocks);
+    *Reader = {};
+}
+
+static pmc_store_query DefaultStoreQuery(void)
+{
+    pmc_store_query Result = {};
+    Result.MaxSiteID = 0xffffffff;
+    Result.MaxThreadID = 0xffffffff;
+    Result.MaxStartTSC = (u64)-1ll;
+    return Result;
+}
+
+static b32 BlockMayMatch(pmc_store_block_index *Block, pmc_store_query *Query)
+{
+    b32 Result = ((Block->MaxSiteID >= Query->MinSiteID) && (Block->MinSiteID <= Query->MaxSiteID) &&
+                  (Block->MaxThreadID >= Query->MinThreadID) && (Block->MinThreadID <= Query->MaxThreadID) &&
+                  (Block->MaxStartTSC >= Query->MinStartTSC) && (Block->MinStartTSC <= Query->MaxStartTSC));
+    return Result;
+}
+
+static b32 RowMatches(pmc_store_row *Row, pmc_store_query *Query)
+{
+    b32 Result = ((Row->SiteID >= Query->MinSiteID) && (Row->SiteID <= Query->MaxSiteID) &&
+                  (Row->ThreadID >= Query->MinThreadID) && (Row->ThreadID <= Query->MaxThreadID) &&
+                  (Row->StartTSC >= Query->MinStartTSC) && (Row->StartTSC <= Query->MaxStartTSC));
+    return Result;
+}
+
+static b32 DecodeStoreColumn(pmc_store_cursor *Cursor, u8 *ColumnStart, u32 ColumnSize, u32 Column)
+{
+    u8 *At = ColumnStart;
+    u8 *End = ColumnStart + ColumnSize;
+    u64 Previous = 0;
+    b32 Result = true;
+    for(u32 RowIndex = 0; Result && (RowIndex < Cursor->RowCount); ++RowIndex)
+    {
+        u64 Value = 0;
+        Result = ReadVarint(&At, End, &Value);
+        if(Column == StoreColumn_StartTSC)
+        {
+            Value = Previous + ZigZagDecode(Value);
+            Previous = Value;
+        }
+        SetStoreColumnValue(Cursor->Rows + RowIndex, Column, Value);
+    }
+
+    return Result;
+}
+
+static b32 LoadNextStoreBlock(pmc_store_cursor *Cursor)
+{
+    pmc_store_reader *Reader = Cursor->Reader;
+    u32 ColumnCount = GetStoreColumnCount(Reader->Header.PMCCount);
+
+    b32 Loaded = false;
+    while(!Loaded && !Cursor->Error && (Cursor->NextBlockIndex < Reader->Header.BlockCount))
+    {
+        pmc_store_block_index *Block = Reader->Blocks + Cursor->NextBlockIndex++;
+        if(!BlockMayMatch(Block, &Cursor->Query))
+        {
+            ++Cursor->BlocksSkipped;
+            continue;
+        }
+
+        // NOTE: A block has to lie between the header and the index
+        u64 IndexOffset = Reader->Header.IndexOffset;
+        if((Block->Size > Cursor->BlockCapacity) || (Block->RowCount > PMC_STORE_BLOCK_ROW_COUNT) ||
+           (Block->Size < ColumnCount*sizeof(u32)) ||
+           (Block->Offset < sizeof(pmc_store_file_header)) || (Block->Offset > IndexOffset) ||
+           (Block->Size > (IndexOffset - Block->Offset)) ||
+           (StoreSeek(Reader->File, Block->Offset, SEEK_SET) != 0) ||
+           (fread(Cursor->BlockData, Block->Size, 1, Reader->File) != 1))
+        {
+            Cursor->Error = true;
+            break;
+        }
+        ++Cursor->BlocksRead;
+
+        u32 *ColumnSizes = (u32 *)Cursor->BlockData;
+        u8 *ColumnStarts[StoreColumn_Count];
+        u8 *At = Cursor->BlockData + ColumnCount*sizeof(u32);
+        u8 *End = Cursor->BlockData + Block->Size;
+        for(u32 Column = 0; Column < ColumnCount; ++Column)
+        {
+            ColumnStarts[Column] = At;
+            if(ColumnSizes[Column] > (u64)(End - At))
+            {
+                Cursor->Error = true;
+                break;
+            }
+            At += ColumnSizes[Column];
+        }
+
+        Cursor->RowCount = Block->RowCount;
+        Cursor->RowIndex = 0;
+
+        // NOTE: Only the filtered columns are decoded first, and the rest only if some row in the block matches
+        u32 const FilterColumns[] = {StoreColumn_SiteID, StoreColumn_ThreadID, StoreColumn_StartTSC};
+        for(u32 FilterIndex = 0; !Cursor->Error && (FilterIndex < ArrayCount(FilterColumns)); ++FilterIndex)
+        {
+            u32 Column = FilterColumns[FilterIndex];
+            Cursor->Error = !DecodeStoreColumn(Cursor, ColumnStarts[Column], ColumnSizes[Column], Column);
+        }
+
+        b32 AnyMatch = false;
+        for(u32 RowIndex = 0; !Cursor->Error && !AnyMatch && (RowIndex < Cursor->RowCount); ++RowIndex)
+        {
+            AnyMatch = RowMatches(Cursor->Rows + RowIndex, &Cursor->Query);
+        }
+
+        if(AnyMatch)
+        {
+            for(u32 Column = 0; !Cursor->Error && (Column < ColumnCount); ++Column)
+            {
+                if((Column != StoreColumn_SiteID) && (Column != StoreColumn_ThreadID) && (Column != StoreColumn_StartTSC))
+                {
+                    Cursor->Error = !DecodeStoreColumn(Cursor, ColumnStarts[Column], ColumnSizes[Column], Column);
+                }
+            }
+            Loaded = !Cursor->Error;
+        }
+    }
+
+    if(!Loaded)
+    {
+        Cursor->RowCount = 0;
+        Cursor->RowIndex = 0;
+    }
+
+    return Loaded;
+}
+
+static b32 BeginStoreQuery(pmc_store_cursor *Cursor, pmc_store_reader *Reader, pmc_store_query *Query)
+{
+    *Cursor = {};
+    Cursor->Reader = Reader;
+    Cursor->Query = *Query;
+    Cursor->BlockCapacity = PMC_STORE_MAX_BLOCK_SIZE;
+    Cursor->BlockData = (u8 *)malloc(Cursor->BlockCapacity);
+    Cursor->Rows = (pmc_store_row *)calloc(PMC_STORE_BLOCK_ROW_COUNT, sizeof(pmc_store_row));
+    Cursor->Error = (!Cursor->BlockData || !Cursor->Rows);
+    if(Cursor->Error)
+    {
+        EndStoreQuery(Cursor);
+    }
+
+    b32 Result = !Cursor->Error;
+    return Result;
+}
+
+static b32 NextStoreRow(pmc_store_cursor *Cursor, pmc_store_row *Row)
+{
+    b32 Result = false;
+    while(!Result && !Cursor->Error)
+    {
+        if(Cursor->RowIndex < Cursor->RowCount)
+        {
+            pmc_store_row *Candidate = Cursor->Rows + Cursor->RowIndex++;
+            if(RowMatches(Candidate, &Cursor->Query))
+            {
+                *Row = *Candidate;
+                Result = true;
+            }
+        }
+        else if(!LoadNextStoreBlock(Cursor))
+        {
+            break;
+        }
+    }
+
+    return Result;
+}
+
+static void EndStoreQuery(pmc_store_cursor *Cursor)
+{
+    free(Cursor->BlockData);
+    free(Cursor->Rows);
+    Cursor->BlockData = 0;
+    Cursor->Rows = 0;
+}
@@ -0,0 +1,143 @@
+/* ========================================================================
+
+   (C) Copyright 2024 by Molly Rocket, Inc., All Rights Reserved.
+
+   This software is provided 'as-is', without any express or implied
+   warranty. In no event will the authors be held liable for any damages
+   arising from the use of this software.
+
+   Please see https://computerenhance.com for more information
+
+   ======================================================================== */
+
+//
+// NOTE: Columnar results store
+//
+
+// NOTE: A store file holds completed regions in blocks of up to PMC_STORE_BLOCK_ROW_COUNT rows. Inside a block each
+// column (site, thread, CPU, start TSC, duration, context switches, then one per counter) is stored on its own as
+// LEB128 varints, with the start TSC delta-encoded, since consecutive results start close together. An index at the
+// end of the file records every block's offset along with its min/max site, thread and start TSC, so a query only
+// reads the blocks that can match. Like results files, stores only depend on pmctrace.h, so tools that read them
+// do not need ETW.
+
+#define PMC_STORE_FILE_MAGIC 0x53434d50 // NOTE: "PMCS"
+#define PMC_STORE_FILE_VERSION 1
+#define PMC_STORE_NAME_LENGTH 64
+#define PMC_STORE_BLOCK_ROW_COUNT 4096
+
+enum pmc_store_column : u32
+{
+    StoreColumn_SiteID,
+    StoreColumn_ThreadID,
+    StoreColumn_CPUIndex,
+    StoreColumn_StartTSC,
+    StoreColumn_TSCElapsed,
+    StoreColumn_ContextSwitchCount,
+    StoreColumn_FirstCounter,
+
+    StoreColumn_Count = StoreColumn_FirstCounter + MAX_TRACE_PMC_COUNT,
+};
+
+struct pmc_store_file_header
+{
+    u32 Magic;
+    u32 Version;
+    u32 PMCCount;
+    u32 BlockRowCount;
+    u64 RowCount;
+    u64 BlockCount;
+    u64 IndexOffset; // NOTE: The block index is written last, so this is 0 in a store that was never closed
+    char Names[MAX_TRACE_PMC_COUNT][PMC_STORE_NAME_LENGTH];
+};
+
+struct pmc_store_block_index
+{
+    u64 Offset;
+    u32 Size;
+    u32 RowCount;
+
+    u32 MinSiteID;
+    u32 MaxSiteID;
+    u32 MinThreadID;
+    u32 MaxThreadID;
+    u64 MinStartTSC;
+    u64 MaxStartTSC;
+};
+
+struct pmc_store_row
+{
+    u32 SiteID;
+    u32 ThreadID;
+    u32 CPUIndex;
+    u64 StartTSC;
+    u64 TSCElapsed;
+    u64 ContextSwitchCount;
+    u64 Counters[MAX_TRACE_PMC_COUNT];
+};
+
+struct pmc_store_writer
+{
+    FILE *File;
+    pmc_store_file_header Header;
+
+    pmc_store_block_index *Blocks;
+    u64 BlockCapacity;
+    u64 WriteOffset;
+
+    pmc_store_row *Rows; // NOTE: [PMC_STORE_BLOCK_ROW_COUNT]
+    u32 RowCount;
+    u8 *Scratch;
+
+    b32 Error;
+};
+
+// NOTE: Ranges are inclusive. DefaultStoreQuery matches every row.
+struct pmc_store_query
+{
+    u32 MinSiteID;
+    u32 MaxSiteID;
+    u32 MinThreadID;
+    u32 MaxThreadID;
+    u64 MinStartTSC;
+    u64 MaxStartTSC;
+};
+
+struct pmc_store_reader
+{
+    FILE *File;
+    pmc_store_file_header Header;
+    pmc_store_block_index *Blocks; // NOTE: [Header.BlockCount]
+};
+
+struct pmc_store_cursor
+{
+    pmc_store_reader *Reader;
+    pmc_store_query Query;
+
+    u64 NextBlockIndex;
+    u8 *BlockData;
+    u32 BlockCapacity;
+
+    pmc_store_row *Rows; // NOTE: [PMC_STORE_BLOCK_ROW_COUNT]
+    u32 RowCount;
+    u32 RowIndex;
+
+    u64 BlocksRead;
+    u64 BlocksSkipped;
+    b32 Error;
+};
+
+static b32 OpenStoreFile(pmc_store_writer *Writer, char const *FileName, pmc_name_array *Names, u32 PMCCount);
+static void StoreResult(pmc_store_writer *Writer, pmc_trace_result *Result);
+static b32 CloseStoreFile(pmc_store_writer *Writer);
+
+// NOTE: OpenStoreForQuery only reads the header and the block index. NextStoreRow then returns matching rows one
+// at a time, loading a block only when its index says it may contain a match, and returns false at the end (or on
+// a read error, which sets Cursor->Error).
+static b32 OpenStoreForQuery(pmc_store_reader *Reader, char const *FileName);
+static void CloseStoreForQuery(pmc_store_reader *Reader);
+static pmc_store_query DefaultStoreQuery(void);
+static b32 BeginStoreQuery(pmc_store_cursor *Cursor, pmc_store_reader *Reader, pmc_store_query *Query);
+static b32 NextStoreRow(pmc_store_cursor *Cursor, pmc_store_row *Row);
+static void EndStoreQuery(pmc_store_cursor *Cursor);
@@ -10,7 +10,20 @@
 ;
 ;  ========================================================================
 
+; NOTE: The kernels take their arguments in ARG0 and ARG1, so the same file assembles with either
+; nasm -f win64 or nasm -f elf64.
+%ifidn __OUTPUT_FORMAT__, elf64
+%define ARG0 rdi
+%define ARG1 rsi
+%else
+%define ARG0 rcx
+%define ARG1 rdx
+%endif
+
 global CountNonZeroesWithBranch
+global FixedBranches
+global PointerChase
+global SSEAdds
 
 section .text
 
@@ -19,7 +32,7 @@ CountNonZeroesWithBranch:
     xor r10, r10
 
 .loop:
-    mov al, [rdx + r10]
+    mov al, [ARG1 + r10]
 
     cmp al, 0
     jz .skipsum
@@ -27,6 +40,45 @@ CountNonZeroesWithBranch:
 .skipsum:
 
     inc r10
-    cmp r10, rcx
+    cmp r10, ARG0
     jb .loop
     ret
+
+; NOTE: 5 always-taken branches and 6 instructions per iteration
+FixedBranches:
+    mov rax, ARG0
+    align 64
+.loop:
+    jmp .a
+.a: jmp .b
+.b: jmp .c
+.c: jmp .d
+.d: dec rax
+    jnz .loop
+    ret
+
+; NOTE: One dependent load per iteration - ARG1 must point to a cycle of pointers
+PointerChase:
+    mov rax, ARG1
+    mov r10, ARG0
+    align 64
+.loop:
+    mov rax, [rax]
+    dec r10
+    jnz .loop
+    ret
+
+; NOTE: 1 branch and 6 instructions per iteration
+SSEAdds:
+    mov rax, ARG0
+    pxor xmm0, xmm0
+    pxor xmm1, xmm1
+    align 64
+.loop:
+    paddd xmm0, xmm1
+    paddd xmm0, xmm1
+    paddd xmm0, xmm1
+    paddd xmm0, xmm1
+    dec rax
+    jnz .loop
+    ret
@@ -15,15 +15,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <intrin.h>
 #include <windows.h>
 #include <psapi.h>
 #include <evntrace.h>
 #include <evntcons.h>
+#include <dbghelp.h>
 
 #pragma comment (lib, "advapi32.lib")
+#pragma comment (lib, "dbghelp.lib")
 
 typedef uint8_t u8;
+typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
 
@@ -36,21 +40,76 @@ typedef double f64;
 
 #include "pmctrace.h"
 #include "pmctrace.cpp"
+#include "pmctrace_results.h"
+#include "pmctrace_results.cpp"
+#include "pmctrace_export.h"
+#include "pmctrace_export.cpp"
+#include "pmctrace_store.h"
+#include "pmctrace_store.cpp"
 
 extern "C" void CountNonZeroesWithBranch(u64 Count, u8 *Data);
 #pragma comment (lib, "pmctrace_test_asm")
 
+struct logical_processor
+{
+    u16 Group;
+    u8 Number;
+    u8 SMTIndex;
+    u32 CoreIndex;
+    u32 L3Index;
+    u32 NodeIndex;
+};
+
+struct cpu_topology
+{
+    u32 ProcessorCount;
+    u32 CoreCount;
+    u32 L3Count;
+    u32 NodeCount;
+    logical_processor Processors[1024];
+};
+
+enum pin_policy
+{
+    PinPolicy_None,
+    PinPolicy_Core,
+    PinPolicy_SMT,
+    PinPolicy_L3,
+    PinPolicy_NUMA,
+
+    PinPolicy_Count,
+};
+
+enum memory_policy
+{
+    MemoryPolicy_Any,
+    MemoryPolicy_Local,
+    MemoryPolicy_Remote,
+
+    MemoryPolicy_Count,
+};
+
 struct thread_context
 {
     HANDLE ThreadHandle;
 
     pmc_tracer *Tracer;
+    u32 SiteID;
+
+    // NOTE: Placement is null when the scheduler is left to place the thread
+    logical_processor *Placement;
+    b32 UseMemoryNode;
+    u32 MemoryNode;
 
     u64 BufferCount;
     u64 NonZeroCount;
 
     pmc_trace_result BestResult;
 
+    // NOTE: Every result is kept so the run can be saved for pmctrace_compare
+    u32 SampleCount;
+    pmc_trace_result Samples[10*32];
+
     // NOTE(casey): The scratch space is in the thread_context rather than on the thread's stack
     // because if there is an error, the thread may exit before the tracer is finished writing back
     // results, which would lead to a crash - so the scratch targets must remain valid until after
@@ -58,6 +117,409 @@ struct thread_context
     pmc_traced_region ScratchResults[32];
 };
 
+struct hotspot
+{
+    u32 SiteID;
+    u32 SampleCount;
+    u64 SymbolAddress;
+    char SymbolName[64];
+};
+
+static int CompareHotspots(void const *A, void const *B)
+{
+    hotspot const *HotspotA = (hotspot const *)A;
+    hotspot const *HotspotB = (hotspot const *)B;
+
+    int Result = 0;
+    if(HotspotA->SiteID != HotspotB->SiteID)
+    {
+        Result = (HotspotA->SiteID < HotspotB->SiteID) ? -1 : 1;
+    }
+    else if(HotspotA->SampleCount != HotspotB->SampleCount)
+    {
+        Result = (HotspotA->SampleCount > HotspotB->SampleCount) ? -1 : 1;
+    }
+
+    return Result;
+}
+
+// NOTE: Must be a power of two. It is twice the most hotspots kept, so the table never gets more than half full.
+#define MAX_HOTSPOT_COUNT 4096
+#define HOTSPOT_TABLE_SIZE (2*MAX_HOTSPOT_COUNT)
+
+static hotspot *FindHotspot(hotspot *Hotspots, u32 *HotspotCount, u32 SiteID, u64 SymbolAddress)
+{
+    hotspot *Result = 0;
+
+    u32 Mask = HOTSPOT_TABLE_SIZE - 1;
+    u32 Slot = (u32)((SymbolAddress ^ ((u64)SiteID << 32))*11400714819323198485ull >> 32) & Mask;
+    for(u32 Probe = 0; Probe < HOTSPOT_TABLE_SIZE; ++Probe)
+    {
+        hotspot *Hotspot = Hotspots + ((Slot + Probe) & Mask);
+        if(!Hotspot->SampleCount)
+        {
+            // NOTE: Once the hotspot limit is reached, new symbols are dropped but known ones still count
+            if(*HotspotCount < MAX_HOTSPOT_COUNT)
+            {
+                ++*HotspotCount;
+                Hotspot->SiteID = SiteID;
+                Hotspot->SymbolAddress = SymbolAddress;
+                Result = Hotspot;
+            }
+            break;
+        }
+        else if((Hotspot->SiteID == SiteID) && (Hotspot->SymbolAddress == SymbolAddress))
+        {
+            Result = Hotspot;
+            break;
+        }
+    }
+
+    return Result;
+}
+
+static void PrintHotspots(pmc_tracer *Tracer, wchar_t const *SourceName)
+{
+    u32 MaxSampleCount = PMC_SAMPLE_QUEUE_SIZE;
+    pmc_ip_sample *Samples = (pmc_ip_sample *)VirtualAlloc(0, MaxSampleCount*sizeof(pmc_ip_sample), MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+    hotspot *Hotspots = (hotspot *)VirtualAlloc(0, HOTSPOT_TABLE_SIZE*sizeof(hotspot), MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+    u32 HotspotCount = 0;
+
+    HANDLE Process = GetCurrentProcess();
+    if(Samples && Hotspots && SymInitialize(Process, 0, TRUE))
+    {
+        // NOTE: Symbolization happens here, long after the run, so it costs the instrumented threads nothing
+        u32 SampleCount = DrainPMCSamples(Tracer, Samples, MaxSampleCount);
+
+        union
+        {
+            SYMBOL_INFO Symbol;
+            u8 Storage[sizeof(SYMBOL_INFO) + MAX_SYM_NAME];
+        } Info;
+
+        for(u32 SampleIndex = 0; SampleIndex < SampleCount; ++SampleIndex)
+        {
+            pmc_ip_sample *Sample = Samples + SampleIndex;
+
+            Info.Symbol = {};
+            Info.Symbol.SizeOfStruct = sizeof(SYMBOL_INFO);
+            Info.Symbol.MaxNameLen = MAX_SYM_NAME;
+
+            u64 Displacement = 0;
+            u64 SymbolAddress = Sample->InstructionPointer;
+            char const *SymbolName = "(unknown)";
+            if(SymFromAddr(Process, Sample->InstructionPointer, &Displacement, &Info.Symbol))
+            {
+                SymbolAddress = Info.Symbol.Address;
+                SymbolName = Info.Symbol.Name;
+            }
+
+            hotspot *Hotspot = FindHotspot(Hotspots, &HotspotCount, Sample->SiteID, SymbolAddress);
+            if(Hotspot)
+            {
+                if(!Hotspot->SampleCount)
+                {
+                    snprintf(Hotspot->SymbolName, sizeof(Hotspot->SymbolName), "%s", SymbolName);
+                }
+                ++Hotspot->SampleCount;
+            }
+        }
+
+        // NOTE: Pack the used slots to the front of the table so only they are sorted and printed
+        u32 PackedCount = 0;
+        for(u32 SlotIndex = 0; SlotIndex < HOTSPOT_TABLE_SIZE; ++SlotIndex)
+        {
+            if(Hotspots[SlotIndex].SampleCount)
+            {
+                Hotspots[PackedCount++] = Hotspots[SlotIndex];
+            }
+        }
+        qsort(Hotspots, HotspotCount, sizeof(hotspot), CompareHotspots);
+
+        printf("\nHOTSPOTS - %u %S samples (%llu dropped):\n", SampleCount, SourceName, GetDroppedPMCSampleCount(Tracer));
+        for(u32 HotspotIndex = 0; HotspotIndex < HotspotCount; ++HotspotIndex)
+        {
+            hotspot *Hotspot = Hotspots + HotspotIndex;
+            printf("  site %2u: %6u %s\n", Hotspot->SiteID, Hotspot->SampleCount, Hotspot->SymbolName);
+        }
+
+        SymCleanup(Process);
+    }
+    else
+    {
+        printf("ERROR: Unable to symbolize samples\n");
+    }
+
+    VirtualFree(Hotspots, 0, MEM_RELEASE);
+    VirtualFree(Samples, 0, MEM_RELEASE);
+}
+
+static logical_processor *FindOrAddProcessor(cpu_topology *Topology, u16 Group, u8 Number)
+{
+    logical_processor *Result = 0;
+    for(u32 ProcessorIndex = 0; ProcessorIndex < Topology->ProcessorCount; ++ProcessorIndex)
+    {
+        logical_processor *Processor = Topology->Processors + ProcessorIndex;
+        if((Processor->Group == Group) && (Processor->Number == Number))
+        {
+            Result = Processor;
+            break;
+        }
+    }
+
+    if(!Result && (Topology->ProcessorCount < ArrayCount(Topology->Processors)))
+    {
+        Result = Topology->Processors + Topology->ProcessorCount++;
+        *Result = {};
+        Result->Group = Group;
+        Result->Number = Number;
+    }
+
+    return Result;
+}
+
+static u32 GetRelationGroupCount(WORD GroupCount)
+{
+    // NOTE: Since Windows 11, caches and nodes have one mask per processor group they span. Before that GroupCount
+    // is always zero and only GroupMask (the first of GroupMasks) is filled in, so there is exactly one.
+    u32 Result = GroupCount ? GroupCount : 1;
+    return Result;
+}
+
+static b32 EnumerateTopology(cpu_topology *Topology)
+{
+    *Topology = {};
+
+    DWORD BufferSize = 0;
+    GetLogicalProcessorInformationEx(RelationAll, 0, &BufferSize);
+    u8 *Buffer = (u8 *)VirtualAlloc(0, BufferSize, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+    if(Buffer && GetLogicalProcessorInformationEx(RelationAll, (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *)Buffer, &BufferSize))
+    {
+        // NOTE: Cores are listed before caches and nodes, so processors end up in core order with
+        // SMT siblings adjacent to each other
+        for(u32 Pass = 0; Pass < 2; ++Pass)
+        {
+            for(DWORD Offset = 0; Offset < BufferSize;)
+            {
+                SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *Info = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *)(Buffer + Offset);
+                if((Pass == 0) && (Info->Relationship == RelationProcessorCore))
+                {
+                    u8 SMTIndex = 0;
+                    for(u32 GroupIndex = 0; GroupIndex < Info->Processor.GroupCount; ++GroupIndex)
+                    {
+                        GROUP_AFFINITY *Mask = &Info->Processor.GroupMask[GroupIndex];
+                        for(u32 Bit = 0; Bit < 64; ++Bit)
+                        {
+                            if(Mask->Mask & ((KAFFINITY)1 << Bit))
+                            {
+                                logical_processor *Processor = FindOrAddProcessor(Topology, Mask->Group, (u8)Bit);
+                                if(Processor)
+                                {
+                                    Processor->CoreIndex = Topology->CoreCount;
+                                    Processor->SMTIndex = SMTIndex++;
+                                }
+                            }
+                        }
+                    }
+                    ++Topology->CoreCount;
+                }
+                else if((Pass == 1) && (Info->Relationship == RelationCache) && (Info->Cache.Level == 3))
+                {
+                    for(u32 GroupIndex = 0; GroupIndex < GetRelationGroupCount(Info->Cache.GroupCount); ++GroupIndex)
+                    {
+                        GROUP_AFFINITY *Mask = &Info->Cache.GroupMasks[GroupIndex];
+                        for(u32 Bit = 0; Bit < 64; ++Bit)
+                        {
+                            if(Mask->Mask & ((KAFFINITY)1 << Bit))
+                            {
+                                logical_processor *Processor = FindOrAddProcessor(Topology, Mask->Group, (u8)Bit);
+                                if(Processor)
+                                {
+                                    Processor->L3Index = Topology->L3Count;
+                                }
+                            }
+                        }
+                    }
+                    ++Topology->L3Count;
+                }
+                else if((Pass == 1) && (Info->Relationship == RelationNumaNode))
+                {
+                    for(u32 GroupIndex = 0; GroupIndex < GetRelationGroupCount(Info->NumaNode.GroupCount); ++GroupIndex)
+                    {
+                        GROUP_AFFINITY *Mask = &Info->NumaNode.GroupMasks[GroupIndex];
+                        for(u32 Bit = 0; Bit < 64; ++Bit)
+                        {
+                            if(Mask->Mask & ((KAFFINITY)1 << Bit))
+                            {
+                                logical_processor *Processor = FindOrAddProcessor(Topology, Mask->Group, (u8)Bit);
+                                if(Processor)
+                                {
+                                    Processor->NodeIndex = Info->NumaNode.NodeNumber;
+                                }
+                            }
+                        }
+                    }
+
+                    if(Topology->NodeCount <= Info->NumaNode.NodeNumber)
+                    {
+                        Topology->NodeCount = Info->NumaNode.NodeNumber + 1;
+                    }
+                }
+
+                Offset += Info->Size;
+            }
+        }
+    }
+
+    if(Buffer)
+    {
+        VirtualFree(Buffer, 0, MEM_RELEASE);
+    }
+
+    return (Topology->ProcessorCount != 0);
+}
+
+static u32 BuildPlacement(cpu_topology *Topology, pin_policy Policy, logical_processor **Order, u32 MaxOrderCount)
+{
+    u32 OrderCount = 0;
+    switch(Policy)
+    {
+        case PinPolicy_Core:
+        {
+            // NOTE: One thread per physical core, leaving every SMT sibling idle
+            for(u32 ProcessorIndex = 0; ProcessorIndex < Topology->ProcessorCount; ++ProcessorIndex)
+            {
+                logical_processor *Processor = Topology->Processors + ProcessorIndex;
+                if((Processor->SMTIndex == 0) && (OrderCount < MaxOrderCount))
+                {
+                    Order[OrderCount++] = Processor;
+                }
+            }
+        } break;
+
+        case PinPolicy_SMT:
+        {
+            // NOTE: Fill both siblings of a core before moving to the next core
+            for(u32 ProcessorIndex = 0; (ProcessorIndex < Topology->ProcessorCount) && (OrderCount < MaxOrderCount); ++ProcessorIndex)
+            {
+                Order[OrderCount++] = Topology->Processors + ProcessorIndex;
+            }
+        } break;
+
+        case PinPolicy_L3:
+        {
+            // NOTE: Keep every thread inside the first L3 (CCX or die), using its physical cores first
+            for(u32 SMTIndex = 0; SMTIndex < 2; ++SMTIndex)
+            {
+                for(u32 ProcessorIndex = 0; ProcessorIndex < Topology->ProcessorCount; ++ProcessorIndex)
+                {
+                    logical_processor *Processor = Topology->Processors + ProcessorIndex;
+                    if((Processor->L3Index == 0) && ((SMTIndex ? (Processor->SMTIndex != 0) : (Processor->SMTIndex == 0))) &&
+                       (OrderCount < MaxOrderCount))
+                    {
+                        Order[OrderCount++] = Processor;
+                    }
+                }
+            }
+        } break;
+
+        case PinPolicy_NUMA:
+        {
+            // NOTE: Round-robin across NUMA nodes, one physical core at a time
+            for(u32 Round = 0;; ++Round)
+            {
+                u32 AddedCount = 0;
+                for(u32 NodeIndex = 0; NodeIndex < Topology->NodeCount; ++NodeIndex)
+                {
+                    u32 CoreInNode = 0;
+                    for(u32 ProcessorIndex = 0; ProcessorIndex < Topology->ProcessorCount; ++ProcessorIndex)
+                    {
+                        logical_processor *Processor = Topology->Processors + ProcessorIndex;
+                        if((Processor->NodeIndex == NodeIndex) && (Processor->SMTIndex == 0))
+                        {
+                            if((CoreInNode++ == Round) && (OrderCount < MaxOrderCount))
+                            {
+                                Order[OrderCount++] = Processor;
+                                ++AddedCount;
+                            }
+                        }
+                    }
+                }
+
+                if(AddedCount == 0)
+                {
+                    break;
+                }
+            }
+        } break;
+
+        default: {} break;
+    }
+
+    return OrderCount;
+}
+
+static void PrintMemoryNode(thread_context *Thread)
+{
+    if(Thread->UseMemoryNode)
+    {
+        printf("node %u", Thread->MemoryNode);
+    }
+    else
+    {
+        printf("any node");
+    }
+}
+
+static void PrintTopologyGroups(thread_context *Threads, u32 ThreadCount, pmc_name_array *Names)
+{
+    // NOTE: Threads are grouped by the NUMA node and L3 they ran on plus the node their memory came from,
+    // and each group reports its mean per-iteration counters so placements can be compared directly
+    b32 Printed[64] = {};
+    printf("\nBY TOPOLOGY (per iteration):\n");
+    for(u32 FirstIndex = 0; (FirstIndex < ThreadCount) && (FirstIndex < ArrayCount(Printed)); ++FirstIndex)
+    {
+        thread_context *First = Threads + FirstIndex;
+        if(!Printed[FirstIndex] && First->Placement)
+        {
+            u32 GroupCount = 0;
+            f64 TSCSum = 0;
+            f64 CounterSums[MAX_TRACE_PMC_COUNT] = {};
+            u32 PMCCount = First->BestResult.PMCCount;
+
+            for(u32 ThreadIndex = FirstIndex; (ThreadIndex < ThreadCount) && (ThreadIndex < ArrayCount(Printed)); ++ThreadIndex)
+            {
+                thread_context *Thread = Threads + ThreadIndex;
+                if(Thread->Placement &&
+                   (Thread->Placement->NodeIndex == First->Placement->NodeIndex) &&
+                   (Thread->Placement->L3Index == First->Placement->L3Index) &&
+                   (Thread->UseMemoryNode == First->UseMemoryNode) &&
+                   (Thread->MemoryNode == First->MemoryNode))
+                {
+                    Printed[ThreadIndex] = true;
+                    ++GroupCount;
+
+                    f64 Iterations = (f64)Thread->BufferCount;
+                    TSCSum += (f64)Thread->BestResult.TSCElapsed / Iterations;
+                    for(u32 CI = 0; CI < PMCCount; ++CI)
+                    {
+                        CounterSums[CI] += (f64)Thread->BestResult.Counters[CI] / Iterations;
+                    }
+                }
+            }
+
+            printf("  node %u, L3 %u, memory on ", First->Placement->NodeIndex, First->Placement->L3Index);
+            PrintMemoryNode(First);
+            printf(" - %u thread%s:\n", GroupCount, (GroupCount != 1) ? "s" : "");
+            printf("    %.4f TSC\n", TSCSum / GroupCount);
+            for(u32 CI = 0; CI < PMCCount; ++CI)
+            {
+                printf("    %.4f %S\n", CounterSums[CI] / GroupCount, Names->Strings[CI]);
+            }
+        }
+    }
+}
+
 static DWORD CALLBACK TestThread(void *Arg)
 {
     thread_context *Context = (thread_context *)Arg;
@@ -66,7 +528,16 @@ static DWORD CALLBACK TestThread(void *Arg)
     u64 BufferCount = Context->BufferCount;
     u64 NonZeroCount = Context->NonZeroCount;
 
-    u8 *BufferData = (u8 *)VirtualAlloc(0, BufferCount, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+    u8 *BufferData = 0;
+    if(Context->UseMemoryNode)
+    {
+        BufferData = (u8 *)VirtualAllocExNuma(GetCurrentProcess(), 0, BufferCount, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE, Context->MemoryNode);
+    }
+    else
+    {
+        BufferData = (u8 *)VirtualAlloc(0, BufferCount, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+    }
+
     if(BufferData)
     {
         for(u64 Index = 0; Index < NonZeroCount; ++Index)
@@ -83,7 +554,7 @@ static DWORD CALLBACK TestThread(void *Arg)
             for(u32 BatchIndex = 0; NoErrors(Tracer) && (BatchIndex < BatchSize); ++BatchIndex)
             {
                 pmc_traced_region *TracedThread = &Context->ScratchResults[BatchIndex];
-                StartCountingPMCs(Tracer, TracedThread);
+                StartCountingPMCs(Tracer, TracedThread, Context->SiteID);
                 CountNonZeroesWithBranch(BufferCount, BufferData);
                 StopCountingPMCs(Tracer, TracedThread);
             }
@@ -91,9 +562,17 @@ static DWORD CALLBACK TestThread(void *Arg)
             for(u32 BatchIndex = 0; BatchIndex < BatchSize; ++BatchIndex)
             {
                 pmc_trace_result Result = GetOrWaitForResult(Tracer, &Context->ScratchResults[BatchIndex]);
-                if(NoErrors(Tracer) && (Context->BestResult.TSCElapsed > Result.TSCElapsed))
+                if(NoErrors(Tracer))
                 {
-                    Context->BestResult = Result;
+                    if(Context->BestResult.TSCElapsed > Result.TSCElapsed)
+                    {
+                        Context->BestResult = Result;
+                    }
+
+                    if(Context->SampleCount < ArrayCount(Context->Samples))
+                    {
+                        Context->Samples[Context->SampleCount++] = Result;
+                    }
                 }
             }
         }
@@ -106,8 +585,85 @@ static DWORD CALLBACK TestThread(void *Arg)
     return 0;
 }
 
-int main(void)
+int main(int ArgCount, char **Args)
 {
+    // NOTE: Optionally save every result, tagged by thread index as the SiteID, for pmctrace_compare, and
+    // optionally take instruction pointer samples on a named PMC (for example -sample BranchMispredictions).
+    // -pin none|core|smt|l3|numa places each thread on the topology, and -mem any|local|remote picks
+    // which NUMA node its buffer comes from relative to the node it was pinned to. -export FileName rewrites
+    // per-thread OpenMetrics aggregates to FileName every second while the run is going, and -store FileName
+    // writes every result to a columnar store for pmctrace_query.
+    char const *ResultsFileName = 0;
+    char const *ExportFileName = 0;
+    char const *StoreFileName = 0;
+    wchar_t SampleSourceName[64] = {};
+    char const *PinPolicyNames[PinPolicy_Count] = {"none", "core", "smt", "l3", "numa"};
+    char const *MemoryPolicyNames[MemoryPolicy_Count] = {"any", "local", "remote"};
+    pin_policy PinPolicy = PinPolicy_None;
+    memory_policy MemoryPolicy = MemoryPolicy_Any;
+    b32 UsageError = false;
+    for(int ArgIndex = 1; !UsageError && (ArgIndex < ArgCount); ++ArgIndex)
+    {
+        if((strcmp(Args[ArgIndex], "-pin") == 0) && ((ArgIndex + 1) < ArgCount))
+        {
+            char const *Name = Args[++ArgIndex];
+            PinPolicy = PinPolicy_Count;
+            for(u32 PolicyIndex = 0; PolicyIndex < PinPolicy_Count; ++PolicyIndex)
+            {
+                if(strcmp(Name, PinPolicyNames[PolicyIndex]) == 0)
+                {
+                    PinPolicy = (pin_policy)PolicyIndex;
+                }
+            }
+            UsageError = (PinPolicy == PinPolicy_Count);
+        }
+        else if((strcmp(Args[ArgIndex], "-mem") == 0) && ((ArgIndex + 1) < ArgCount))
+        {
+            char const *Name = Args[++ArgIndex];
+            MemoryPolicy = MemoryPolicy_Count;
+            for(u32 PolicyIndex = 0; PolicyIndex < MemoryPolicy_Count; ++PolicyIndex)
+            {
+                if(strcmp(Name, MemoryPolicyNames[PolicyIndex]) == 0)
+                {
+                    MemoryPolicy = (memory_policy)PolicyIndex;
+                }
+            }
+            UsageError = (MemoryPolicy == MemoryPolicy_Count);
+        }
+        else if((strcmp(Args[ArgIndex], "-export") == 0) && ((ArgIndex + 1) < ArgCount))
+        {
+            ExportFileName = Args[++ArgIndex];
+        }
+        else if((strcmp(Args[ArgIndex], "-store") == 0) && ((ArgIndex + 1) < ArgCount))
+        {
+            StoreFileName = Args[++ArgIndex];
+        }
+        else if((strcmp(Args[ArgIndex], "-sample") == 0) && ((ArgIndex + 1) < ArgCount))
+        {
+            char const *Name = Args[++ArgIndex];
+            for(u32 CharIndex = 0; Name[CharIndex] && (CharIndex < (ArrayCount(SampleSourceName) - 1)); ++CharIndex)
+            {
+                SampleSourceName[CharIndex] = Name[CharIndex];
+            }
+        }
+        else if(!ResultsFileName && (Args[ArgIndex][0] != '-'))
+        {
+            ResultsFileName = Args[ArgIndex];
+        }
+        else
+        {
+            // NOTE: A mistyped option must not be taken as the results file name, which would overwrite that file
+            UsageError = true;
+        }
+    }
+
+    if(UsageError)
+    {
+        fprintf(stderr, "USAGE: %s [-pin none|core|smt|l3|numa] [-mem any|local|remote] [-sample PMCName] "
+                "[-export FileName] [-store FileName] [results]\n", Args[0]);
+        return 2;
+    }
+
     printf("Looking for PMC names...\n");
     pmc_name_array SharedNameArray =
     {
@@ -123,25 +679,112 @@ int main(void)
         pmc_tracer Tracer;
 
         printf("Starting trace...\n");
-        StartTracing(&Tracer, &PMCMapping);
+        if(SampleSourceName[0])
+        {
+            pmc_sampling_mapping Sampling = MapPMCSamplingSource(SampleSourceName, 100000);
+            StartTracing(&Tracer, &PMCMapping, &Sampling);
+        }
+        else
+        {
+            StartTracing(&Tracer, &PMCMapping);
+        }
+
+        pmc_exporter Exporter = {};
+        if(ExportFileName && !StartPMCExporter(&Exporter, &Tracer, UsedNames, ExportFileName, 1000))
+        {
+            printf("WARNING: Unable to start exporting to %s\n", ExportFileName);
+        }
 
-        thread_context Threads[16] = {};
+        // NOTE: Thread contexts are static because they keep every sample, which is too much for the stack
+        static thread_context Threads[16] = {};
         HANDLE ThreadHandles[ArrayCount(Threads)] = {};
 
+        static cpu_topology Topology;
+        logical_processor *Placement[ArrayCount(Threads)] = {};
+        u32 PlacementCount = 0;
+        if(PinPolicy != PinPolicy_None)
+        {
+            if(EnumerateTopology(&Topology))
+            {
+                PlacementCount = BuildPlacement(&Topology, PinPolicy, Placement, ArrayCount(Placement));
+                printf("Pinning by %s: %u processors, %u cores, %u L3s, %u NUMA nodes\n", PinPolicyNames[PinPolicy],
+                       Topology.ProcessorCount, Topology.CoreCount, Topology.L3Count, Topology.NodeCount);
+                if((MemoryPolicy == MemoryPolicy_Remote) && (Topology.NodeCount < 2))
+                {
+                    printf("WARNING: Only one NUMA node - remote memory is the same as local\n");
+                }
+                if(PlacementCount && (PlacementCount < ArrayCount(Threads)))
+                {
+                    // NOTE: Threads that share a CPU also share its counters' time, so their results are not
+                    // comparable with those of threads that had a CPU to themselves
+                    printf("WARNING: Pinning by %s has only %u CPUs for %u threads - some threads will share a CPU\n",
+                           PinPolicyNames[PinPolicy], PlacementCount, (u32)ArrayCount(Threads));
+                }
+            }
+            else
+            {
+                printf("WARNING: Unable to enumerate CPU topology - threads will not be pinned\n");
+            }
+        }
+
         printf("Launching threads...\n");
         for(u32 ThreadIndex = 0; ThreadIndex < ArrayCount(ThreadHandles); ++ThreadIndex)
         {
             thread_context *Thread = Threads + ThreadIndex;
             Thread->Tracer = &Tracer;
+            Thread->SiteID = ThreadIndex;
             Thread->BufferCount = 64*1024*1024;
             Thread->NonZeroCount = ThreadIndex*8192;
 
-            ThreadHandles[ThreadIndex] = CreateThread(0, 0, TestThread, Thread, 0, 0);
+            if(PlacementCount)
+            {
+                // NOTE: Pinned threads all run the same workload, so differences between them come
+                // from placement alone. Policies with fewer slots than threads wrap around.
+                Thread->Placement = Placement[ThreadIndex % PlacementCount];
+                Thread->NonZeroCount = 8*8192;
+
+                if(MemoryPolicy != MemoryPolicy_Any)
+                {
+                    Thread->UseMemoryNode = true;
+                    Thread->MemoryNode = Thread->Placement->NodeIndex;
+                    if((MemoryPolicy == MemoryPolicy_Remote) && Topology.NodeCount)
+                    {
+                        Thread->MemoryNode = (Thread->MemoryNode + 1) % Topology.NodeCount;
+                    }
+                }
+            }
+
+            ThreadHandles[ThreadIndex] = CreateThread(0, 0, TestThread, Thread, CREATE_SUSPENDED, 0);
+            if(ThreadHandles[ThreadIndex])
+            {
+                if(Thread->Placement)
+                {
+                    GROUP_AFFINITY Affinity = {};
+                    Affinity.Mask = (KAFFINITY)1 << Thread->Placement->Number;
+                    Affinity.Group = Thread->Placement->Group;
+                    if(!SetThreadGroupAffinity(ThreadHandles[ThreadIndex], &Affinity, 0))
+                    {
+                        printf("WARNING: Unable to pin thread %u\n", ThreadIndex);
+                    }
+                }
+
+                ResumeThread(ThreadHandles[ThreadIndex]);
+            }
         }
 
         printf("Waiting for threads to complete...\n");
         WaitForMultipleObjects(ArrayCount(Threads), ThreadHandles, TRUE, INFINITE);
 
+        if(Exporter.Thread)
+        {
+            StopPMCExporter(&Exporter);
+
+            pmc_exporter_stats ExportStats = GetPMCExporterStats(&Exporter);
+            printf("Exported %llu snapshots to %s (%llu failed) using %.3f CPU seconds and %llu bytes\n",
+                   ExportStats.SnapshotCount, ExportFileName, ExportStats.FailedWriteCount,
+                   ExportStats.CPUSeconds, ExportStats.MemoryBytes);
+        }
+
         if(NoErrors(&Tracer))
         {
             for(u32 ThreadIndex = 0; ThreadIndex < ArrayCount(ThreadHandles); ++ThreadIndex)
@@ -153,11 +796,87 @@ int main(void)
                 printf("  %llu TSC elapsed / %llu iterations [%llu switch%s]\n",
                        BestResult.TSCElapsed, Thread->BufferCount, BestResult.ContextSwitchCount,
                        (BestResult.ContextSwitchCount != 1) ? "es" : "");
+                if(Thread->Placement)
+                {
+                    logical_processor *Processor = Thread->Placement;
+                    printf("  on CPU %u:%u (core %u, SMT %u, L3 %u, node %u), memory on ",
+                           Processor->Group, Processor->Number, Processor->CoreIndex, Processor->SMTIndex,
+                           Processor->L3Index, Processor->NodeIndex);
+                    PrintMemoryNode(Thread);
+                    printf("\n");
+                }
                 for(u32 CI = 0; CI < BestResult.PMCCount; ++CI)
                 {
                     printf("  %llu %S\n", BestResult.Counters[CI], UsedNames->Strings[CI]);
                 }
             }
+
+            if(PlacementCount)
+            {
+                PrintTopologyGroups(Threads, ArrayCount(Threads), UsedNames);
+            }
+
+            if(ResultsFileName)
+            {
+                pmc_results_writer Writer;
+                OpenResultsFile(&Writer, ResultsFileName, UsedNames, PMCMapping.PMCCount);
+                for(u32 ThreadIndex = 0; ThreadIndex < ArrayCount(Threads); ++ThreadIndex)
+                {
+                    thread_context *Thread = Threads + ThreadIndex;
+                    for(u32 SampleIndex = 0; SampleIndex < Thread->SampleCount; ++SampleIndex)
+                    {
+                        WriteResult(&Writer, &Thread->Samples[SampleIndex]);
+                    }
+                }
+
+                if(CloseResultsFile(&Writer))
+                {
+                    printf("\nSaved results to %s\n", ResultsFileName);
+                }
+                else
+                {
+                    printf("\nERROR: Unable to save results to %s\n", ResultsFileName);
+                }
+            }
+
+            if(StoreFileName)
+            {
+                pmc_store_writer Writer;
+                OpenStoreFile(&Writer, StoreFileName, UsedNames, PMCMapping.PMCCount);
+                for(u32 ThreadIndex = 0; ThreadIndex < ArrayCount(Threads); ++ThreadIndex)
+                {
+                    thread_context *Thread = Threads + ThreadIndex;
+                    for(u32 SampleIndex = 0; SampleIndex < Thread->SampleCount; ++SampleIndex)
+                    {
+                        StoreResult(&Writer, &Thread->Samples[SampleIndex]);
+                    }
+                }
+
+                if(CloseStoreFile(&Writer))
+                {
+                    printf("\nStored results in %s\n", StoreFileName);
+                }
+                else
+                {
+                    printf("\nERROR: Unable to store results in %s\n", StoreFileName);
+                }
+            }
+
+            if(SampleSourceName[0])
+            {
+                PrintHotspots(&Tracer, SampleSourceName);
+            }
+
+            pmc_tracer_stats Stats = GetTracerStats(&Tracer);
+            char const *KindNames[TracerEvent_Count] = {"markers", "context switches", "syscall enters", "syscall exits", "other"};
+
+            printf("\nTRACER - %.2f seconds, max lag %llu TSC:\n", Stats.ElapsedSeconds, Stats.MaxLagTSC);
+            for(u32 KindIndex = 0; KindIndex < TracerEvent_Count; ++KindIndex)
+            {
+                pmc_tracer_event_kind_stats *Kind = &Stats.Kinds[KindIndex];
+                printf("  %llu %s (%.0f/s, %llu TSC/event)\n", Kind->EventCount, KindNames[KindIndex], Kind->EventsPerSecond,
+                       Kind->EventCount ? (Kind->CallbackTSC / Kind->EventCount) : 0);
+            }
         }
         else
         {
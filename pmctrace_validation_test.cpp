@@ -0,0 +1,415 @@
+/* ========================================================================
+
+   (C) Copyright 2024 by Molly Rocket, Inc., All Rights Reserved.
+
+   This software is provided 'as-is', without any express or implied
+   warranty. In no event will the authors be held liable for any damages
+   arising from the use of this software.
+
+   Please see https://computerenhance.com for more information
+
+   ======================================================================== */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <intrin.h>
+#include <windows.h>
+#include <psapi.h>
+#include <evntrace.h>
+#include <evntcons.h>
+
+#pragma comment (lib, "advapi32.lib")
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+typedef int32_t b32;
+
+typedef float f32;
+typedef double f64;
+
+#define ArrayCount(Array) (sizeof(Array)/sizeof((Array)[0]))
+
+#include "pmctrace.h"
+#include "pmctrace.cpp"
+
+extern "C" void CountNonZeroesWithBranch(u64 Count, u8 *Data);
+extern "C" void FixedBranches(u64 Count);
+extern "C" void PointerChase(u64 Count, void *Start);
+extern "C" void SSEAdds(u64 Count);
+#pragma comment (lib, "pmctrace_test_asm")
+
+// NOTE: Every kernel in pmctrace_test_asm.asm has a known per-iteration instruction and branch count,
+// so each counter can be checked against an expected range. The iteration counts are large enough that
+// the region's own marker overhead is well under the tolerances below.
+
+enum validation_kernel
+{
+    Kernel_FixedBranches,
+    Kernel_PredictableBranches,
+    Kernel_RandomBranches,
+    Kernel_ChaseL1,
+    Kernel_ChaseL2,
+    Kernel_ChaseL3,
+    Kernel_ChaseDRAM,
+    Kernel_SSEAdds,
+
+    Kernel_Count,
+};
+
+struct validation_kernel_info
+{
+    char const *Name;
+    u64 IterationCount;
+    u64 BufferSize;
+};
+
+static validation_kernel_info const KernelInfo[Kernel_Count] =
+{
+    {"FixedBranches", 1024*1024, 0},
+    {"PredictableBranches", 1024*1024, 1024*1024},
+    {"RandomBranches", 1024*1024, 1024*1024},
+    {"ChaseL1", 1024*1024, 16*1024},
+    {"ChaseL2", 1024*1024, 256*1024},
+    {"ChaseL3", 1024*1024, 4*1024*1024},
+    {"ChaseDRAM", 1024*1024, 256*1024*1024},
+    {"SSEAdds", 1024*1024, 0},
+};
+
+struct validation_check
+{
+    validation_kernel Kernel;
+    wchar_t const *PMCName;
+    f64 MinPerIteration;
+    f64 MaxPerIteration;
+};
+
+// NOTE: TotalIssues and InstructionRetired are both treated as retired instructions. RandomBranches
+// executes its conditional increment on half the iterations, hence 6.5 instructions. The pointer
+// chases visit cache lines in a random cycle, so every load past L1 should miss the L1 data cache.
+static validation_check const Checks[] =
+{
+    {Kernel_FixedBranches, L"TotalIssues", 5.9, 6.1},
+    {Kernel_FixedBranches, L"InstructionRetired", 5.9, 6.1},
+    {Kernel_FixedBranches, L"BranchInstructions", 4.95, 5.05},
+    {Kernel_FixedBranches, L"BranchMispredictions", 0.0, 0.01},
+
+    {Kernel_PredictableBranches, L"TotalIssues", 5.9, 6.1},
+    {Kernel_PredictableBranches, L"InstructionRetired", 5.9, 6.1},
+    {Kernel_PredictableBranches, L"BranchInstructions", 1.98, 2.02},
+    {Kernel_PredictableBranches, L"BranchMispredictions", 0.0, 0.01},
+
+    {Kernel_RandomBranches, L"TotalIssues", 6.4, 6.6},
+    {Kernel_RandomBranches, L"InstructionRetired", 6.4, 6.6},
+    {Kernel_RandomBranches, L"BranchInstructions", 1.98, 2.02},
+    {Kernel_RandomBranches, L"BranchMispredictions", 0.4, 0.6},
+
+    {Kernel_ChaseL1, L"TotalIssues", 2.9, 3.1},
+    {Kernel_ChaseL1, L"InstructionRetired", 2.9, 3.1},
+    {Kernel_ChaseL1, L"DcacheMisses", 0.0, 0.05},
+    {Kernel_ChaseL2, L"DcacheMisses", 0.8, 1.2},
+    {Kernel_ChaseL3, L"DcacheMisses", 0.8, 1.2},
+    {Kernel_ChaseDRAM, L"DcacheMisses", 0.8, 1.2},
+
+    {Kernel_SSEAdds, L"TotalIssues", 5.9, 6.1},
+    {Kernel_SSEAdds, L"InstructionRetired", 5.9, 6.1},
+    {Kernel_SSEAdds, L"BranchInstructions", 0.99, 1.01},
+    {Kernel_SSEAdds, L"BranchMispredictions", 0.0, 0.01},
+};
+
+// NOTE: How many counters are traced at once. Mapping more names than the CPU has counters for would
+// multiplex or fail, so larger sets are validated in several passes of at most this many counters each.
+#define VALIDATION_GROUP_SIZE 4
+
+static wchar_t const *CandidateNames[] =
+{
+    L"TotalIssues",
+    L"InstructionRetired",
+    L"BranchInstructions",
+    L"BranchMispredictions",
+    L"DcacheMisses",
+};
+
+static u64 XorShift64(u64 *State)
+{
+    u64 X = *State;
+    X ^= X << 13;
+    X ^= X >> 7;
+    X ^= X << 17;
+    *State = X;
+    return X;
+}
+
+static void FillRandomBits(u8 *Data, u64 Count, u64 *Random)
+{
+    for(u64 Index = 0; Index < Count; ++Index)
+    {
+        Data[Index] = (u8)(XorShift64(Random) & 1);
+    }
+}
+
+static void BuildPointerCycle(u8 *Data, u64 Size, u64 *Random)
+{
+    // NOTE: Link every cache line into one random cycle, so neither the prefetchers nor the
+    // branch predictor can anticipate the next address
+    u64 LineCount = Size / 64;
+    u64 *Order = (u64 *)VirtualAlloc(0, LineCount*sizeof(u64), MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+    if(Order)
+    {
+        for(u64 Index = 0; Index < LineCount; ++Index)
+        {
+            Order[Index] = Index;
+        }
+
+        for(u64 Index = LineCount - 1; Index > 0; --Index)
+        {
+            u64 Swap = XorShift64(Random) % (Index + 1);
+            u64 Temp = Order[Index];
+            Order[Index] = Order[Swap];
+            Order[Swap] = Temp;
+        }
+
+        for(u64 Index = 0; Index < LineCount; ++Index)
+        {
+            u8 *From = Data + 64*Order[Index];
+            u8 *To = Data + 64*Order[(Index + 1) % LineCount];
+            *(u8 **)From = To;
+        }
+
+        VirtualFree(Order, 0, MEM_RELEASE);
+    }
+}
+
+static void RunKernel(validation_kernel Kernel, u64 IterationCount, u8 *Data)
+{
+    switch(Kernel)
+    {
+        case Kernel_FixedBranches: {FixedBranches(IterationCount);} break;
+
+        case Kernel_PredictableBranches:
+        case Kernel_RandomBranches: {CountNonZeroesWithBranch(IterationCount, Data);} break;
+
+        case Kernel_ChaseL1:
+        case Kernel_ChaseL2:
+        case Kernel_ChaseL3:
+        case Kernel_ChaseDRAM: {PointerChase(IterationCount, Data);} break;
+
+        case Kernel_SSEAdds: {SSEAdds(IterationCount);} break;
+
+        default: {} break;
+    }
+}
+
+static b32 MeasureKernel(pmc_tracer *Tracer, validation_kernel Kernel, pmc_trace_result *Best)
+{
+    validation_kernel_info const *Info = &KernelInfo[Kernel];
+    u64 Random = 0x9E3779B97F4A7C15ull + Kernel;
+
+    u8 *Data = 0;
+    if(Info->BufferSize)
+    {
+        Data = (u8 *)VirtualAlloc(0, Info->BufferSize, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+        if(!Data)
+        {
+            printf("ERROR: Unable to allocate %llu bytes for %s\n", Info->BufferSize, Info->Name);
+            return false;
+        }
+
+        if(Kernel == Kernel_RandomBranches)
+        {
+            FillRandomBits(Data, Info->BufferSize, &Random);
+        }
+        else if(Kernel != Kernel_PredictableBranches)
+        {
+            BuildPointerCycle(Data, Info->BufferSize, &Random);
+        }
+    }
+
+    // NOTE: Warm the caches and the branch predictor once before measuring, then keep the fastest
+    // of several runs, the same way the threaded test reports its best result
+    RunKernel(Kernel, Info->IterationCount, Data);
+
+    pmc_traced_region Regions[8];
+    Best->TSCElapsed = (u64)-1ll;
+    for(u32 RunIndex = 0; NoErrors(Tracer) && (RunIndex < ArrayCount(Regions)); ++RunIndex)
+    {
+        StartCountingPMCs(Tracer, &Regions[RunIndex], Kernel);
+        RunKernel(Kernel, Info->IterationCount, Data);
+        StopCountingPMCs(Tracer, &Regions[RunIndex]);
+    }
+
+    for(u32 RunIndex = 0; NoErrors(Tracer) && (RunIndex < ArrayCount(Regions)); ++RunIndex)
+    {
+        pmc_trace_result Result = GetOrWaitForResult(Tracer, &Regions[RunIndex]);
+        if(NoErrors(Tracer) && (Best->TSCElapsed > Result.TSCElapsed))
+        {
+            *Best = Result;
+        }
+    }
+
+    if(Data)
+    {
+        VirtualFree(Data, 0, MEM_RELEASE);
+    }
+
+    return NoErrors(Tracer);
+}
+
+int main(void)
+{
+    // NOTE: Only counters this machine actually exposes are traced - checks on any other counter are
+    // reported as skipped rather than failed
+    pmc_name_array UsedNames = {};
+    u32 UsedCount = 0;
+    for(u32 CandidateIndex = 0; CandidateIndex < ArrayCount(CandidateNames); ++CandidateIndex)
+    {
+        pmc_name_array Probe = {};
+        Probe.Strings[0] = CandidateNames[CandidateIndex];
+        pmc_source_mapping ProbeMapping = MapPMCNames(&Probe);
+        if(IsValid(&ProbeMapping) && (UsedCount < ArrayCount(UsedNames.Strings)))
+        {
+            UsedNames.Strings[UsedCount++] = CandidateNames[CandidateIndex];
+        }
+    }
+
+    if(!UsedCount)
+    {
+        printf("ERROR: Unable to find any ETW PMCs to validate\n");
+        return 2;
+    }
+
+    printf("Validating:");
+    for(u32 NameIndex = 0; NameIndex < UsedCount; ++NameIndex)
+    {
+        printf(" %S", UsedNames.Strings[NameIndex]);
+    }
+    printf("\n");
+
+    // NOTE: Every pass runs all kernels with its own tracer, and the TSC per load comes from the first pass
+    static u64 Counts[Kernel_Count][ArrayCount(CandidateNames)];
+    u64 TSCElapsed[Kernel_Count] = {};
+    b32 Measured = true;
+    for(u32 GroupStart = 0; Measured && (GroupStart < UsedCount); GroupStart += VALIDATION_GROUP_SIZE)
+    {
+        u32 GroupCount = UsedCount - GroupStart;
+        if(GroupCount > VALIDATION_GROUP_SIZE)
+        {
+            GroupCount = VALIDATION_GROUP_SIZE;
+        }
+
+        pmc_name_array GroupNames = {};
+        for(u32 NameIndex = 0; NameIndex < GroupCount; ++NameIndex)
+        {
+            GroupNames.Strings[NameIndex] = UsedNames.Strings[GroupStart + NameIndex];
+        }
+
+        pmc_source_mapping PMCMapping = MapPMCNames(&GroupNames);
+        if(!IsValid(&PMCMapping))
+        {
+            printf("ERROR: Unable to map the PMC group starting with %S\n", GroupNames.Strings[0]);
+            Measured = false;
+            break;
+        }
+
+        pmc_tracer Tracer;
+        StartTracing(&Tracer, &PMCMapping);
+
+        pmc_trace_result Results[Kernel_Count] = {};
+        for(u32 Kernel = 0; NoErrors(&Tracer) && (Kernel < Kernel_Count); ++Kernel)
+        {
+            MeasureKernel(&Tracer, (validation_kernel)Kernel, &Results[Kernel]);
+        }
+
+        if(NoErrors(&Tracer))
+        {
+            for(u32 Kernel = 0; Kernel < Kernel_Count; ++Kernel)
+            {
+                for(u32 NameIndex = 0; NameIndex < GroupCount; ++NameIndex)
+                {
+                    Counts[Kernel][GroupStart + NameIndex] = Results[Kernel].Counters[NameIndex];
+                }
+
+                if(GroupStart == 0)
+                {
+                    TSCElapsed[Kernel] = Results[Kernel].TSCElapsed;
+                }
+            }
+        }
+        else
+        {
+            printf("ERROR: %s\n", GetErrorMessage(&Tracer));
+            Measured = false;
+        }
+
+        StopTracing(&Tracer);
+    }
+
+    int ExitCode = 0;
+    if(Measured)
+    {
+        u32 PassCount = 0;
+        u32 FailCount = 0;
+        u32 SkipCount = 0;
+
+        printf("\n%-20s %-22s %10s %21s\n", "Kernel", "Counter", "Per iter", "Expected");
+        for(u32 CheckIndex = 0; CheckIndex < ArrayCount(Checks); ++CheckIndex)
+        {
+            validation_check const *Check = &Checks[CheckIndex];
+            validation_kernel_info const *Info = &KernelInfo[Check->Kernel];
+
+            u32 CounterIndex = UsedCount;
+            for(u32 NameIndex = 0; NameIndex < UsedCount; ++NameIndex)
+            {
+                if(lstrcmpW(UsedNames.Strings[NameIndex], Check->PMCName) == 0)
+                {
+                    CounterIndex = NameIndex;
+                    break;
+                }
+            }
+
+            if(CounterIndex < UsedCount)
+            {
+                f64 PerIteration = (f64)Counts[Check->Kernel][CounterIndex] / (f64)Info->IterationCount;
+                b32 Passed = ((PerIteration >= Check->MinPerIteration) && (PerIteration <= Check->MaxPerIteration));
+                printf("%-20s %-22S %10.4f   [%8.4f, %8.4f] %s\n", Info->Name, Check->PMCName, PerIteration,
+                       Check->MinPerIteration, Check->MaxPerIteration, Passed ? "PASS" : "FAIL");
+                if(Passed)
+                {
+                    ++PassCount;
+                }
+                else
+                {
+                    ++FailCount;
+                }
+            }
+            else
+            {
+                ++SkipCount;
+            }
+        }
+
+        // NOTE: Latency per load is not checked against a range, since it varies widely between machines,
+        // but it should grow with each level of the hierarchy
+        printf("\nTSC per load:");
+        for(u32 Kernel = Kernel_ChaseL1; Kernel <= Kernel_ChaseDRAM; ++Kernel)
+        {
+            printf(" %s %.1f", KernelInfo[Kernel].Name,
+                   (f64)TSCElapsed[Kernel] / (f64)KernelInfo[Kernel].IterationCount);
+        }
+        printf("\n");
+
+        printf("\n%u passed, %u failed, %u skipped\n", PassCount, FailCount, SkipCount);
+        ExitCode = FailCount ? 1 : 0;
+    }
+    else
+    {
+        ExitCode = 2;
+    }
+
+    return ExitCode;
+}